@@ -0,0 +1,77 @@
+#pragma once
+
+#include <algorithm>
+#include <concepts>
+#include <limits>
+
+namespace RB_Tree::augment {
+
+// Besides subtree_size, every node of a Tree can carry the aggregate of its
+// subtree under a monoid chosen by a policy:
+//   value_type                      the aggregate
+//   identity()                      the aggregate of no keys
+//   combine(lhs, rhs)               lhs followed by rhs, associative
+//   lift(key)                       the aggregate of a single key
+// The aggregate is recomputed wherever subtree_size is, and
+// Tree::aggregate(lo, hi) folds the keys of [lo, hi] in key order.
+template <typename Policy, typename KeyTy>
+concept Monoid = requires(const typename Policy::value_type &value,
+                          const KeyTy &key) {
+  { Policy::identity() } -> std::convertible_to<typename Policy::value_type>;
+  {
+    Policy::combine(value, value)
+  } -> std::convertible_to<typename Policy::value_type>;
+  { Policy::lift(key) } -> std::convertible_to<typename Policy::value_type>;
+};
+
+// Only subtree_size: nodes keep their layout and nothing extra is done.
+struct None final {
+  struct value_type final {
+    bool operator==(const value_type &) const = default;
+  };
+
+  static value_type identity() { return {}; }
+  static value_type combine(value_type, value_type) { return {}; }
+  static value_type lift(const auto &) { return {}; }
+};
+
+template <typename ValueTy> struct Sum final {
+  using value_type = ValueTy;
+
+  static value_type identity() { return value_type{}; }
+  static value_type combine(const value_type &lhs, const value_type &rhs) {
+    return lhs + rhs;
+  }
+  static value_type lift(const auto &key) {
+    return static_cast<value_type>(key);
+  }
+};
+
+template <typename ValueTy> struct Min final {
+  using value_type = ValueTy;
+
+  static value_type identity() {
+    return std::numeric_limits<value_type>::max();
+  }
+  static value_type combine(const value_type &lhs, const value_type &rhs) {
+    return std::min(lhs, rhs);
+  }
+  static value_type lift(const auto &key) {
+    return static_cast<value_type>(key);
+  }
+};
+
+template <typename ValueTy> struct Max final {
+  using value_type = ValueTy;
+
+  static value_type identity() {
+    return std::numeric_limits<value_type>::lowest();
+  }
+  static value_type combine(const value_type &lhs, const value_type &rhs) {
+    return std::max(lhs, rhs);
+  }
+  static value_type lift(const auto &key) {
+    return static_cast<value_type>(key);
+  }
+};
+} // namespace RB_Tree::augment
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Binary form of the "k <key> q <first> <second> ..." command stream.
+//
+// A 32-byte header:
+//   0  "RQCS"
+//   4  version, u16           (VERSION)
+//   6  key size in bytes, u8  (4 or 8)
+//   7  flags, u8              (FLAG_DELTA)
+//   8  number of k commands, u64
+//   16 number of q commands, u64
+//   24 reserved, zero
+// followed by one opcode byte per command (OP_INSERT, OP_QUERY) and its
+// operands. Operands are signed little-endian integers of the key size or,
+// with FLAG_DELTA, zigzag LEB128 varints of the difference from the previous
+// operand in the stream. All header fields are little-endian.
+namespace BinaryFormat {
+
+inline constexpr char MAGIC[4] = {'R', 'Q', 'C', 'S'};
+inline constexpr std::uint16_t VERSION = 1;
+inline constexpr std::size_t HEADER_SIZE = 32;
+inline constexpr std::uint8_t FLAG_DELTA = 1;
+inline constexpr std::uint8_t OP_INSERT = 0;
+inline constexpr std::uint8_t OP_QUERY = 1;
+// Opcode and two 10-byte varints.
+inline constexpr std::size_t MAX_COMMAND_SIZE = 21;
+
+inline std::uint64_t readLE(const char *data, std::size_t size) {
+  std::uint64_t value = 0;
+  for (std::size_t byte = 0; byte < size; ++byte)
+    value |= std::uint64_t{static_cast<unsigned char>(data[byte])}
+             << (8 * byte);
+  return value;
+}
+
+inline void writeLE(std::vector<char> &out, std::uint64_t value,
+                    std::size_t size) {
+  for (std::size_t byte = 0; byte < size; ++byte)
+    out.push_back(static_cast<char>((value >> (8 * byte)) & 0xFF));
+}
+
+// Builds a binary stream in memory: the header needs the command counts.
+class Encoder final {
+  std::size_t key_size_;
+  bool delta_;
+  std::uint64_t inserts_ = 0, queries_ = 0;
+  std::int64_t previous_ = 0;
+  std::vector<char> body_;
+
+public:
+  explicit Encoder(std::size_t key_size = 4, bool delta = false)
+      : key_size_(key_size), delta_(delta) {
+    if (key_size != 4 && key_size != 8)
+      throw std::invalid_argument("key size must be 4 or 8 bytes");
+  }
+
+  void insert(std::int64_t key) {
+    ++inserts_;
+    body_.push_back(static_cast<char>(OP_INSERT));
+    operand(key);
+  }
+
+  void query(std::int64_t first, std::int64_t second) {
+    ++queries_;
+    body_.push_back(static_cast<char>(OP_QUERY));
+    operand(first);
+    operand(second);
+  }
+
+  std::vector<char> finish() const {
+    std::vector<char> out(MAGIC, MAGIC + sizeof(MAGIC));
+    writeLE(out, VERSION, 2);
+    writeLE(out, key_size_, 1);
+    writeLE(out, delta_ ? FLAG_DELTA : 0, 1);
+    writeLE(out, inserts_, 8);
+    writeLE(out, queries_, 8);
+    out.resize(HEADER_SIZE, 0);
+    out.insert(out.end(), body_.begin(), body_.end());
+    return out;
+  }
+
+private:
+  void operand(std::int64_t value) {
+    if (key_size_ == 4 && (value < INT32_MIN || value > INT32_MAX))
+      throw std::out_of_range("key " + std::to_string(value) +
+                              " does not fit in 4 bytes");
+
+    if (!delta_) {
+      writeLE(body_, static_cast<std::uint64_t>(value), key_size_);
+      return;
+    }
+
+    auto diff = static_cast<std::uint64_t>(value) -
+                static_cast<std::uint64_t>(previous_);
+    previous_ = value;
+    // zigzag: small differences of either sign become small numbers
+    std::uint64_t zigzag =
+        (diff << 1) ^ (static_cast<std::int64_t>(diff) < 0 ? ~0ULL : 0);
+    do {
+      auto byte = static_cast<char>(zigzag & 0x7F);
+      zigzag >>= 7;
+      body_.push_back(static_cast<char>(byte | (zigzag ? 0x80 : 0)));
+    } while (zigzag);
+  }
+};
+} // namespace BinaryFormat
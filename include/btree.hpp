@@ -0,0 +1,502 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "node.hpp"
+
+namespace RB_Tree {
+
+namespace detail {
+inline constexpr std::uint32_t BTREE_ORDER = 32;
+
+inline std::uint32_t lowMask(std::uint32_t n) {
+  return n >= 32 ? ~0u : (1u << n) - 1;
+}
+
+// Number of the first n keys that are < key (or <= key if inclusive). All
+// BTREE_ORDER slots must be initialized.
+template <typename KeyTy>
+std::uint32_t countBelow(const KeyTy *keys, std::uint32_t n, const KeyTy &key,
+                         bool inclusive) {
+#if defined(__SSE2__)
+  if constexpr (std::is_same_v<KeyTy, std::int32_t>) {
+    const __m128i x = _mm_set1_epi32(key);
+    std::uint32_t mask = 0;
+    for (std::uint32_t i = 0; i < BTREE_ORDER; i += 4) {
+      __m128i k = _mm_loadu_si128(reinterpret_cast<const __m128i *>(keys + i));
+      __m128i cmp = inclusive ? _mm_cmpgt_epi32(k, x) : _mm_cmplt_epi32(k, x);
+      mask |= static_cast<std::uint32_t>(
+                  _mm_movemask_ps(_mm_castsi128_ps(cmp)))
+              << i;
+    }
+    if (inclusive)
+      mask = ~mask;
+    return std::popcount(mask & lowMask(n));
+  }
+#endif
+
+  std::uint32_t count = 0;
+  for (std::uint32_t i = 0; i < n; ++i)
+    count += inclusive ? !(key < keys[i]) : (keys[i] < key);
+  return count;
+}
+
+// Sum of the first n counts.
+inline std::size_t sumCounts(const std::uint32_t *counts, std::uint32_t n) {
+#if defined(__SSE2__)
+  const __m128i limit = _mm_set1_epi32(static_cast<int>(n));
+  __m128i index = _mm_setr_epi32(0, 1, 2, 3);
+  __m128i acc = _mm_setzero_si128();
+  for (std::uint32_t i = 0; i < BTREE_ORDER; i += 4) {
+    __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(counts + i));
+    acc = _mm_add_epi32(acc, _mm_and_si128(c, _mm_cmplt_epi32(index, limit)));
+    index = _mm_add_epi32(index, _mm_set1_epi32(4));
+  }
+  alignas(16) std::uint32_t lanes[4];
+  _mm_store_si128(reinterpret_cast<__m128i *>(lanes), acc);
+  return std::size_t{lanes[0]} + lanes[1] + lanes[2] + lanes[3];
+#else
+  std::size_t sum = 0;
+  for (std::uint32_t i = 0; i < n; ++i)
+    sum += counts[i];
+  return sum;
+#endif
+}
+} // namespace detail
+
+// Order-statistics B+ tree with the interface of Tree. Every node spans
+// several cache lines and holds up to BTREE_ORDER sorted keys (leaves) or
+// children together with their subtree sizes (inner nodes), so a search
+// touches only a few nodes. Keys inside a node are counted with SIMD
+// comparisons when KeyTy is a 32-bit integer.
+//
+// Unlike those of Tree, iterators are invalidated by insert().
+template <typename KeyTy = int> class BTree final {
+  static constexpr std::uint32_t ORDER = detail::BTREE_ORDER;
+  static constexpr std::size_t MAX_HEIGHT = 32;
+
+  struct alignas(64) Leaf final {
+    KeyTy keys[ORDER]{};
+    NodeIdx parent = NULL_IDX;
+    NodeIdx next = NULL_IDX; // the leaf with the next keys
+    std::uint32_t size = 0;
+  };
+
+  // keys[i] is the smallest key of the subtree children[i], counts[i] is its
+  // number of keys.
+  struct alignas(64) Inner final {
+    KeyTy keys[ORDER]{};
+    std::uint32_t counts[ORDER]{};
+    NodeIdx children[ORDER]{};
+    NodeIdx parent = NULL_IDX;
+    std::uint32_t size = 0;
+  };
+
+  std::vector<Leaf> leaves_;
+  std::vector<Inner> inners_;
+  NodeIdx root_ = NULL_IDX;
+  int height_ = 0; // number of inner levels above the leaves
+
+public:
+  // Points to a key in a leaf.
+  class It final {
+    const BTree *tree_ = nullptr;
+    NodeIdx leaf_ = NULL_IDX;
+    std::uint32_t slot_ = 0;
+
+    struct KeyRef final {
+      const KeyTy &key;
+      const KeyRef *operator->() const { return this; }
+    };
+
+  public:
+    It() = default;
+    It(const BTree *tree, NodeIdx leaf, std::uint32_t slot)
+        : tree_(tree), leaf_(leaf), slot_(slot) {}
+
+    KeyRef operator->() const { return {tree_->leaves_[leaf_].keys[slot_]}; }
+    NodeIdx leaf() const { return leaf_; }
+    std::uint32_t slot() const { return slot_; }
+
+    bool operator==(const It &) const = default;
+  };
+
+  BTree() = default;
+  ~BTree() = default;
+
+  BTree(const BTree &) = delete;
+  BTree &operator=(const BTree &) = delete;
+
+  BTree(BTree &&other)
+      : leaves_(std::move(other.leaves_)), inners_(std::move(other.inners_)),
+        root_(other.root_), height_(other.height_) {
+    other.clear();
+  }
+
+  BTree &operator=(BTree &&other) {
+    if (this != &other) {
+      leaves_ = std::move(other.leaves_);
+      inners_ = std::move(other.inners_);
+      root_ = other.root_;
+      height_ = other.height_;
+      other.clear();
+    }
+
+    return *this;
+  }
+
+  std::size_t size() const {
+    if (root_ == NULL_IDX)
+      return 0;
+    if (height_ == 0)
+      return leaves_[root_].size;
+    const auto &root = inners_[root_];
+    return detail::sumCounts(root.counts, root.size);
+  }
+
+  int height() const { return height_; }
+  bool verifyTree() const;
+
+  void insert(const KeyTy &key);
+  std::optional<It> lowerBound(const KeyTy &key) const;
+  std::optional<It> upperBound(const KeyTy &key) const;
+  std::size_t getRank(std::optional<It> it_opt) const;
+  std::size_t distance(std::optional<It> first_opt,
+                       std::optional<It> last_opt) const;
+
+  std::size_t countLess(const KeyTy &key) const {
+    return countBelow(key, false);
+  }
+  std::size_t countLessEqual(const KeyTy &key) const {
+    return countBelow(key, true);
+  }
+  std::size_t countRange(const KeyTy &lo, const KeyTy &hi) const {
+    if (hi < lo)
+      return 0;
+    return countLessEqual(hi) - countLess(lo);
+  }
+
+private:
+  void clear() {
+    leaves_.clear();
+    inners_.clear();
+    root_ = NULL_IDX;
+    height_ = 0;
+  }
+
+  // Child of an inner node to descend into: the last one whose smallest key
+  // is below the key, or the first one.
+  static std::uint32_t childFor(const Inner &inner, const KeyTy &key,
+                                bool inclusive) {
+    std::uint32_t c =
+        detail::countBelow(inner.keys, inner.size, key, inclusive);
+    return c == 0 ? 0 : c - 1;
+  }
+
+  std::size_t countBelow(const KeyTy &key, bool inclusive) const;
+  std::optional<It> bound(const KeyTy &key, bool inclusive) const;
+
+  NodeIdx newLeaf();
+  NodeIdx newInner();
+  void setParent(NodeIdx child, bool is_leaf, NodeIdx parent);
+  void insertIntoLeaf(NodeIdx leaf_idx, std::uint32_t pos, const KeyTy &key);
+  void insertChild(NodeIdx parent_idx, NodeIdx left, NodeIdx right,
+                   const KeyTy &right_min, std::size_t left_count,
+                   std::size_t right_count, bool children_are_leaves);
+
+  struct VerifyState;
+  const char *checkNode(NodeIdx node, int level, NodeIdx parent,
+                        VerifyState &state, std::size_t &count,
+                        const KeyTy *&min_key) const;
+};
+
+template <typename KeyTy>
+std::size_t BTree<KeyTy>::countBelow(const KeyTy &key, bool inclusive) const {
+  if (root_ == NULL_IDX)
+    return 0;
+
+  std::size_t count = 0;
+  NodeIdx node = root_;
+  for (int level = height_; level > 0; --level) {
+    const auto &inner = inners_[node];
+    std::uint32_t c = childFor(inner, key, inclusive);
+    count += detail::sumCounts(inner.counts, c);
+    node = inner.children[c];
+  }
+
+  const auto &leaf = leaves_[node];
+  return count + detail::countBelow(leaf.keys, leaf.size, key, inclusive);
+}
+
+template <typename KeyTy>
+std::optional<typename BTree<KeyTy>::It>
+BTree<KeyTy>::bound(const KeyTy &key, bool inclusive) const {
+  if (root_ == NULL_IDX)
+    return std::nullopt;
+
+  NodeIdx node = root_;
+  for (int level = height_; level > 0; --level)
+    node = inners_[node].children[childFor(inners_[node], key, inclusive)];
+
+  const auto &leaf = leaves_[node];
+  std::uint32_t slot = detail::countBelow(leaf.keys, leaf.size, key, inclusive);
+  if (slot < leaf.size)
+    return It(this, node, slot);
+
+  // Every key of this leaf is below the bound: the answer opens the next one.
+  if (leaf.next == NULL_IDX)
+    return std::nullopt;
+  return It(this, leaf.next, 0);
+}
+
+template <typename KeyTy>
+std::optional<typename BTree<KeyTy>::It>
+BTree<KeyTy>::lowerBound(const KeyTy &key) const {
+  return bound(key, false);
+}
+
+template <typename KeyTy>
+std::optional<typename BTree<KeyTy>::It>
+BTree<KeyTy>::upperBound(const KeyTy &key) const {
+  return bound(key, true);
+}
+
+template <typename KeyTy>
+std::size_t BTree<KeyTy>::getRank(std::optional<It> it_opt) const {
+  if (root_ == NULL_IDX || !it_opt)
+    return 0;
+
+  std::size_t rank = it_opt->slot();
+  NodeIdx child = it_opt->leaf();
+  NodeIdx parent = leaves_[child].parent;
+
+  while (parent != NULL_IDX) {
+    const auto &inner = inners_[parent];
+    std::uint32_t c = 0;
+    while (inner.children[c] != child)
+      ++c;
+    rank += detail::sumCounts(inner.counts, c);
+
+    child = parent;
+    parent = inner.parent;
+  }
+
+  return rank;
+}
+
+template <typename KeyTy>
+std::size_t BTree<KeyTy>::distance(std::optional<It> first_opt,
+                                   std::optional<It> last_opt) const {
+  if (root_ == NULL_IDX || !first_opt)
+    return 0;
+
+  if (first_opt == last_opt)
+    return 0;
+
+  if (!last_opt)
+    return size() - getRank(first_opt);
+
+  std::size_t r1 = getRank(first_opt);
+  std::size_t r2 = getRank(last_opt);
+
+  return (r2 >= r1) ? (r2 - r1) : 0;
+}
+
+template <typename KeyTy> void BTree<KeyTy>::insert(const KeyTy &key) {
+  if (root_ == NULL_IDX) {
+    root_ = newLeaf();
+    height_ = 0;
+    leaves_[root_].keys[0] = key;
+    leaves_[root_].size = 1;
+    return;
+  }
+
+  // Descend without modifying anything: the key may be a duplicate.
+  std::array<NodeIdx, MAX_HEIGHT> path;
+  std::array<std::uint32_t, MAX_HEIGHT> child_pos;
+  NodeIdx node = root_;
+  for (int level = height_; level > 0; --level) {
+    const auto &inner = inners_[node];
+    std::uint32_t c = childFor(inner, key, true);
+    path[level] = node;
+    child_pos[level] = c;
+    node = inner.children[c];
+  }
+
+  const auto &leaf = leaves_[node];
+  std::uint32_t pos = detail::countBelow(leaf.keys, leaf.size, key, false);
+  if (pos < leaf.size && !(key < leaf.keys[pos]))
+    return;
+
+  if (size() >= MAX_NODES)
+    throw std::length_error("RB_Tree::BTree: too many keys");
+
+  // Updating the sizes and the smallest keys along the path.
+  for (int level = height_; level > 0; --level) {
+    auto &inner = inners_[path[level]];
+    ++inner.counts[child_pos[level]];
+    if (key < inner.keys[child_pos[level]])
+      inner.keys[child_pos[level]] = key;
+  }
+
+  insertIntoLeaf(node, pos, key);
+}
+
+template <typename KeyTy> NodeIdx BTree<KeyTy>::newLeaf() {
+  leaves_.emplace_back();
+  return static_cast<NodeIdx>(leaves_.size() - 1);
+}
+
+template <typename KeyTy> NodeIdx BTree<KeyTy>::newInner() {
+  inners_.emplace_back();
+  return static_cast<NodeIdx>(inners_.size() - 1);
+}
+
+template <typename KeyTy>
+void BTree<KeyTy>::setParent(NodeIdx child, bool is_leaf, NodeIdx parent) {
+  if (is_leaf)
+    leaves_[child].parent = parent;
+  else
+    inners_[child].parent = parent;
+}
+
+template <typename KeyTy>
+void BTree<KeyTy>::insertIntoLeaf(NodeIdx leaf_idx, std::uint32_t pos,
+                                  const KeyTy &key) {
+  auto insertAt = [](Leaf &leaf, std::uint32_t at, const KeyTy &k) {
+    for (std::uint32_t i = leaf.size; i > at; --i)
+      leaf.keys[i] = leaf.keys[i - 1];
+    leaf.keys[at] = k;
+    ++leaf.size;
+  };
+
+  if (leaves_[leaf_idx].size < ORDER) {
+    insertAt(leaves_[leaf_idx], pos, key);
+    return;
+  }
+
+  // Splitting the full leaf in halves. newLeaf() may reallocate the arena.
+  NodeIdx right_idx = newLeaf();
+  auto &left = leaves_[leaf_idx];
+  auto &right = leaves_[right_idx];
+  constexpr std::uint32_t HALF = ORDER / 2;
+
+  for (std::uint32_t i = HALF; i < ORDER; ++i)
+    right.keys[i - HALF] = left.keys[i];
+  right.size = ORDER - HALF;
+  left.size = HALF;
+
+  right.next = left.next;
+  left.next = right_idx;
+  right.parent = left.parent;
+
+  if (pos <= HALF)
+    insertAt(left, pos, key);
+  else
+    insertAt(right, pos - HALF, key);
+
+  insertChild(left.parent, leaf_idx, right_idx, right.keys[0], left.size,
+              right.size, true);
+}
+
+// Registers `right`, split off `left`, in their parent. Splits the parent in
+// turn when it is full.
+template <typename KeyTy>
+void BTree<KeyTy>::insertChild(NodeIdx parent_idx, NodeIdx left, NodeIdx right,
+                               const KeyTy &right_min, std::size_t left_count,
+                               std::size_t right_count,
+                               bool children_are_leaves) {
+  if (parent_idx == NULL_IDX) {
+    // The root was split: growing the tree by one level.
+    KeyTy left_min = children_are_leaves ? leaves_[left].keys[0]
+                                         : inners_[left].keys[0];
+    KeyTy right_key = right_min;
+    NodeIdx root_idx = newInner();
+    auto &root = inners_[root_idx];
+    root.size = 2;
+    root.keys[0] = left_min;
+    root.keys[1] = right_key;
+    root.children[0] = left;
+    root.children[1] = right;
+    root.counts[0] = static_cast<std::uint32_t>(left_count);
+    root.counts[1] = static_cast<std::uint32_t>(right_count);
+
+    setParent(left, children_are_leaves, root_idx);
+    setParent(right, children_are_leaves, root_idx);
+    root_ = root_idx;
+    ++height_;
+    return;
+  }
+
+  KeyTy right_key = right_min;
+  auto insertAt = [&](Inner &inner, std::uint32_t at) {
+    for (std::uint32_t i = inner.size; i > at; --i) {
+      inner.keys[i] = inner.keys[i - 1];
+      inner.counts[i] = inner.counts[i - 1];
+      inner.children[i] = inner.children[i - 1];
+    }
+    inner.keys[at] = right_key;
+    inner.counts[at] = static_cast<std::uint32_t>(right_count);
+    inner.children[at] = right;
+    ++inner.size;
+  };
+
+  {
+    auto &parent = inners_[parent_idx];
+    std::uint32_t c = 0;
+    while (parent.children[c] != left)
+      ++c;
+    parent.counts[c] = static_cast<std::uint32_t>(left_count);
+
+    if (parent.size < ORDER) {
+      insertAt(parent, c + 1);
+      setParent(right, children_are_leaves, parent_idx);
+      return;
+    }
+  }
+
+  // Splitting the full parent in halves. newInner() may reallocate the arena.
+  NodeIdx sibling_idx = newInner();
+  auto &parent = inners_[parent_idx];
+  auto &sibling = inners_[sibling_idx];
+  constexpr std::uint32_t HALF = ORDER / 2;
+
+  std::uint32_t c = 0;
+  while (parent.children[c] != left)
+    ++c;
+
+  for (std::uint32_t i = HALF; i < ORDER; ++i) {
+    sibling.keys[i - HALF] = parent.keys[i];
+    sibling.counts[i - HALF] = parent.counts[i];
+    sibling.children[i - HALF] = parent.children[i];
+  }
+  sibling.size = ORDER - HALF;
+  parent.size = HALF;
+  sibling.parent = parent.parent;
+
+  if (c + 1 <= HALF)
+    insertAt(parent, c + 1);
+  else
+    insertAt(sibling, c + 1 - HALF);
+
+  for (std::uint32_t i = 0; i < parent.size; ++i)
+    setParent(parent.children[i], children_are_leaves, parent_idx);
+  for (std::uint32_t i = 0; i < sibling.size; ++i)
+    setParent(sibling.children[i], children_are_leaves, sibling_idx);
+
+  insertChild(parent.parent, parent_idx, sibling_idx, sibling.keys[0],
+              detail::sumCounts(parent.counts, parent.size),
+              detail::sumCounts(sibling.counts, sibling.size), false);
+}
+} // namespace RB_Tree
@@ -0,0 +1,286 @@
+#pragma once
+
+#include <cerrno>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "binary_format.hpp"
+
+namespace Input {
+
+class ParseError final : public std::runtime_error {
+public:
+  using std::runtime_error::runtime_error;
+};
+
+// Scanner for the "k <key> q <first> <second> ..." command stream. A regular
+// file is memory mapped as a whole; anything else (a pipe, a terminal) is read
+// in large blocks. Tokens are parsed by hand, without iostreams and locales.
+//
+// A stream that starts with the binary header (see binary_format.hpp) is
+// decoded instead of parsed; callers see the same commands either way.
+class CommandReader final {
+  static constexpr std::size_t BLOCK_SIZE = 1 << 20;
+  // Longer than any valid token, so a token never straddles a refill.
+  static constexpr std::size_t MAX_TOKEN = 64;
+  static_assert(MAX_TOKEN >= BinaryFormat::HEADER_SIZE &&
+                MAX_TOKEN >= BinaryFormat::MAX_COMMAND_SIZE);
+
+  int fd_ = -1;
+  bool owns_fd_ = false;
+  const char *begin_ = nullptr;
+  const char *pos_ = nullptr;
+  const char *end_ = nullptr;
+  void *map_ = nullptr;
+  std::size_t map_size_ = 0;
+  std::vector<char> block_;
+  std::size_t consumed_ = 0; // bytes dropped from the block before begin_
+  std::size_t token_offset_ = 0;
+  bool eof_ = false;
+
+  bool detected_ = false;
+  bool binary_ = false;
+  std::size_t key_size_ = 0;
+  bool delta_ = false;
+  std::int64_t previous_ = 0;
+  std::uint64_t inserts_left_ = 0, queries_left_ = 0;
+
+public:
+  CommandReader() : CommandReader(STDIN_FILENO, false) {}
+
+  explicit CommandReader(const std::string &path)
+      : CommandReader(::open(path.c_str(), O_RDONLY), true) {
+    if (fd_ < 0)
+      throw std::runtime_error("Failed to open file: " + path);
+  }
+
+  CommandReader(const CommandReader &) = delete;
+  CommandReader &operator=(const CommandReader &) = delete;
+
+  ~CommandReader() {
+    if (map_)
+      ::munmap(map_, map_size_);
+    if (owns_fd_ && fd_ >= 0)
+      ::close(fd_);
+  }
+
+  // Reads the next command letter. Returns false at the end of the input.
+  bool nextCommand(char &command) {
+    if (!detected_)
+      detectFormat();
+    if (binary_)
+      return nextBinaryCommand(command);
+
+    skipSpaces();
+    if (pos_ == end_)
+      return false;
+
+    command = *pos_++;
+    return true;
+  }
+
+  // Reads the next signed integer. Malformed or out-of-range numbers raise
+  // ParseError.
+  template <typename IntTy> IntTy nextInt() {
+    if (binary_)
+      return nextBinaryInt<IntTy>();
+
+    skipSpaces();
+    if (pos_ == end_)
+      fail("unexpected end of input, expected an integer");
+
+    const char *first = (*pos_ == '+') ? pos_ + 1 : pos_;
+    if (first != pos_ && first != end_ && *first == '-')
+      fail("expected an integer");
+
+    IntTy value{};
+    auto [ptr, ec] = std::from_chars(first, end_, value);
+    if (ec == std::errc::result_out_of_range)
+      fail("integer is out of range");
+    if (ec != std::errc() || (ptr != end_ && !isSpace(*ptr)))
+      fail("expected an integer");
+    if (ptr == end_ && !eof_)
+      fail("integer is too long");
+
+    pos_ = ptr;
+    return value;
+  }
+
+  bool isBinary() const { return binary_; }
+
+  // Offset of the last token read (or of the end of the input) from the
+  // beginning of the input.
+  std::size_t offset() const { return token_offset_; }
+
+  [[noreturn]] void fail(const std::string &what) const {
+    throw ParseError("malformed input at byte " + std::to_string(offset()) +
+                     ": " + what);
+  }
+
+private:
+  CommandReader(int fd, bool owns_fd) : fd_(fd), owns_fd_(owns_fd) {
+    if (fd_ < 0)
+      return;
+
+    struct stat st {};
+    if (::fstat(fd_, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      map_size_ = static_cast<std::size_t>(st.st_size);
+      void *map = ::mmap(nullptr, map_size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+      if (map != MAP_FAILED) {
+        ::madvise(map, map_size_, MADV_SEQUENTIAL);
+        map_ = map;
+        begin_ = pos_ = static_cast<const char *>(map);
+        end_ = begin_ + map_size_;
+        eof_ = true;
+        return;
+      }
+    }
+
+    block_.resize(BLOCK_SIZE + MAX_TOKEN);
+    begin_ = pos_ = end_ = block_.data();
+  }
+
+  static bool isSpace(char c) {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' ||
+           c == '\f';
+  }
+
+  // Keeps at least MAX_TOKEN bytes ahead of pos_ unless the input ends.
+  void refill() {
+    if (eof_ || static_cast<std::size_t>(end_ - pos_) >= MAX_TOKEN)
+      return;
+
+    std::size_t left = end_ - pos_;
+    consumed_ += pos_ - begin_;
+    std::memmove(block_.data(), pos_, left);
+    begin_ = pos_ = block_.data();
+    end_ = begin_ + left;
+
+    while (!eof_ && static_cast<std::size_t>(end_ - pos_) < MAX_TOKEN) {
+      ssize_t n = ::read(fd_, block_.data() + left, block_.size() - left);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        throw std::runtime_error("Failed to read the input");
+      if (n == 0)
+        eof_ = true;
+      left += static_cast<std::size_t>(n);
+      end_ = begin_ + left;
+    }
+  }
+
+  void markToken() { token_offset_ = consumed_ + (pos_ - begin_); }
+
+  void detectFormat() {
+    detected_ = true;
+    refill();
+    if (static_cast<std::size_t>(end_ - pos_) < sizeof(BinaryFormat::MAGIC) ||
+        std::memcmp(pos_, BinaryFormat::MAGIC, sizeof(BinaryFormat::MAGIC)))
+      return;
+
+    binary_ = true;
+    markToken();
+    if (static_cast<std::size_t>(end_ - pos_) < BinaryFormat::HEADER_SIZE)
+      fail("truncated binary header");
+
+    auto version = BinaryFormat::readLE(pos_ + 4, 2);
+    if (version != BinaryFormat::VERSION)
+      fail("unsupported binary stream version " + std::to_string(version));
+    key_size_ = BinaryFormat::readLE(pos_ + 6, 1);
+    if (key_size_ != 4 && key_size_ != 8)
+      fail("unsupported key size " + std::to_string(key_size_));
+    delta_ = BinaryFormat::readLE(pos_ + 7, 1) & BinaryFormat::FLAG_DELTA;
+    inserts_left_ = BinaryFormat::readLE(pos_ + 8, 8);
+    queries_left_ = BinaryFormat::readLE(pos_ + 16, 8);
+
+    pos_ += BinaryFormat::HEADER_SIZE;
+  }
+
+  bool nextBinaryCommand(char &command) {
+    refill();
+    markToken();
+    if (pos_ == end_) {
+      if (inserts_left_ != 0 || queries_left_ != 0)
+        fail("stream ends before the command counts of its header");
+      return false;
+    }
+
+    auto opcode = static_cast<std::uint8_t>(*pos_);
+    std::uint64_t &left =
+        opcode == BinaryFormat::OP_INSERT ? inserts_left_ : queries_left_;
+    if (opcode != BinaryFormat::OP_INSERT && opcode != BinaryFormat::OP_QUERY)
+      fail("unknown opcode " + std::to_string(opcode));
+    if (left == 0)
+      fail("more commands than the header declares");
+
+    --left;
+    ++pos_;
+    command = opcode == BinaryFormat::OP_INSERT ? 'k' : 'q';
+    return true;
+  }
+
+  template <typename IntTy> IntTy nextBinaryInt() {
+    refill();
+    markToken();
+
+    std::int64_t value = 0;
+    if (!delta_) {
+      if (static_cast<std::size_t>(end_ - pos_) < key_size_)
+        fail("unexpected end of input, expected an integer");
+      std::uint64_t bits = BinaryFormat::readLE(pos_, key_size_);
+      value = key_size_ == 4
+                  ? static_cast<std::int32_t>(static_cast<std::uint32_t>(bits))
+                  : static_cast<std::int64_t>(bits);
+      pos_ += key_size_;
+    } else {
+      std::uint64_t zigzag = 0;
+      for (int shift = 0;; shift += 7) {
+        if (pos_ == end_ || shift > 63)
+          fail("malformed varint");
+        auto byte = static_cast<unsigned char>(*pos_++);
+        zigzag |= std::uint64_t{byte & 0x7Fu} << shift;
+        if (!(byte & 0x80))
+          break;
+      }
+      std::uint64_t diff = (zigzag >> 1) ^ (~(zigzag & 1) + 1);
+      value = static_cast<std::int64_t>(
+          static_cast<std::uint64_t>(previous_) + diff);
+      previous_ = value;
+    }
+
+    if (!std::in_range<IntTy>(value))
+      fail("integer is out of range");
+    return static_cast<IntTy>(value);
+  }
+
+  // Skips whitespace and leaves a whole token (if any) in the buffer.
+  void skipSpaces() {
+    while (true) {
+      refill();
+      while (pos_ != end_ && isSpace(*pos_))
+        ++pos_;
+
+      if (pos_ != end_) {
+        refill();
+        markToken();
+        return;
+      }
+      if (eof_) {
+        markToken();
+        return;
+      }
+    }
+  }
+};
+} // namespace Input
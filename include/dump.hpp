@@ -5,25 +5,22 @@
 #include <string>
 
 #include "node.hpp"
+#include "tree.hpp"
 
 namespace RB_Tree {
 
-template <typename KeyTy> class Tree;
-
 namespace {
 constexpr const char *RED = "\x1B[31m";
 constexpr const char *RST = "\x1B[0m";
 } // namespace
 
-template <typename KeyTy>
-void dumpTree(
-    std::ostream &os,
-    const std::optional<typename std::list<Node<KeyTy>>::iterator> &node_opt,
-    size_t &null_counter) {
-  if (!node_opt)
+template <typename NodeTy>
+void dumpTree(std::ostream &os, const std::vector<NodeTy> &nodes,
+              NodeIdx node_idx, size_t &null_counter) {
+  if (node_idx == NULL_IDX)
     return;
 
-  const Node<KeyTy> &node = **node_opt;
+  const NodeTy &node = nodes[node_idx];
   const void *node_addr = static_cast<const void *>(&node);
 
   std::string node_color = (node.color == Color::black) ? "black" : "red";
@@ -37,11 +34,11 @@ void dumpTree(
      << " | <f3> key = " << node.key << "}}\"];\n";
 
   // Left child.
-  if (node.left) {
-    const void *left_addr = static_cast<const void *>(&(**node.left));
+  if (node.left != NULL_IDX) {
+    const void *left_addr = static_cast<const void *>(&nodes[node.left]);
     os << "\tnode_" << node_addr << ":<f2>:s -> node_" << left_addr
        << ":<f1>:n;\n";
-    dumpTree<KeyTy>(os, node.left, null_counter); // ← явное указание KeyTy
+    dumpTree(os, nodes, node.left, null_counter);
   } else {
     os << "\tnode_" << node_addr << ":<f2>:s -> null_" << ++null_counter
        << ";\n";
@@ -51,11 +48,11 @@ void dumpTree(
   }
 
   // Right child.
-  if (node.right) {
-    const void *right_addr = static_cast<const void *>(&(**node.right));
+  if (node.right != NULL_IDX) {
+    const void *right_addr = static_cast<const void *>(&nodes[node.right]);
     os << "\tnode_" << node_addr << ":<f3>:s -> node_" << right_addr
        << ":<f1>:n;\n";
-    dumpTree<KeyTy>(os, node.right, null_counter); // ← явное указание KeyTy
+    dumpTree(os, nodes, node.right, null_counter);
   } else {
     os << "\tnode_" << node_addr << ":<f3>:s -> null_" << ++null_counter
        << ";\n";
@@ -65,8 +62,9 @@ void dumpTree(
   }
 }
 
-template <typename KeyTy>
-void makeGraph(const std::string &filename, const Tree<KeyTy> &tree) {
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+void makeGraph(const std::string &filename,
+               const Tree<KeyTy, Compare, Augment, MULTI> &tree) {
   auto root_opt = tree.get_root();
   if (!root_opt) {
     std::cout << RED
@@ -88,7 +86,7 @@ void makeGraph(const std::string &filename, const Tree<KeyTy> &tree) {
   file << "\tsplines = false;\n\n";
 
   size_t null_counter = 0;
-  dumpTree<KeyTy>(file, root_opt, null_counter);
+  dumpTree(file, tree.get_nodes(), root_opt->index(), null_counter);
 
   file << "}\n";
 }
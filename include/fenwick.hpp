@@ -0,0 +1,86 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace Offline {
+
+// Binary indexed tree over positions [0, size) holding 0/1 counts.
+class FenwickTree final {
+  std::vector<std::uint32_t> tree_;
+
+public:
+  explicit FenwickTree(std::size_t size) : tree_(size + 1, 0) {}
+
+  void add(std::size_t pos) {
+    for (std::size_t i = pos + 1; i < tree_.size(); i += i & (~i + 1))
+      ++tree_[i];
+  }
+
+  // Sum over the first `count` positions.
+  std::size_t prefix(std::size_t count) const {
+    std::size_t sum = 0;
+    for (std::size_t i = count; i > 0; i &= i - 1)
+      sum += tree_[i];
+    return sum;
+  }
+};
+
+template <typename KeyTy> struct Command final {
+  char type = 0; // 'k' or 'q'
+  KeyTy first{};
+  KeyTy second{};
+};
+
+// Answers all 'q' commands of a fully known stream, in stream order. Keys are
+// compressed to their positions among the distinct inserted keys, so the
+// replay only touches a flat Fenwick tree. The answers are the same as those
+// of RB_Tree::Tree::countRange() for the same stream.
+template <typename KeyTy>
+std::vector<std::size_t>
+answerQueries(const std::vector<Command<KeyTy>> &commands) {
+  std::vector<KeyTy> keys;
+  std::size_t queries_num = 0;
+  for (const auto &command : commands) {
+    if (command.type == 'k')
+      keys.push_back(command.first);
+    else
+      ++queries_num;
+  }
+
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+  auto position = [&keys](const KeyTy &key) -> std::size_t {
+    return std::lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+  };
+  auto position_after = [&keys](const KeyTy &key) -> std::size_t {
+    return std::upper_bound(keys.begin(), keys.end(), key) - keys.begin();
+  };
+
+  FenwickTree fenwick(keys.size());
+  std::vector<char> inserted(keys.size(), 0);
+  std::vector<std::size_t> answers;
+  answers.reserve(queries_num);
+
+  for (const auto &command : commands) {
+    if (command.type == 'k') {
+      std::size_t pos = position(command.first);
+      if (!inserted[pos]) {
+        inserted[pos] = 1;
+        fenwick.add(pos);
+      }
+    } else {
+      std::size_t distance = 0;
+      if (command.second > command.first)
+        distance = fenwick.prefix(position_after(command.second)) -
+                   fenwick.prefix(position(command.first));
+      answers.push_back(distance);
+    }
+  }
+
+  return answers;
+}
+} // namespace Offline
@@ -0,0 +1,200 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <new>
+#include <vector>
+
+#include "tree.hpp"
+
+namespace RB_Tree {
+
+namespace detail {
+inline constexpr std::size_t CACHE_LINE = 64;
+
+// Storage aligned to a cache line, so that a run of keys starting at a
+// multiple of the line size fills whole lines.
+// Not final: std::vector derives from its allocator.
+template <typename T> struct LineAllocator {
+  using value_type = T;
+
+  LineAllocator() = default;
+  template <typename U> LineAllocator(const LineAllocator<U> &) {}
+
+  T *allocate(std::size_t n) {
+    return static_cast<T *>(
+        ::operator new(n * sizeof(T), std::align_val_t{CACHE_LINE}));
+  }
+  void deallocate(T *p, std::size_t n) {
+    ::operator delete(p, n * sizeof(T), std::align_val_t{CACHE_LINE});
+  }
+
+  template <typename U> bool operator==(const LineAllocator<U> &) const {
+    return true;
+  }
+};
+} // namespace detail
+
+// Read-only snapshot of the keys of a Tree in Eytzinger (BFS) order: the
+// children of position k are 2k and 2k + 1, so the first levels of every
+// search share a few cache lines and deeper levels can be prefetched before
+// they are needed. Searches are branchless.
+template <typename KeyTy, typename Compare = std::less<KeyTy>>
+class FrozenIndex final {
+  // The PREFETCH_STRIDE descendants of k, log2(PREFETCH_STRIDE) levels
+  // down, sit next to each other from k * PREFETCH_STRIDE on. The stride
+  // keeps them within a cache line's worth of bytes, and keys_ is
+  // line-aligned, so for a key size that divides the line one prefetch
+  // covers them; otherwise every line they touch is prefetched.
+  static constexpr std::size_t PREFETCH_STRIDE = std::bit_floor(
+      std::max<std::size_t>(1, detail::CACHE_LINE / sizeof(KeyTy)));
+  static constexpr std::size_t PREFETCH_SPAN = PREFETCH_STRIDE * sizeof(KeyTy);
+
+  // 1-based, keys_[0] is unused
+  std::vector<KeyTy, detail::LineAllocator<KeyTy>> keys_;
+  std::vector<std::uint32_t> ranks_; // number of keys before keys_[k]
+  std::size_t total_ = 0;
+  [[no_unique_address]] Compare comp_;
+
+public:
+  FrozenIndex() : keys_(1), ranks_(1) {}
+
+  // `sorted` must be strictly increasing in the order of `comp`.
+  explicit FrozenIndex(const std::vector<KeyTy> &sorted,
+                       const Compare &comp = Compare())
+      : FrozenIndex(sorted, nullptr, comp) {}
+
+  // Multiset snapshot: sorted[i] is there counts[i] times.
+  FrozenIndex(const std::vector<KeyTy> &sorted,
+              const std::vector<std::uint32_t> &counts,
+              const Compare &comp = Compare())
+      : FrozenIndex(sorted, counts.data(), comp) {}
+
+  std::size_t size() const { return total_; }
+
+  // Number of keys < key.
+  std::size_t countLess(const KeyTy &key) const {
+    return rankOf(descend(key, [this](const KeyTy &node_key, const KeyTy &k) {
+      return comp_(node_key, k);
+    }));
+  }
+
+  // Number of keys <= key.
+  std::size_t countLessEqual(const KeyTy &key) const {
+    return rankOf(descend(key, [this](const KeyTy &node_key, const KeyTy &k) {
+      return !comp_(k, node_key);
+    }));
+  }
+
+  // Number of keys in [lo, hi]. The two descents are interleaved, so their
+  // cache misses overlap.
+  std::size_t countRange(const KeyTy &lo, const KeyTy &hi) const {
+    if (comp_(hi, lo))
+      return 0;
+
+    const std::size_t n = slots();
+    const KeyTy *keys = keys_.data();
+    std::size_t lo_k = 1, hi_k = 1;
+
+    // All levels above the last one are complete.
+    for (int level = std::bit_width(n) - 1; level > 0; --level) {
+      prefetch(lo_k);
+      prefetch(hi_k);
+      lo_k = 2 * lo_k + static_cast<std::size_t>(comp_(keys[lo_k], lo));
+      hi_k = 2 * hi_k + static_cast<std::size_t>(!comp_(hi, keys[hi_k]));
+    }
+
+    if (lo_k <= n)
+      lo_k = 2 * lo_k + static_cast<std::size_t>(comp_(keys[lo_k], lo));
+    if (hi_k <= n)
+      hi_k = 2 * hi_k + static_cast<std::size_t>(!comp_(hi, keys[hi_k]));
+
+    return rankOf(finish(hi_k)) - rankOf(finish(lo_k));
+  }
+
+private:
+  // A null `counts` means every key is there once.
+  FrozenIndex(const std::vector<KeyTy> &sorted, const std::uint32_t *counts,
+              const Compare &comp)
+      : keys_(sorted.size() + 1), ranks_(sorted.size() + 1), comp_(comp) {
+    std::size_t next = 0;
+    fill(sorted, counts, next, 1);
+  }
+
+  std::size_t slots() const { return keys_.size() - 1; }
+
+  void fill(const std::vector<KeyTy> &sorted, const std::uint32_t *counts,
+            std::size_t &next, std::size_t k) {
+    if (k > sorted.size())
+      return;
+
+    fill(sorted, counts, next, 2 * k);
+    keys_[k] = sorted[next];
+    ranks_[k] = static_cast<std::uint32_t>(total_);
+    total_ += counts ? counts[next] : 1;
+    ++next;
+    fill(sorted, counts, next, 2 * k + 1);
+  }
+
+  void prefetch(std::size_t k) const {
+    // Only the addresses are computed, prefetching past the end is harmless.
+    auto begin =
+        reinterpret_cast<std::uintptr_t>(keys_.data()) + k * PREFETCH_SPAN;
+    if constexpr (PREFETCH_SPAN == detail::CACHE_LINE) {
+      __builtin_prefetch(reinterpret_cast<const void *>(begin));
+    } else {
+      auto line = begin & ~std::uintptr_t{detail::CACHE_LINE - 1};
+      for (; line < begin + PREFETCH_SPAN; line += detail::CACHE_LINE)
+        __builtin_prefetch(reinterpret_cast<const void *>(line));
+    }
+  }
+
+  // Goes right while goRight(key at k) holds; all levels of a complete tree
+  // are visited, so the loop length does not depend on the data.
+  template <typename GoRight>
+  std::size_t descend(const KeyTy &key, GoRight goRight) const {
+    const std::size_t n = slots();
+    const KeyTy *keys = keys_.data();
+    std::size_t k = 1;
+
+    while (k <= n) {
+      prefetch(k);
+      k = 2 * k + static_cast<std::size_t>(goRight(keys[k], key));
+    }
+
+    return finish(k);
+  }
+
+  // The answer is the last node where the search went left: drop the
+  // trailing right turns and that left turn.
+  static std::size_t finish(std::size_t k) {
+    return k >> (std::countr_one(k) + 1);
+  }
+
+  // Number of keys before the node at k; k == 0 means "past the last key".
+  std::size_t rankOf(std::size_t k) const {
+    return k == 0 ? total_ : ranks_[k];
+  }
+};
+
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+FrozenIndex<KeyTy, Compare>
+Tree<KeyTy, Compare, Augment, MULTI>::freeze() const {
+  std::vector<KeyTy> sorted;
+  sorted.reserve(arena_->nodes.size());
+  forEachInOrder([&sorted](const NodeTy &node) { sorted.push_back(node.key); });
+
+  if constexpr (MULTI) {
+    std::vector<std::uint32_t> counts;
+    counts.reserve(arena_->nodes.size());
+    forEachInOrder(
+        [&counts](const NodeTy &node) { counts.push_back(node.count); });
+    return FrozenIndex<KeyTy, Compare>(sorted, counts, comp_);
+  } else {
+    return FrozenIndex<KeyTy, Compare>(sorted, comp_);
+  }
+}
+} // namespace RB_Tree
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string_view>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace Perf {
+
+// Cheap timestamps for timing single operations: the time stamp counter on
+// x86, steady_clock elsewhere. Ticks are converted to nanoseconds with the
+// rate measured between construction and calibrate().
+class TickClock final {
+  std::chrono::steady_clock::time_point start_time_;
+  std::uint64_t start_ticks_;
+  double ns_per_tick_ = 1;
+
+public:
+  TickClock()
+      : start_time_(std::chrono::steady_clock::now()), start_ticks_(now()) {}
+
+  static std::uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+#endif
+  }
+
+  void calibrate() {
+    std::uint64_t ticks = now() - start_ticks_;
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::steady_clock::now() - start_time_)
+                  .count();
+    if (ticks > 0)
+      ns_per_tick_ = static_cast<double>(ns) / static_cast<double>(ticks);
+  }
+
+  double nsPerTick() const { return ns_per_tick_; }
+};
+
+// Histogram of non-negative integer samples with logarithmic buckets, each
+// power of two split into 2^SUB_BITS linear sub-buckets, as in HdrHistogram:
+// any sample is known to within 1/2^SUB_BITS of its value, over the whole
+// 64-bit range, in a few kilobytes.
+class LatencyHistogram final {
+  static constexpr int SUB_BITS = 5;
+  static constexpr std::uint64_t SUB_COUNT = std::uint64_t{1} << SUB_BITS;
+
+  std::vector<std::uint64_t> counts_;
+  std::uint64_t total_ = 0;
+  std::uint64_t max_ = 0;
+
+public:
+  LatencyHistogram() : counts_(bucketOf(~std::uint64_t{0}) + 1) {}
+
+  void record(std::uint64_t value) {
+    ++counts_[bucketOf(value)];
+    ++total_;
+    max_ = std::max(max_, value);
+  }
+
+  std::uint64_t count() const { return total_; }
+  std::uint64_t max() const { return max_; }
+
+  // Upper end of the bucket holding the sample at the given percentile,
+  // capped by the largest sample.
+  std::uint64_t percentile(double percent) const {
+    if (total_ == 0)
+      return 0;
+
+    auto rank = static_cast<std::uint64_t>(
+        percent / 100 * static_cast<double>(total_ - 1));
+    std::uint64_t seen = 0;
+    for (std::size_t bucket = 0; bucket < counts_.size(); ++bucket) {
+      seen += counts_[bucket];
+      if (seen > rank)
+        return std::min(bucketHigh(bucket), max_);
+    }
+    return max_;
+  }
+
+  // "<name>,<low>,<high>,<count>" for every non-empty bucket; values are
+  // scaled by `scale`.
+  void dumpCsv(std::ostream &os, std::string_view name, double scale) const {
+    for (std::size_t bucket = 0; bucket < counts_.size(); ++bucket)
+      if (counts_[bucket] > 0)
+        os << name << ',' << static_cast<double>(bucketLow(bucket)) * scale
+           << ',' << static_cast<double>(bucketHigh(bucket)) * scale << ','
+           << counts_[bucket] << '\n';
+  }
+
+private:
+  static std::size_t bucketOf(std::uint64_t value) {
+    if (value < SUB_COUNT)
+      return value;
+    int shift = std::bit_width(value) - SUB_BITS - 1;
+    return (shift + 1) * SUB_COUNT + ((value >> shift) - SUB_COUNT);
+  }
+
+  static std::uint64_t bucketLow(std::size_t bucket) {
+    if (bucket < SUB_COUNT)
+      return bucket;
+    std::size_t shift = bucket / SUB_COUNT - 1;
+    return (SUB_COUNT + bucket % SUB_COUNT) << shift;
+  }
+
+  static std::uint64_t bucketHigh(std::size_t bucket) {
+    if (bucket < SUB_COUNT)
+      return bucket;
+    std::size_t shift = bucket / SUB_COUNT - 1;
+    return bucketLow(bucket) + ((std::uint64_t{1} << shift) - 1);
+  }
+};
+} // namespace Perf
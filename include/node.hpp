@@ -1,27 +1,77 @@
 #pragma once
 #include <cstddef>
-#include <list>
+#include <cstdint>
+#include <limits>
 #include <optional>
+#include <type_traits>
+#include <vector>
+
+#include "augmentation.hpp"
 
 namespace RB_Tree {
 
-enum class Color { red, black };
+enum class Color : std::uint8_t { red, black };
+
+// Nodes live in a contiguous arena (std::vector) and refer to each other by
+// 32-bit indices. NULL_IDX plays the role of a null link.
+using NodeIdx = std::uint32_t;
+inline constexpr NodeIdx NULL_IDX = std::numeric_limits<NodeIdx>::max();
+// Bounded by the 31-bit subtree size.
+inline constexpr std::size_t MAX_NODES = (std::size_t{1} << 31) - 1;
 
-template <typename KeyTy> struct Node final {
-  using It = typename std::list<Node<KeyTy>>::iterator;
+// Multiplicity of a key in a set: always one, stored nowhere.
+struct SingleCount final {
+  constexpr SingleCount(std::uint32_t = 1) {}
+  constexpr operator std::uint32_t() const { return 1; }
+};
+
+// In a multiset (MULTI) a node holds all copies of its key: `count` of them,
+// and subtree_size sums the counts of the subtree.
+template <typename KeyTy, typename Augment = augment::None, bool MULTI = false>
+struct Node final {
+  using CountTy = std::conditional_t<MULTI, std::uint32_t, SingleCount>;
 
   KeyTy key;
-  Color color = Color::red;
-  std::optional<It> parent = std::nullopt;
-  std::optional<It> left = std::nullopt;
-  std::optional<It> right = std::nullopt;
-  std::size_t subtree_size = 1;
+  NodeIdx parent = NULL_IDX;
+  NodeIdx left = NULL_IDX;
+  NodeIdx right = NULL_IDX;
+  // The color is packed into the spare top bit of the subtree size.
+  std::uint32_t subtree_size : 31;
+  Color color : 1;
+  [[no_unique_address]] CountTy count;
+  // Aggregate of the subtree (see augmentation.hpp), no space if unused.
+  [[no_unique_address]] typename Augment::value_type aggregate;
+
+  Node(const KeyTy &key)
+      : key(key), subtree_size(1), color(Color::red), count(1),
+        aggregate(Augment::lift(key)) {}
+};
+
+// A stable handle to a node of the arena. Unlike a raw pointer it survives
+// the reallocation of the arena, so it stays valid across inserts, and the
+// tree keeps the arena on the heap, so it also survives moving the tree.
+template <typename KeyTy, typename Augment = augment::None, bool MULTI = false>
+class NodeIt final {
+  using NodeTy = Node<KeyTy, Augment, MULTI>;
+
+  const std::vector<NodeTy> *arena_ = nullptr;
+  NodeIdx idx_ = NULL_IDX;
+
+public:
+  NodeIt() = default;
+  NodeIt(const std::vector<NodeTy> *arena, NodeIdx idx)
+      : arena_(arena), idx_(idx) {}
+
+  const NodeTy &operator*() const { return (*arena_)[idx_]; }
+  const NodeTy *operator->() const { return &(*arena_)[idx_]; }
+  NodeIdx index() const { return idx_; }
 
-  Node(const KeyTy &key) : key(key) {}
+  bool operator==(const NodeIt &) const = default;
 };
 
-template <typename KeyTy>
-inline std::size_t size(std::optional<typename Node<KeyTy>::It> node_opt) {
+template <typename KeyTy, typename Augment, bool MULTI>
+inline std::size_t
+size(std::optional<NodeIt<KeyTy, Augment, MULTI>> node_opt) {
   return node_opt ? (*node_opt)->subtree_size : 0;
 }
 } // namespace RB_Tree
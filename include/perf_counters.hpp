@@ -0,0 +1,143 @@
+#pragma once
+
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace Perf {
+
+// Hardware counters of the calling thread, read with perf_event_open around
+// a phase of work. Events the kernel or the CPU refuses (no PMU in a VM,
+// perf_event_paranoid, non-Linux systems) are reported as unavailable; the
+// rest keep working.
+class Counters final {
+  struct Event final {
+    const char *name;
+    std::uint32_t type;
+    std::uint64_t config;
+    int fd = -1;
+    double value = 0; // scaled for multiplexing, last start() .. stop()
+  };
+
+  std::array<Event, 5> events_;
+  std::string error_;
+
+public:
+  Counters()
+      : events_{{
+#if defined(__linux__)
+            {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+            {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+            {"l1d-misses", PERF_TYPE_HW_CACHE,
+             cacheMiss(PERF_COUNT_HW_CACHE_L1D)},
+            {"llc-misses", PERF_TYPE_HW_CACHE,
+             cacheMiss(PERF_COUNT_HW_CACHE_LL)},
+            {"branch-misses", PERF_TYPE_HARDWARE,
+             PERF_COUNT_HW_BRANCH_MISSES},
+#else
+            {"cycles", 0, 0},
+            {"instructions", 0, 0},
+            {"l1d-misses", 0, 0},
+            {"llc-misses", 0, 0},
+            {"branch-misses", 0, 0},
+#endif
+        }} {
+#if defined(__linux__)
+    for (auto &event : events_) {
+      perf_event_attr attr{};
+      attr.size = sizeof(attr);
+      attr.type = event.type;
+      attr.config = event.config;
+      attr.disabled = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format =
+          PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+      event.fd = static_cast<int>(
+          ::syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+      if (event.fd < 0 && error_.empty())
+        error_ = std::string(event.name) + ": " + std::strerror(errno);
+    }
+#else
+    error_ = "perf_event_open is only available on Linux";
+#endif
+  }
+
+  Counters(const Counters &) = delete;
+  Counters &operator=(const Counters &) = delete;
+
+  ~Counters() {
+#if defined(__linux__)
+    for (auto &event : events_)
+      if (event.fd >= 0)
+        ::close(event.fd);
+#endif
+  }
+
+  // Reason the first unavailable event could not be opened, empty if all of
+  // them work.
+  const std::string &error() const { return error_; }
+
+  void start() {
+#if defined(__linux__)
+    for (auto &event : events_) {
+      if (event.fd < 0)
+        continue;
+      ::ioctl(event.fd, PERF_EVENT_IOC_RESET, 0);
+      ::ioctl(event.fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+  }
+
+  void stop() {
+#if defined(__linux__)
+    for (auto &event : events_) {
+      if (event.fd < 0)
+        continue;
+      ::ioctl(event.fd, PERF_EVENT_IOC_DISABLE, 0);
+
+      // value, time enabled, time running
+      std::uint64_t data[3] = {};
+      event.value = 0;
+      if (::read(event.fd, data, sizeof(data)) == sizeof(data) && data[2] > 0)
+        event.value = static_cast<double>(data[0]) *
+                      static_cast<double>(data[1]) /
+                      static_cast<double>(data[2]);
+    }
+#endif
+  }
+
+  // One "<phase> <event>/op: <value>" line per event, "n/a" for the events
+  // that could not be opened.
+  void report(std::ostream &os, std::string_view phase,
+              std::size_t ops) const {
+    for (const auto &event : events_) {
+      os << phase << ' ' << event.name << "/op: ";
+      if (event.fd < 0 || ops == 0)
+        os << "n/a\n";
+      else
+        os << event.value / static_cast<double>(ops) << '\n';
+    }
+  }
+
+private:
+#if defined(__linux__)
+  static constexpr std::uint64_t cacheMiss(std::uint64_t cache) {
+    return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+           (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  }
+#endif
+};
+} // namespace Perf
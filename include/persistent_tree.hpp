@@ -0,0 +1,260 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+
+#include "node.hpp"
+
+namespace RB_Tree {
+
+// Immutable red-black tree node. Nodes are shared between versions of a
+// PersistentTree and freed when the last version using them is gone.
+template <typename KeyTy> struct PersistentNode final {
+  using Ptr = std::shared_ptr<const PersistentNode>;
+
+  KeyTy key;
+  Ptr left, right;
+  std::size_t subtree_size;
+  Color color;
+
+  PersistentNode(const KeyTy &key_, Ptr left_, Ptr right_, Color color_)
+      : key(key_), left(std::move(left_)), right(std::move(right_)),
+        subtree_size(1 + sizeOf(left) + sizeOf(right)), color(color_) {}
+
+  static std::size_t sizeOf(const Ptr &node) {
+    return node ? node->subtree_size : 0;
+  }
+};
+
+// One version of a PersistentTree. It never changes, so any number of
+// threads may query the same snapshot without synchronization.
+template <typename KeyTy> class Snapshot final {
+  using NodeTy = PersistentNode<KeyTy>;
+  using Ptr = typename NodeTy::Ptr;
+
+  Ptr root_;
+
+public:
+  Snapshot() = default;
+  explicit Snapshot(Ptr root) : root_(std::move(root)) {}
+
+  std::size_t size() const { return NodeTy::sizeOf(root_); }
+
+  // Smallest key >= key.
+  std::optional<KeyTy> lowerBound(const KeyTy &key) const {
+    return bound(key, [](const KeyTy &node_key, const KeyTy &k) {
+      return node_key < k;
+    });
+  }
+
+  // Smallest key > key.
+  std::optional<KeyTy> upperBound(const KeyTy &key) const {
+    return bound(key, [](const KeyTy &node_key, const KeyTy &k) {
+      return !(k < node_key);
+    });
+  }
+
+  // Number of keys < key.
+  std::size_t countLess(const KeyTy &key) const {
+    return count(key, [](const KeyTy &node_key, const KeyTy &k) {
+      return node_key < k;
+    });
+  }
+
+  // Number of keys <= key.
+  std::size_t countLessEqual(const KeyTy &key) const {
+    return count(key, [](const KeyTy &node_key, const KeyTy &k) {
+      return !(k < node_key);
+    });
+  }
+
+  // Number of keys in [lo, hi].
+  std::size_t countRange(const KeyTy &lo, const KeyTy &hi) const {
+    if (hi < lo)
+      return 0;
+    return countLessEqual(hi) - countLess(lo);
+  }
+
+  bool verifyTree() const {
+    int black_height = 0;
+    return (!root_ || root_->color == Color::black) &&
+           checkNode(root_.get(), nullptr, nullptr, black_height);
+  }
+
+private:
+  template <typename GoRight>
+  std::optional<KeyTy> bound(const KeyTy &key, GoRight goRight) const {
+    const NodeTy *node = root_.get();
+    const NodeTy *result = nullptr;
+
+    while (node) {
+      if (goRight(node->key, key)) {
+        node = node->right.get();
+      } else {
+        result = node;
+        node = node->left.get();
+      }
+    }
+
+    return result ? std::optional<KeyTy>(result->key) : std::nullopt;
+  }
+
+  template <typename GoRight>
+  std::size_t count(const KeyTy &key, GoRight goRight) const {
+    const NodeTy *node = root_.get();
+    std::size_t result = 0;
+
+    while (node) {
+      if (goRight(node->key, key)) {
+        result += NodeTy::sizeOf(node->left) + 1;
+        node = node->right.get();
+      } else {
+        node = node->left.get();
+      }
+    }
+
+    return result;
+  }
+
+  // Checks ordering within (lo, hi), sizes, and the red and black rules.
+  static bool checkNode(const NodeTy *node, const KeyTy *lo, const KeyTy *hi,
+                        int &black_height) {
+    if (!node) {
+      black_height = 1;
+      return true;
+    }
+
+    if ((lo && !(*lo < node->key)) || (hi && !(node->key < *hi)))
+      return false;
+    if (node->subtree_size !=
+        1 + NodeTy::sizeOf(node->left) + NodeTy::sizeOf(node->right))
+      return false;
+    if (node->color == Color::red &&
+        ((node->left && node->left->color == Color::red) ||
+         (node->right && node->right->color == Color::red)))
+      return false;
+
+    int left_height = 0, right_height = 0;
+    if (!checkNode(node->left.get(), lo, &node->key, left_height) ||
+        !checkNode(node->right.get(), &node->key, hi, right_height) ||
+        left_height != right_height)
+      return false;
+
+    black_height = left_height + (node->color == Color::black);
+    return true;
+  }
+};
+
+// Red-black tree whose insert copies the path to the new key instead of
+// modifying nodes in place, then publishes the new root. snapshot() is a
+// reference-counted handle to the current version: readers keep querying it
+// while inserts go on, and the nodes only that version used are freed when
+// its last snapshot is dropped.
+//
+// Inserts are serialized with a mutex that snapshot() never takes, so readers
+// do not wait for writers. The root is a std::atomic<std::shared_ptr>, which
+// libstdc++ implements with a short internal lock rather than lock-free.
+template <typename KeyTy = int> class PersistentTree final {
+  using NodeTy = PersistentNode<KeyTy>;
+  using Ptr = typename NodeTy::Ptr;
+
+  std::atomic<Ptr> root_;
+  std::mutex write_mutex_;
+
+public:
+  PersistentTree() = default;
+
+  PersistentTree(const PersistentTree &) = delete;
+  PersistentTree &operator=(const PersistentTree &) = delete;
+
+  Snapshot<KeyTy> snapshot() const { return Snapshot<KeyTy>(root_.load()); }
+
+  void insert(const KeyTy &key) {
+    std::lock_guard lock(write_mutex_);
+
+    Ptr root = root_.load(std::memory_order_relaxed);
+    Ptr inserted = insertInto(root, key);
+    if (inserted == root)
+      return;
+
+    if (inserted->color == Color::red)
+      inserted = std::make_shared<const NodeTy>(
+          inserted->key, inserted->left, inserted->right, Color::black);
+    root_.store(std::move(inserted));
+  }
+
+private:
+  static bool isRed(const Ptr &node) {
+    return node && node->color == Color::red;
+  }
+
+  static Ptr make(const KeyTy &key, Ptr left, Ptr right, Color color) {
+    return std::make_shared<const NodeTy>(key, std::move(left),
+                                          std::move(right), color);
+  }
+
+  // Returns the new version of the subtree, or `node` itself if the key is
+  // already there.
+  static Ptr insertInto(const Ptr &node, const KeyTy &key) {
+    if (!node)
+      return make(key, nullptr, nullptr, Color::red);
+
+    if (key < node->key) {
+      Ptr left = insertInto(node->left, key);
+      if (left == node->left)
+        return node;
+      return balance(node->key, std::move(left), node->right, node->color);
+    }
+
+    if (node->key < key) {
+      Ptr right = insertInto(node->right, key);
+      if (right == node->right)
+        return node;
+      return balance(node->key, node->left, std::move(right), node->color);
+    }
+
+    return node;
+  }
+
+  // Okasaki's rebalancing: a black node with a red child and a red grandchild
+  // becomes a red node with two black children.
+  static Ptr balance(const KeyTy &key, Ptr left, Ptr right, Color color) {
+    if (color == Color::black) {
+      if (isRed(left) && isRed(left->left)) {
+        const auto &ll = left->left;
+        return make(left->key,
+                    make(ll->key, ll->left, ll->right, Color::black),
+                    make(key, left->right, std::move(right), Color::black),
+                    Color::red);
+      }
+      if (isRed(left) && isRed(left->right)) {
+        const auto &lr = left->right;
+        return make(lr->key,
+                    make(left->key, left->left, lr->left, Color::black),
+                    make(key, lr->right, std::move(right), Color::black),
+                    Color::red);
+      }
+      if (isRed(right) && isRed(right->left)) {
+        const auto &rl = right->left;
+        return make(rl->key,
+                    make(key, std::move(left), rl->left, Color::black),
+                    make(right->key, rl->right, right->right, Color::black),
+                    Color::red);
+      }
+      if (isRed(right) && isRed(right->right)) {
+        const auto &rr = right->right;
+        return make(right->key,
+                    make(key, std::move(left), right->left, Color::black),
+                    make(rr->key, rr->left, rr->right, Color::black),
+                    Color::red);
+      }
+    }
+
+    return make(key, std::move(left), std::move(right), color);
+  }
+};
+} // namespace RB_Tree
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cerrno>
+#include <charconv>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+#include <unistd.h>
+
+namespace Output {
+
+enum class Format {
+  text,  // "<answer> " per answer, as the drivers always printed
+  binary // 8-byte little-endian answer, two's complement if it is signed
+};
+
+// "--binary-output" anywhere on the command line selects the binary format.
+inline Format parseFormat(int argc, char **argv) {
+  for (int i = 1; i < argc; ++i)
+    if (std::string_view(argv[i]) == "--binary-output")
+      return Format::binary;
+  return Format::text;
+}
+
+// Collects query answers in a large reusable buffer and hands it to the file
+// descriptor in big writes. Anything else written to the same descriptor
+// (e.g. through std::cout) must come after flush().
+class ResultWriter final {
+  static constexpr std::size_t BUFFER_SIZE = 1 << 16;
+  // Enough for any 64-bit number and its separator.
+  static constexpr std::size_t MAX_RECORD = 24;
+
+  int fd_;
+  Format format_;
+  std::vector<char> buffer_;
+  std::size_t size_ = 0;
+
+public:
+  explicit ResultWriter(Format format = Format::text, int fd = STDOUT_FILENO)
+      : fd_(fd), format_(format), buffer_(BUFFER_SIZE) {}
+
+  ResultWriter(const ResultWriter &) = delete;
+  ResultWriter &operator=(const ResultWriter &) = delete;
+
+  ~ResultWriter() {
+    try {
+      flush();
+    } catch (...) {
+    }
+  }
+
+  // Counts of the q command and keys of the s command.
+  template <std::integral IntTy> void write(IntTy answer) {
+    if (buffer_.size() - size_ < MAX_RECORD)
+      flush();
+
+    char *out = buffer_.data() + size_;
+    if (format_ == Format::text) {
+      char *end = std::to_chars(out, out + MAX_RECORD - 1, answer).ptr;
+      *end++ = ' ';
+      size_ = end - buffer_.data();
+    } else {
+      auto bits = static_cast<std::uint64_t>(answer);
+      for (int byte = 0; byte < 8; ++byte)
+        out[byte] = static_cast<char>((bits >> (8 * byte)) & 0xFF);
+      size_ += 8;
+    }
+  }
+
+  void flush() {
+    const char *data = buffer_.data();
+    while (size_ > 0) {
+      ssize_t n = ::write(fd_, data, size_);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0) {
+        size_ = 0;
+        throw std::runtime_error("Failed to write the output");
+      }
+      data += n;
+      size_ -= static_cast<std::size_t>(n);
+    }
+  }
+};
+} // namespace Output
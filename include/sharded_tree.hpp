@@ -0,0 +1,278 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "tree.hpp"
+
+namespace RB_Tree {
+
+// Key-range partitioned set of Trees. Shard i holds the keys in
+// [bounds_[i - 1], bounds_[i]) and is owned by its own worker thread, so
+// inserts into different shards run in parallel.
+//
+// insert() only routes the key into a per-shard buffer; full buffers are
+// handed to the workers. Queries first wait until the keys inserted so far
+// into the shards they read have reached their trees, then read the trees on
+// the calling thread; an exception a worker hit is rethrown there. When one
+// shard grows well past its share, the bounds are moved to the quantiles of
+// a uniform sample of the inserted keys and the keys are redistributed.
+//
+// The methods of ShardedTree itself must be called from one thread.
+template <typename KeyTy = int> class ShardedTree final {
+  static constexpr std::size_t HANDOFF_SIZE = 1024;
+  static constexpr std::size_t SAMPLE_SIZE = 4096;
+  static constexpr std::size_t MIN_REBALANCE_SIZE = 1 << 14;
+  // Rebalancing starts when a shard holds over 3/2 of its share of keys.
+  static constexpr std::size_t SKEW_NUM = 3, SKEW_DEN = 2;
+
+  struct Shard final {
+    Tree<KeyTy> tree;
+    std::vector<KeyTy> buffer; // filled by the caller
+
+    std::mutex mutex;
+    std::condition_variable wake, idle;
+    std::vector<KeyTy> inbox; // handed to the worker
+    std::size_t handed = 0;   // keys handed off, by the caller
+    std::atomic<std::size_t> done = 0; // keys the worker is through with
+    std::exception_ptr error; // the worker's, set before `done` moves on
+    bool stop = false;
+    std::thread worker;
+  };
+
+  std::vector<std::unique_ptr<Shard>> shards_;
+  std::vector<KeyTy> bounds_; // shards_.size() - 1 increasing split keys
+
+  std::vector<KeyTy> sample_;
+  std::size_t inserted_ = 0; // insert() calls, duplicates included
+  std::size_t next_check_ = MIN_REBALANCE_SIZE;
+  std::size_t rebalances_ = 0;
+  std::mt19937_64 rng_;
+
+public:
+  // `bounds` are the initial split keys, one less than the number of shards.
+  explicit ShardedTree(std::vector<KeyTy> bounds)
+      : bounds_(std::move(bounds)) {
+    if (!std::is_sorted(bounds_.begin(), bounds_.end()))
+      throw std::invalid_argument("RB_Tree::ShardedTree: unsorted bounds");
+
+    for (std::size_t i = 0; i <= bounds_.size(); ++i) {
+      auto shard = std::make_unique<Shard>();
+      shard->worker = std::thread([s = shard.get()] { work(*s); });
+      shards_.push_back(std::move(shard));
+    }
+  }
+
+  ShardedTree(const ShardedTree &) = delete;
+  ShardedTree &operator=(const ShardedTree &) = delete;
+
+  ~ShardedTree() {
+    for (auto &shard : shards_) {
+      {
+        std::lock_guard lock(shard->mutex);
+        shard->stop = true;
+      }
+      shard->wake.notify_one();
+      shard->worker.join();
+    }
+  }
+
+  std::size_t shardCount() const { return shards_.size(); }
+  std::size_t rebalances() const { return rebalances_; }
+
+  void insert(const KeyTy &key) {
+    auto &shard = *shards_[shardOf(key)];
+    shard.buffer.push_back(key);
+    if (shard.buffer.size() >= HANDOFF_SIZE)
+      handOff(shard);
+
+    // Reservoir sampling: every inserted key is in the sample with the same
+    // probability.
+    ++inserted_;
+    if (sample_.size() < SAMPLE_SIZE) {
+      sample_.push_back(key);
+    } else {
+      std::size_t slot = rng_() % inserted_;
+      if (slot < SAMPLE_SIZE)
+        sample_[slot] = key;
+    }
+
+    if (inserted_ >= next_check_) {
+      sync();
+      rebalanceIfSkewed();
+      next_check_ = 2 * inserted_;
+    }
+  }
+
+  // Waits until all inserted keys are in the trees.
+  void sync() { sync(0, shards_.size() - 1); }
+
+  std::size_t size() {
+    sync();
+    std::size_t total = 0;
+    for (auto &shard : shards_)
+      total += shard->tree.size();
+    return total;
+  }
+
+  std::vector<std::size_t> shardSizes() {
+    sync();
+    std::vector<std::size_t> sizes;
+    for (auto &shard : shards_)
+      sizes.push_back(shard->tree.size());
+    return sizes;
+  }
+
+  // Number of keys in [lo, hi]: the shards strictly between those of lo and
+  // hi are counted whole.
+  std::size_t countRange(const KeyTy &lo, const KeyTy &hi) {
+    if (hi < lo)
+      return 0;
+
+    std::size_t first = shardOf(lo), last = shardOf(hi);
+    sync(first, last);
+    if (first == last)
+      return shards_[first]->tree.countRange(lo, hi);
+
+    std::size_t count = shards_[first]->tree.countRange(lo, hi);
+    for (std::size_t i = first + 1; i < last; ++i)
+      count += shards_[i]->tree.size();
+    return count + shards_[last]->tree.countLessEqual(hi);
+  }
+
+  bool verifyTree() {
+    sync();
+    for (std::size_t i = 0; i < shards_.size(); ++i) {
+      const auto &tree = shards_[i]->tree;
+      if (!tree.verifyTree())
+        return false;
+      if (i > 0 && tree.countLess(bounds_[i - 1]) != 0)
+        return false;
+      if (i < bounds_.size() &&
+          tree.countLess(bounds_[i]) != tree.size())
+        return false;
+    }
+    return true;
+  }
+
+private:
+  std::size_t shardOf(const KeyTy &key) const {
+    return std::upper_bound(bounds_.begin(), bounds_.end(), key) -
+           bounds_.begin();
+  }
+
+  // Waits for the shards [first, last] only. A shard whose worker is
+  // through with everything handed to it is not locked at all.
+  void sync(std::size_t first, std::size_t last) {
+    for (std::size_t i = first; i <= last; ++i)
+      handOff(*shards_[i]);
+
+    for (std::size_t i = first; i <= last; ++i) {
+      auto &shard = *shards_[i];
+      if (shard.done.load(std::memory_order_acquire) != shard.handed) {
+        std::unique_lock lock(shard.mutex);
+        shard.idle.wait(lock, [&] { return shard.done == shard.handed; });
+      }
+      // The worker is idle and leaves the error alone until the next
+      // hand-off.
+      if (shard.error)
+        std::rethrow_exception(std::exchange(shard.error, nullptr));
+    }
+  }
+
+  void handOff(Shard &shard) {
+    if (shard.buffer.empty())
+      return;
+
+    {
+      std::lock_guard lock(shard.mutex);
+      shard.inbox.insert(shard.inbox.end(), shard.buffer.begin(),
+                         shard.buffer.end());
+    }
+    shard.handed += shard.buffer.size();
+    shard.buffer.clear();
+    shard.wake.notify_one();
+  }
+
+  static void work(Shard &shard) {
+    std::vector<KeyTy> keys;
+    while (true) {
+      {
+        std::unique_lock lock(shard.mutex);
+        shard.wake.wait(lock,
+                        [&] { return shard.stop || !shard.inbox.empty(); });
+        if (shard.stop)
+          return;
+        std::swap(keys, shard.inbox);
+      }
+
+      // After an error the rest of the keys is dropped and the error is
+      // passed to the caller rather than ending the process.
+      std::exception_ptr error;
+      try {
+        for (const auto &key : keys)
+          shard.tree.insert(key);
+      } catch (...) {
+        error = std::current_exception();
+      }
+
+      {
+        std::lock_guard lock(shard.mutex);
+        if (error && !shard.error)
+          shard.error = error;
+        shard.done.fetch_add(keys.size(), std::memory_order_release);
+      }
+      shard.idle.notify_all();
+      keys.clear();
+    }
+  }
+
+  // Called with the workers idle.
+  void rebalanceIfSkewed() {
+    std::size_t total = 0, largest = 0;
+    for (auto &shard : shards_) {
+      std::size_t n = shard->tree.size();
+      total += n;
+      largest = std::max(largest, n);
+    }
+
+    if (shards_.size() < 2 || total < MIN_REBALANCE_SIZE ||
+        largest * shards_.size() * SKEW_DEN <= total * SKEW_NUM)
+      return;
+
+    std::vector<KeyTy> sample = sample_;
+    std::sort(sample.begin(), sample.end());
+    std::vector<KeyTy> bounds;
+    for (std::size_t i = 1; i < shards_.size(); ++i)
+      bounds.push_back(sample[i * sample.size() / shards_.size()]);
+    if (bounds == bounds_)
+      return;
+
+    std::vector<KeyTy> keys;
+    keys.reserve(total);
+    for (auto &shard : shards_) {
+      keys.insert(keys.end(), shard->tree.begin(), shard->tree.end());
+      shard->tree = Tree<KeyTy>();
+    }
+
+    bounds_ = std::move(bounds);
+    std::vector<std::vector<KeyTy>> parts(shards_.size());
+    for (const auto &key : keys)
+      parts[shardOf(key)].push_back(key);
+    for (std::size_t i = 0; i < shards_.size(); ++i)
+      shards_[i]->tree.assign(parts[i].begin(), parts[i].end());
+
+    ++rebalances_;
+  }
+};
+} // namespace RB_Tree
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace Parallel {
+
+// "--threads N" on the command line; all hardware threads by default.
+inline unsigned parseThreads(int argc, char **argv) {
+  for (int i = 1; i < argc; ++i) {
+    if (std::string_view(argv[i]) != "--threads")
+      continue;
+
+    std::string_view value = i + 1 < argc ? argv[i + 1] : "";
+    unsigned threads = 0;
+    auto [ptr, ec] =
+        std::from_chars(value.data(), value.data() + value.size(), threads);
+    if (ec != std::errc() || ptr != value.data() + value.size() ||
+        threads == 0)
+      throw std::invalid_argument("--threads expects a positive number, got '" +
+                                  std::string(value) + "'");
+    return threads;
+  }
+
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Fixed set of worker threads for data-parallel loops. The calling thread
+// takes part in every loop, so a pool of one thread runs everything inline.
+class ThreadPool final {
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+  std::condition_variable start_, finish_;
+
+  std::function<void(std::size_t, std::size_t)> job_;
+  std::size_t job_size_ = 0;
+  std::size_t chunk_ = 1;
+  std::atomic<std::size_t> next_ = 0;
+  std::size_t generation_ = 0;
+  std::size_t busy_ = 0;
+  bool stop_ = false;
+
+public:
+  explicit ThreadPool(unsigned threads) {
+    for (unsigned i = 1; i < threads; ++i)
+      workers_.emplace_back([this] { work(); });
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  ~ThreadPool() {
+    {
+      std::lock_guard lock(mutex_);
+      stop_ = true;
+    }
+    start_.notify_all();
+    for (auto &worker : workers_)
+      worker.join();
+  }
+
+  unsigned size() const { return static_cast<unsigned>(workers_.size()) + 1; }
+
+  // Calls body(begin, end) on disjoint chunks covering [0, n) and returns
+  // when all of them are done. body must not throw.
+  template <typename Body> void parallelFor(std::size_t n, Body body) {
+    if (workers_.empty() || n <= 1) {
+      if (n > 0)
+        body(std::size_t{0}, n);
+      return;
+    }
+
+    {
+      std::lock_guard lock(mutex_);
+      job_ = body;
+      job_size_ = n;
+      // A few chunks per thread even out uneven chunk costs.
+      chunk_ = std::max<std::size_t>(1, n / (4 * size()));
+      next_ = 0;
+      busy_ = workers_.size();
+      ++generation_;
+    }
+    start_.notify_all();
+
+    runChunks();
+
+    std::unique_lock lock(mutex_);
+    finish_.wait(lock, [this] { return busy_ == 0; });
+    job_ = nullptr;
+  }
+
+private:
+  void runChunks() {
+    while (true) {
+      std::size_t begin = next_.fetch_add(chunk_);
+      if (begin >= job_size_)
+        return;
+      job_(begin, std::min(begin + chunk_, job_size_));
+    }
+  }
+
+  void work() {
+    std::size_t seen = 0;
+    while (true) {
+      {
+        std::unique_lock lock(mutex_);
+        start_.wait(lock, [&] { return stop_ || generation_ != seen; });
+        if (stop_)
+          return;
+        seen = generation_;
+      }
+
+      runChunks();
+
+      std::lock_guard lock(mutex_);
+      if (--busy_ == 0)
+        finish_.notify_one();
+    }
+  }
+};
+} // namespace Parallel
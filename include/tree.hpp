@@ -1,126 +1,538 @@
 #pragma once
 
+#include <algorithm>
+#include <bit>
+#include <concepts>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <ranges>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "augmentation.hpp"
 #include "node.hpp"
 
-namespace RB_Tree {
-template <typename KeyTy = int> class Tree final {
-  using NodeTy = Node<KeyTy>;
-  using It = typename std::list<NodeTy>::iterator;
+namespace Parallel {
+class ThreadPool;
+} // namespace Parallel
 
-  std::optional<It> root_ = std::nullopt;
-  std::list<NodeTy> nodes_;
+namespace RB_Tree {
+template <typename KeyTy, typename Compare> class FrozenIndex;
+
+// A comparator with a nested is_transparent type (such as std::less<>)
+// compares keys with other types directly.
+template <typename Compare>
+concept TransparentCompare = requires { typename Compare::is_transparent; };
+
+// Types a tree lookup accepts: the key type itself or, with a transparent
+// comparator, anything the comparator accepts.
+template <typename K, typename KeyTy, typename Compare>
+concept LookupKey = std::same_as<K, KeyTy> || TransparentCompare<Compare>;
+
+// Augment is a policy that keeps a monoid aggregate of every subtree next to
+// subtree_size (see augmentation.hpp); the default keeps only the size.
+// With MULTI the tree is a multiset: repeated keys are counted in their node
+// instead of being dropped, and sizes, ranks and counts include the repeats.
+// Iterators still visit each key once; its node's count says how many times.
+template <typename KeyTy = int, typename Compare = std::less<KeyTy>,
+          typename Augment = augment::None, bool MULTI = false>
+class Tree final {
+  static_assert(augment::Monoid<Augment, KeyTy>,
+                "Augment must be a monoid policy over the keys");
+
+  using NodeTy = Node<KeyTy, Augment, MULTI>;
+  using It = NodeIt<KeyTy, Augment, MULTI>;
+  using AggregateTy = typename Augment::value_type;
+
+  static constexpr bool AUGMENTED = !std::is_same_v<Augment, augment::None>;
+
+  // Arithmetic keys in their natural order are compared with the built-in
+  // operator and searched by the branchless descent (see descend()).
+  static constexpr bool BUILTIN_ORDER =
+      std::is_arithmetic_v<KeyTy> &&
+      (std::is_same_v<Compare, std::less<KeyTy>> ||
+       std::is_same_v<Compare, std::less<>>);
+
+  // The nodes live in a heap-allocated arena, so that handles, which point
+  // at the arena, survive moving the tree. split and extractRange hand their
+  // result a share of the arena instead of copying nodes into a new one, and
+  // a tree that goes away gives its nodes back to the shared free list.
+  // Trees sharing an arena must not be used concurrently with a change to
+  // any of them.
+  struct Arena final {
+    std::vector<NodeTy> nodes;
+    // Roots of erased subtrees, linked through `parent`; inserts reuse their
+    // nodes before growing the arena.
+    NodeIdx free = NULL_IDX;
+  };
+
+  NodeIdx root_ = NULL_IDX;
+  std::shared_ptr<Arena> arena_ = std::make_shared<Arena>();
+  [[no_unique_address]] Compare comp_;
 
 public:
   Tree() = default;
-  ~Tree() = default;
+  explicit Tree(const Compare &comp) : comp_(comp) {}
+  ~Tree() {
+    if (root_ != NULL_IDX && arena_.use_count() > 1)
+      release(root_);
+  }
+
+  template <typename InputIt>
+  Tree(InputIt first, InputIt last, const Compare &comp = Compare())
+      : comp_(comp) {
+    assign(first, last);
+  }
 
   Tree(const Tree &) = delete;
   Tree &operator=(const Tree &) = delete;
 
-  Tree(Tree &&other)
-      : root_(std::move(other.root_)), nodes_(std::move(other.nodes_)) {
-    other.root_ = std::nullopt;
+  // Moving hands the arena over: handles to the nodes stay valid and refer
+  // to the target. Iterators refer to the tree object and do not.
+  Tree(Tree &&other) : root_(other.root_), comp_(std::move(other.comp_)) {
+    std::swap(arena_, other.arena_);
+    other.root_ = NULL_IDX;
   }
 
   Tree &operator=(Tree &&other) {
     if (this != &other) {
-      root_ = std::move(other.root_);
-      nodes_ = std::move(other.nodes_);
-      other.root_ = std::nullopt;
+      clearArena();
+      root_ = other.root_;
+      comp_ = std::move(other.comp_);
+      std::swap(arena_, other.arena_);
+      other.root_ = NULL_IDX;
     }
 
     return *this;
   }
 
-  auto get_root() const { return root_; }
-  const std::list<NodeTy> &get_nodes() const & { return nodes_; }
-  std::list<NodeTy> &&get_nodes() && { return std::move(nodes_); }
+  std::optional<It> get_root() const { return makeIt(root_); }
+  // The whole arena, with the nodes of the trees it is shared with.
+  const std::vector<NodeTy> &get_nodes() const & { return arena_->nodes; }
+  std::vector<NodeTy> &&get_nodes() && {
+    if (arena_.use_count() > 1)
+      arena_ = std::make_shared<Arena>(*arena_);
+    return std::move(arena_->nodes);
+  }
+  const Compare &key_comp() const { return comp_; }
   bool verifyTree() const;
 
   void insert(const KeyTy &key);
-  std::optional<It> lowerBound(const KeyTy &key) const;
-  std::optional<It> upperBound(const KeyTy &key) const;
+  template <typename InputIt> void assign(InputIt first, InputIt last);
+  // Inserts a batch of keys in any order (see tree_batch.hpp). It is sorted
+  // and deduplicated on the pool, then merged in by a join-based union that
+  // keeps node handles valid or, when the batch dwarfs the tree, by a
+  // rebuild that, like assign, does not.
+  void insertBatch(std::span<const KeyTy> keys, Parallel::ThreadPool &pool);
+  void insertBatch(std::span<const KeyTy> keys);
   std::size_t getRank(std::optional<It> node_opt) const;
   std::size_t distance(std::optional<It> first_opt,
                        std::optional<It> last_opt) const;
 
+  // Lookups take a KeyTy or, with a transparent comparator, any type it
+  // compares with keys, so probing never has to build a key.
+  template <LookupKey<KeyTy, Compare> K>
+  std::optional<It> lowerBound(const K &key) const;
+  template <LookupKey<KeyTy, Compare> K>
+  std::optional<It> upperBound(const K &key) const;
+
+  // Top-down rank queries: they are answered from subtree_size in a single
+  // descent and never walk parent links.
+  template <LookupKey<KeyTy, Compare> K>
+  std::size_t countLess(const K &key) const;
+  template <LookupKey<KeyTy, Compare> K>
+  std::size_t countLessEqual(const K &key) const;
+  template <LookupKey<KeyTy, Compare> K>
+  std::size_t countRange(const K &lo, const K &hi) const;
+
+  // Non-template overloads keep implicit conversions to KeyTy working.
+  std::optional<It> lowerBound(const KeyTy &key) const {
+    return lowerBound<KeyTy>(key);
+  }
+  std::optional<It> upperBound(const KeyTy &key) const {
+    return upperBound<KeyTy>(key);
+  }
+  std::size_t countLess(const KeyTy &key) const {
+    return countLess<KeyTy>(key);
+  }
+  std::size_t countLessEqual(const KeyTy &key) const {
+    return countLessEqual<KeyTy>(key);
+  }
+  std::size_t countRange(const KeyTy &lo, const KeyTy &hi) const {
+    return countRange<KeyTy>(lo, hi);
+  }
+
+  // Order statistics: the node of rank k (counted from 0) and the rank a key
+  // has or would have, both in one descent.
+  std::optional<It> select(std::size_t k) const { return makeIt(selectIdx(k)); }
+  template <LookupKey<KeyTy, Compare> K> std::size_t rank(const K &key) const {
+    return countLess(key);
+  }
+  std::size_t rank(const KeyTy &key) const { return countLess(key); }
+  std::size_t size() const { return sizeOf(root_); }
+
+  class Iterator;
+  Iterator begin() const { return Iterator(this, leftmost(root_)); }
+  Iterator end() const { return Iterator(this, NULL_IDX); }
+  // Iterator at rank k, end() if there is no such rank.
+  Iterator iteratorAt(std::size_t k) const {
+    return Iterator(this, selectIdx(k));
+  }
+  // The keys of ranks [first, last).
+  std::ranges::subrange<Iterator> ranks(std::size_t first,
+                                        std::size_t last) const {
+    return {iteratorAt(first), iteratorAt(std::max(first, last))};
+  }
+
+  // Erased nodes go to a free list that later inserts take from, so steady
+  // insert/erase churn does not grow the arena. Handles and iterators to
+  // other nodes stay valid; those to an erased node may later see a new key.
+  // erase(key) returns the number of keys removed: every copy in a multiset.
+  template <LookupKey<KeyTy, Compare> K> std::size_t erase(const K &key);
+  std::size_t erase(const KeyTy &key) { return erase<KeyTy>(key); }
+  // Removes the key under `pos` and returns the iterator to the next one.
+  Iterator erase(Iterator pos);
+  // Removes a single copy of the key from a multiset.
+  bool eraseOne(const KeyTy &key)
+    requires MULTI;
+
+  // Red-black join and split in O(log n): they relink nodes within the
+  // arena and keep colors, sizes and aggregates. The trees split off one
+  // another share the arena, so no node is copied and every handle stays
+  // valid. Joining trees with different arenas copies the smaller one into
+  // the other's arena, in O(log n + min(|left|, |right|)), and invalidates
+  // its handles.
+  // join requires every key of `left` < key < every key of `right`.
+  static Tree join(Tree &&left, const KeyTy &key, Tree &&right);
+  // Keys not less than `key` move to the returned tree.
+  template <LookupKey<KeyTy, Compare> K> Tree split(const K &key);
+  Tree split(const KeyTy &key) { return split<KeyTy>(key); }
+  // The keys in [lo, hi]: eraseRange returns how many were removed, their
+  // nodes go to the free list in O(1).
+  template <LookupKey<KeyTy, Compare> K>
+  std::size_t eraseRange(const K &lo, const K &hi);
+  template <LookupKey<KeyTy, Compare> K>
+  Tree extractRange(const K &lo, const K &hi);
+  std::size_t eraseRange(const KeyTy &lo, const KeyTy &hi) {
+    return eraseRange<KeyTy>(lo, hi);
+  }
+  Tree extractRange(const KeyTy &lo, const KeyTy &hi) {
+    return extractRange<KeyTy>(lo, hi);
+  }
+
+  // Aggregate of the keys in [lo, hi], folded in key order, from at most two
+  // root-to-leaf paths.
+  template <LookupKey<KeyTy, Compare> K>
+  AggregateTy aggregate(const K &lo, const K &hi) const
+    requires AUGMENTED;
+  AggregateTy aggregate(const KeyTy &lo, const KeyTy &hi) const
+    requires AUGMENTED
+  {
+    return aggregate<KeyTy>(lo, hi);
+  }
+
+  // Read-only Eytzinger-ordered copy of the keys (see frozen_index.hpp).
+  FrozenIndex<KeyTy, Compare> freeze() const;
+
+  // Checksummed image of the node arena (see tree_image.hpp): load maps the
+  // file and copies the nodes as they are, without rebalancing; `verify`
+  // additionally runs verifyTree on the result. The comparator is not
+  // saved: load takes the one the tree was built with.
+  void save(const std::string &path) const;
+  static Tree load(const std::string &path, bool verify = false,
+                   const Compare &comp = Compare());
+
 private:
-  void rotateLeft(It node);
-  void rotateRight(It node);
-  void balanceTree(It node);
+  std::optional<It> makeIt(NodeIdx idx) const {
+    if (idx == NULL_IDX)
+      return std::nullopt;
+    return It(&arena_->nodes, idx);
+  }
 
-  bool checkRedProperty(std::optional<It> node_opt) const;
-  bool checkBlackHeight(std::optional<It> node_opt, int black_count,
-                        int &path_black_count) const;
-  bool checkBSTProperty(std::optional<It> node_opt, std::optional<It> min,
-                        std::optional<It> max) const;
-  bool checkParentLinks(std::optional<It> node_opt,
-                        std::optional<It> parent_opt) const;
-  bool checkSubtreeSizes(std::optional<It> node_opt) const;
-};
+  template <typename Lhs, typename Rhs>
+  bool less(const Lhs &lhs, const Rhs &rhs) const {
+    if constexpr (BUILTIN_ORDER)
+      return lhs < rhs;
+    else
+      return comp_(lhs, rhs);
+  }
 
-template <typename KeyTy>
-std::optional<typename Tree<KeyTy>::It>
-Tree<KeyTy>::lowerBound(const KeyTy &key) const {
-  if (!root_)
-    return std::nullopt;
+  std::size_t sizeOf(NodeIdx idx) const {
+    return idx == NULL_IDX ? 0 : arena_->nodes[idx].subtree_size;
+  }
 
-  std::optional<It> current = root_;
-  std::optional<It> candidate;
+  // Keys held by the node itself: one in a set.
+  static std::size_t weight(const NodeTy &node) { return node.count; }
 
-  while (current) {
-    auto &node = **current;
-    if (node.key >= key) {
-      candidate = current;
-      current = node.left;
+  AggregateTy aggregateOf(NodeIdx idx) const {
+    return idx == NULL_IDX ? Augment::identity() : arena_->nodes[idx].aggregate;
+  }
+
+  // The aggregate of all copies of the node's key, by repeated doubling.
+  static AggregateTy liftNode(const NodeTy &node) {
+    AggregateTy single = Augment::lift(node.key);
+    if constexpr (MULTI) {
+      AggregateTy result = Augment::identity();
+      for (std::uint32_t count = node.count; count > 0; count >>= 1) {
+        if (count & 1)
+          result = Augment::combine(result, single);
+        single = Augment::combine(single, single);
+      }
+      return result;
     } else {
-      current = node.right;
+      return single;
     }
   }
 
-  return candidate;
-}
+  // Recomputes the aggregate of a node from its children, wherever the
+  // subtree size is recomputed.
+  void pull(NodeIdx idx) {
+    if constexpr (AUGMENTED) {
+      auto &node = arena_->nodes[idx];
+      node.aggregate = Augment::combine(
+          Augment::combine(aggregateOf(node.left), liftNode(node)),
+          aggregateOf(node.right));
+    }
+  }
 
-template <typename KeyTy>
-std::optional<typename Tree<KeyTy>::It>
-Tree<KeyTy>::upperBound(const KeyTy &key) const {
-  if (!root_)
-    return std::nullopt;
+  // Where a descent fell off the tree.
+  struct Descent final {
+    NodeIdx last = NULL_IDX;  // the node whose null link was reached
+    NodeIdx bound = NULL_IDX; // the last node where the descent went left
+    bool went_right = false;  // the side of the null link under `last`
+    std::size_t count = 0;    // nodes left of the path, if counted
+  };
+
+  template <bool COUNT, typename GoRight>
+  Descent descend(NodeIdx start, GoRight goRight) const;
+
+  void prefetch(NodeIdx idx) const {
+    // Only the address is computed, NULL_IDX is harmless.
+    auto addr = reinterpret_cast<std::uintptr_t>(arena_->nodes.data()) +
+                std::uintptr_t{idx} * sizeof(NodeTy);
+    __builtin_prefetch(reinterpret_cast<const void *>(addr));
+  }
 
-  std::optional<It> current = root_;
-  std::optional<It> candidate;
+  NodeIdx selectIdx(std::size_t k) const;
+  NodeIdx leftmost(NodeIdx idx) const;
+  NodeIdx rightmost(NodeIdx idx) const;
+  NodeIdx successor(NodeIdx idx) const;
+  NodeIdx predecessor(NodeIdx idx) const;
+  template <typename Visit> void forEachInOrder(Visit visit) const;
+
+  template <typename NodeAt>
+  NodeIdx buildBalanced(NodeIdx lo, NodeIdx hi, NodeIdx parent, int depth,
+                        int red_depth, NodeAt nodeAt);
+
+  NodeIdx allocate(const KeyTy &key);
+  void release(NodeIdx root);
+  void clearArena();
+  void transplant(NodeIdx old_idx, NodeIdx new_idx);
+  void eraseNode(NodeIdx node);
+  void eraseFixup(NodeIdx node, NodeIdx parent);
+
+  // A subtree detached from the tree and its black height, which join and
+  // split keep track of instead of measuring it at every step.
+  struct Piece final {
+    NodeIdx root = NULL_IDX;
+    int height = 0;
+  };
+
+  Piece piece(NodeIdx root) const;
+  Piece joinNodes(Piece left, NodeIdx mid, Piece right);
+  Piece joinNodes(Piece left, Piece right);
+  template <typename InLeft>
+  std::pair<Piece, Piece> splitNodes(Piece root, InLeft inLeft);
+  NodeIdx copySubtree(const Tree &from, NodeIdx idx, NodeIdx parent);
+  Tree takeSubtree(NodeIdx part);
+  template <typename NodeAt>
+  Piece buildPiece(NodeIdx lo, NodeIdx hi, NodeAt nodeAt);
+
+  // Batch insert (see tree_batch.hpp): the new keys sit in the nodes
+  // `fresh`, in key order, and `merged` flags those whose key the tree
+  // already had. A task merges a slice [lo, hi) of them into one subtree;
+  // the program joins the task results back under the top levels.
+  struct BatchNodes final {
+    std::vector<NodeIdx> fresh;
+    std::vector<char> merged;
+  };
+
+  struct UnionTask final {
+    Piece tree;
+    NodeIdx lo, hi;
+    Piece result;
+  };
+
+  NodeIdx partitionBatch(NodeIdx lo, NodeIdx hi, const KeyTy &key,
+                         const BatchNodes &incoming) const;
+  Piece unite(Piece tree, NodeIdx lo, NodeIdx hi, BatchNodes &incoming);
+  void planUnion(Piece tree, NodeIdx lo, NodeIdx hi, int depth,
+                 BatchNodes &incoming, std::vector<UnionTask> &tasks,
+                 std::vector<NodeIdx> &program);
+  void rebuildWith(const BatchNodes &incoming);
+
+  // `root` is the root slot of the tree being rebalanced: root_, or a local
+  // one for a detached subtree, so that joins of disjoint subtrees share no
+  // state and can run concurrently.
+  void rotateLeft(NodeIdx node, NodeIdx &root);
+  void rotateRight(NodeIdx node, NodeIdx &root);
+  bool balanceTree(NodeIdx node, NodeIdx &root);
+
+  bool checkRedProperty(NodeIdx node_idx) const;
+  bool checkBlackHeight(NodeIdx node_idx, int black_count,
+                        int &path_black_count) const;
+  bool checkBSTProperty(NodeIdx node_idx, NodeIdx min, NodeIdx max) const;
+  bool checkParentLinks(NodeIdx node_idx, NodeIdx parent_idx) const;
+  bool checkSubtreeSizes(NodeIdx node_idx) const;
+  bool checkAggregates(NodeIdx node_idx) const;
+  bool checkFreeList(std::vector<bool> &seen) const;
+};
 
-  while (current) {
-    auto &node = **current;
-    if (key < node.key) {
-      candidate = current;
-      current = node.left;
+// A Tree that keeps repeated keys (see MULTI).
+template <typename KeyTy = int, typename Compare = std::less<KeyTy>,
+          typename Augment = augment::None>
+using MultiTree = Tree<KeyTy, Compare, Augment, true>;
+
+// Bidirectional in-order iterator over the keys. Like NodeIt it holds an
+// index into the arena, so it stays valid across inserts, though an insert
+// may change which key follows it.
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+class Tree<KeyTy, Compare, Augment, MULTI>::Iterator final {
+  const Tree *tree_ = nullptr;
+  NodeIdx idx_ = NULL_IDX;
+
+public:
+  using iterator_category = std::bidirectional_iterator_tag;
+  using value_type = KeyTy;
+  using difference_type = std::ptrdiff_t;
+  using pointer = const KeyTy *;
+  using reference = const KeyTy &;
+
+  Iterator() = default;
+  Iterator(const Tree *tree, NodeIdx idx) : tree_(tree), idx_(idx) {}
+
+  reference operator*() const { return tree_->arena_->nodes[idx_].key; }
+  pointer operator->() const { return &tree_->arena_->nodes[idx_].key; }
+  // The node under the iterator, nullopt at end().
+  std::optional<It> node() const { return tree_->makeIt(idx_); }
+
+  Iterator &operator++() {
+    idx_ = tree_->successor(idx_);
+    return *this;
+  }
+
+  Iterator operator++(int) {
+    Iterator old = *this;
+    ++*this;
+    return old;
+  }
+
+  Iterator &operator--() {
+    idx_ = idx_ == NULL_IDX ? tree_->rightmost(tree_->root_)
+                            : tree_->predecessor(idx_);
+    return *this;
+  }
+
+  Iterator operator--(int) {
+    Iterator old = *this;
+    --*this;
+    return old;
+  }
+
+  bool operator==(const Iterator &) const = default;
+};
+
+// Descends from `start` to a null link, going right wherever
+// goRight(node key) holds; with COUNT it also sums the sizes of the subtrees
+// passed on the left. For arithmetic keys in their natural order the next
+// child is selected with a mask instead of a branch, which random probes
+// mispredict half the time, and both children are prefetched before the
+// comparison so the next level's miss overlaps it.
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+template <bool COUNT, typename GoRight>
+typename Tree<KeyTy, Compare, Augment, MULTI>::Descent
+Tree<KeyTy, Compare, Augment, MULTI>::descend(
+    NodeIdx start, GoRight goRight) const {
+  Descent result;
+  NodeIdx current = start;
+
+  while (current != NULL_IDX) {
+    const auto &node = arena_->nodes[current];
+    result.last = current;
+
+    if constexpr (BUILTIN_ORDER) {
+      prefetch(node.left);
+      prefetch(node.right);
+
+      bool right = goRight(node.key);
+      auto mask = NodeIdx{0} - static_cast<NodeIdx>(right);
+      result.went_right = right;
+      result.bound = (result.bound & mask) | (current & ~mask);
+      if constexpr (COUNT)
+        result.count +=
+            (sizeOf(node.left) + weight(node)) & (std::size_t{0} - right);
+      current = (node.right & mask) | (node.left & ~mask);
     } else {
-      current = node.right;
+      result.went_right = goRight(node.key);
+      if (result.went_right) {
+        if constexpr (COUNT)
+          result.count += sizeOf(node.left) + weight(node);
+        current = node.right;
+      } else {
+        result.bound = current;
+        current = node.left;
+      }
     }
   }
 
-  return candidate;
+  return result;
+}
+
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+template <LookupKey<KeyTy, Compare> K>
+std::optional<typename Tree<KeyTy, Compare, Augment, MULTI>::It>
+Tree<KeyTy, Compare, Augment, MULTI>::lowerBound(const K &key) const {
+  auto descent = descend<false>(root_, [this, &key](const KeyTy &node_key) {
+    return less(node_key, key);
+  });
+  return makeIt(descent.bound);
 }
 
-template <typename KeyTy>
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+template <LookupKey<KeyTy, Compare> K>
+std::optional<typename Tree<KeyTy, Compare, Augment, MULTI>::It>
+Tree<KeyTy, Compare, Augment, MULTI>::upperBound(const K &key) const {
+  auto descent = descend<false>(root_, [this, &key](const KeyTy &node_key) {
+    return !less(key, node_key);
+  });
+  return makeIt(descent.bound);
+}
+
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
 std::size_t
-Tree<KeyTy>::getRank(std::optional<typename Tree<KeyTy>::It> node_opt) const {
-  if (!root_ || !node_opt)
+Tree<KeyTy, Compare, Augment, MULTI>::getRank(
+    std::optional<It> node_opt) const {
+  if (root_ == NULL_IDX || !node_opt)
     return 0;
 
-  auto node = *node_opt;
-  std::size_t rank = size<KeyTy>(node->left);
-  auto current = node;
+  NodeIdx current = node_opt->index();
+  std::size_t rank = sizeOf(arena_->nodes[current].left);
 
   while (true) {
-    auto parent_opt = current->parent;
-    if (!parent_opt)
+    NodeIdx parent = arena_->nodes[current].parent;
+    if (parent == NULL_IDX)
       break;
 
-    auto parent = *parent_opt;
-    if (current == parent->right)
-      rank += 1 + size<KeyTy>(parent->left);
+    const auto &parent_node = arena_->nodes[parent];
+    if (current == parent_node.right)
+      rank += weight(parent_node) + sizeOf(parent_node.left);
 
     current = parent;
   }
@@ -128,18 +540,18 @@ Tree<KeyTy>::getRank(std::optional<typename Tree<KeyTy>::It> node_opt) const {
   return rank;
 }
 
-template <typename KeyTy>
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
 std::size_t
-Tree<KeyTy>::distance(std::optional<typename Tree<KeyTy>::It> first_opt,
-                      std::optional<typename Tree<KeyTy>::It> last_opt) const {
-  if (!root_ || !first_opt)
+Tree<KeyTy, Compare, Augment, MULTI>::distance(
+    std::optional<It> first_opt, std::optional<It> last_opt) const {
+  if (root_ == NULL_IDX || !first_opt)
     return 0;
 
   if (first_opt == last_opt)
     return 0;
 
   if (!last_opt)
-    return (*root_)->subtree_size - getRank(first_opt);
+    return arena_->nodes[root_].subtree_size - getRank(first_opt);
 
   std::size_t r1 = getRank(first_opt);
   std::size_t r2 = getRank(last_opt);
@@ -147,97 +559,376 @@ Tree<KeyTy>::distance(std::optional<typename Tree<KeyTy>::It> first_opt,
   return (r2 >= r1) ? (r2 - r1) : 0;
 }
 
-template <typename KeyTy> void Tree<KeyTy>::insert(const KeyTy &key) {
-  if (!root_) {
-    nodes_.emplace_back(key);
-    root_ = std::prev(nodes_.end());
-    (*root_)->color = Color::black;
-    return;
+// Goes left while k is inside the left subtree and right, skipping the
+// left subtree and the node, while it is past it.
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+NodeIdx Tree<KeyTy, Compare, Augment, MULTI>::selectIdx(std::size_t k) const {
+  NodeIdx current = root_;
+
+  while (current != NULL_IDX) {
+    const auto &node = arena_->nodes[current];
+    std::size_t left_size = sizeOf(node.left);
+    if (k < left_size) {
+      current = node.left;
+    } else if (k < left_size + weight(node)) {
+      return current;
+    } else {
+      k -= left_size + weight(node);
+      current = node.right;
+    }
   }
 
-  It current = *root_;
-  std::optional<It> parent;
+  return NULL_IDX;
+}
 
-  while (true) {
-    parent = current;
-    auto &current_node = *current;
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+template <LookupKey<KeyTy, Compare> K>
+std::size_t
+Tree<KeyTy, Compare, Augment, MULTI>::countLess(const K &key) const {
+  return descend<true>(root_, [this, &key](const KeyTy &node_key) {
+           return less(node_key, key);
+         }).count;
+}
 
-    if (key < current_node.key) {
-      if (current_node.left)
-        current = *current_node.left;
-      else
-        break;
-    } else if (key > current_node.key) {
-      if (current_node.right)
-        current = *current_node.right;
-      else
-        break;
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+template <LookupKey<KeyTy, Compare> K>
+std::size_t
+Tree<KeyTy, Compare, Augment, MULTI>::countLessEqual(const K &key) const {
+  return descend<true>(root_, [this, &key](const KeyTy &node_key) {
+           return !less(key, node_key);
+         }).count;
+}
+
+// Number of keys in [lo, hi]. Both bounds descend together until the split
+// node (the first node inside the range), after which each bound needs only
+// one descent in its own subtree of the split node. The bounds are only
+// compared with keys: for hi < lo no key is inside both, and the split
+// descent falls off the tree.
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+template <LookupKey<KeyTy, Compare> K>
+std::size_t
+Tree<KeyTy, Compare, Augment, MULTI>::countRange(
+    const K &lo, const K &hi) const {
+  NodeIdx split = root_;
+  while (split != NULL_IDX) {
+    const auto &node = arena_->nodes[split];
+    if (less(node.key, lo))
+      split = node.right;
+    else if (less(hi, node.key))
+      split = node.left;
+    else
+      break;
+  }
+
+  if (split == NULL_IDX)
+    return 0;
+
+  // Keys >= lo in the left subtree of the split node and keys <= hi in its
+  // right subtree.
+  NodeIdx left = arena_->nodes[split].left;
+  auto left_less = descend<true>(left, [this, &lo](const KeyTy &node_key) {
+    return less(node_key, lo);
+  });
+  auto right_less_equal = descend<true>(
+      arena_->nodes[split].right,
+      [this, &hi](const KeyTy &node_key) { return !less(hi, node_key); });
+
+  return weight(arena_->nodes[split]) + sizeOf(left) - left_less.count +
+         right_less_equal.count;
+}
+
+// Same split as countRange. Left of the split node the keys >= lo are found
+// from the largest down, so each part is put in front of what was already
+// folded; right of it the keys <= hi come from the smallest up.
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+template <LookupKey<KeyTy, Compare> K>
+typename Tree<KeyTy, Compare, Augment, MULTI>::AggregateTy
+Tree<KeyTy, Compare, Augment, MULTI>::aggregate(const K &lo, const K &hi) const
+  requires AUGMENTED
+{
+  NodeIdx split = root_;
+  while (split != NULL_IDX) {
+    const auto &node = arena_->nodes[split];
+    if (less(node.key, lo))
+      split = node.right;
+    else if (less(hi, node.key))
+      split = node.left;
+    else
+      break;
+  }
+
+  if (split == NULL_IDX)
+    return Augment::identity();
+
+  AggregateTy left = Augment::identity();
+  NodeIdx current = arena_->nodes[split].left;
+  while (current != NULL_IDX) {
+    const auto &node = arena_->nodes[current];
+    if (less(node.key, lo)) {
+      current = node.right;
     } else {
-      return;
+      left = Augment::combine(
+          Augment::combine(liftNode(node), aggregateOf(node.right)),
+          left);
+      current = node.left;
     }
   }
 
-  nodes_.emplace_back(key);
-  It new_node = std::prev(nodes_.end());
-  new_node->parent = parent;
+  AggregateTy right = Augment::identity();
+  current = arena_->nodes[split].right;
+  while (current != NULL_IDX) {
+    const auto &node = arena_->nodes[current];
+    if (less(hi, node.key)) {
+      current = node.left;
+    } else {
+      right = Augment::combine(
+          right,
+          Augment::combine(aggregateOf(node.left), liftNode(node)));
+      current = node.right;
+    }
+  }
 
-  auto &parent_node = **parent;
-  if (key < parent_node.key)
-    parent_node.left = new_node;
-  else
+  return Augment::combine(
+      Augment::combine(left, liftNode(arena_->nodes[split])), right);
+}
+
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+void Tree<KeyTy, Compare, Augment, MULTI>::insert(const KeyTy &key) {
+  if (size() >= MAX_NODES)
+    throw std::length_error("RB_Tree::Tree: too many nodes");
+
+  if (root_ == NULL_IDX) {
+    root_ = allocate(key);
+    arena_->nodes[root_].color = Color::black;
+    return;
+  }
+
+  // The lower bound of the key is its duplicate if there is one; otherwise
+  // the descent ends at the null link where the key belongs. A multiset
+  // counts the duplicate in its node, a set drops it.
+  auto descent = descend<false>(root_, [this, &key](const KeyTy &node_key) {
+    return less(node_key, key);
+  });
+  if (descent.bound != NULL_IDX &&
+      !less(key, arena_->nodes[descent.bound].key)) {
+    if constexpr (MULTI) {
+      ++arena_->nodes[descent.bound].count;
+      for (NodeIdx tmp = descent.bound; tmp != NULL_IDX;
+           tmp = arena_->nodes[tmp].parent) {
+        ++arena_->nodes[tmp].subtree_size;
+        pull(tmp);
+      }
+    }
+    return;
+  }
+
+  // allocate() may reallocate the arena, so references to nodes must not be
+  // held across it.
+  NodeIdx new_node = allocate(key);
+  NodeIdx parent = descent.last;
+  arena_->nodes[new_node].parent = parent;
+
+  auto &parent_node = arena_->nodes[parent];
+  if (descent.went_right)
     parent_node.right = new_node;
+  else
+    parent_node.left = new_node;
 
   // Updating the sizes for all nodes.
-  auto tmp = parent;
-  while (tmp) {
-    auto &tmp_node = **tmp;
+  NodeIdx tmp = parent;
+  while (tmp != NULL_IDX) {
+    auto &tmp_node = arena_->nodes[tmp];
     ++tmp_node.subtree_size;
+    pull(tmp);
     tmp = tmp_node.parent;
   }
 
   // Balancing after insertion.
-  balanceTree(new_node);
+  balanceTree(new_node, root_);
 
   // Updating the root.
-  (*root_)->color = Color::black;
+  arena_->nodes[root_].color = Color::black;
+}
+
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+NodeIdx Tree<KeyTy, Compare, Augment, MULTI>::leftmost(NodeIdx idx) const {
+  if (idx != NULL_IDX)
+    while (arena_->nodes[idx].left != NULL_IDX)
+      idx = arena_->nodes[idx].left;
+  return idx;
+}
+
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+NodeIdx Tree<KeyTy, Compare, Augment, MULTI>::rightmost(NodeIdx idx) const {
+  if (idx != NULL_IDX)
+    while (arena_->nodes[idx].right != NULL_IDX)
+      idx = arena_->nodes[idx].right;
+  return idx;
 }
 
-template <typename KeyTy> void Tree<KeyTy>::balanceTree(It node) {
+// The next node in key order: the leftmost node of the right subtree or, if
+// there is none, the first ancestor reached from its left subtree.
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+NodeIdx Tree<KeyTy, Compare, Augment, MULTI>::successor(NodeIdx idx) const {
+  if (arena_->nodes[idx].right != NULL_IDX)
+    return leftmost(arena_->nodes[idx].right);
+
+  NodeIdx parent = arena_->nodes[idx].parent;
+  while (parent != NULL_IDX && arena_->nodes[parent].right == idx) {
+    idx = parent;
+    parent = arena_->nodes[parent].parent;
+  }
+  return parent;
+}
+
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+NodeIdx Tree<KeyTy, Compare, Augment, MULTI>::predecessor(NodeIdx idx) const {
+  if (arena_->nodes[idx].left != NULL_IDX)
+    return rightmost(arena_->nodes[idx].left);
+
+  NodeIdx parent = arena_->nodes[idx].parent;
+  while (parent != NULL_IDX && arena_->nodes[parent].left == idx) {
+    idx = parent;
+    parent = arena_->nodes[parent].parent;
+  }
+  return parent;
+}
+
+// Visits the nodes in key order by following parent links, without a stack.
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+template <typename Visit>
+void Tree<KeyTy, Compare, Augment, MULTI>::forEachInOrder(Visit visit) const {
+  for (NodeIdx current = leftmost(root_); current != NULL_IDX;
+       current = successor(current))
+    visit(arena_->nodes[current]);
+}
+
+// Replaces the contents of the tree with the keys of [first, last). The keys
+// are sorted and deduplicated unless they are already strictly increasing,
+// then a perfectly balanced tree is built over them in linear time.
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+template <typename InputIt>
+void Tree<KeyTy, Compare, Augment, MULTI>::assign(InputIt first, InputIt last) {
+  std::vector<KeyTy> keys(first, last);
+
+  auto key_less = [this](const KeyTy &lhs, const KeyTy &rhs) {
+    return less(lhs, rhs);
+  };
+  auto not_less = [this](const KeyTy &lhs, const KeyTy &rhs) {
+    return !less(lhs, rhs);
+  };
+  if (std::adjacent_find(keys.begin(), keys.end(), not_less) != keys.end()) {
+    std::sort(keys.begin(), keys.end(), key_less);
+    if constexpr (!MULTI)
+      keys.erase(std::unique(keys.begin(), keys.end(), not_less), keys.end());
+  }
+
+  if (keys.size() > MAX_NODES)
+    throw std::length_error("RB_Tree::Tree: too many nodes");
+
+  clearArena();
+  if constexpr (MULTI) {
+    // Runs of equal keys become one node each.
+    for (const auto &key : keys) {
+      if (!arena_->nodes.empty() && !less(arena_->nodes.back().key, key))
+        ++arena_->nodes.back().count;
+      else
+        arena_->nodes.emplace_back(key);
+    }
+  } else {
+    arena_->nodes.reserve(keys.size());
+    for (const auto &key : keys)
+      arena_->nodes.emplace_back(key);
+  }
+
+  auto built = static_cast<NodeIdx>(arena_->nodes.size());
+  root_ = buildPiece(0, built, std::identity()).root;
+}
+
+// Links the sorted nodes nodeAt(lo), ..., nodeAt(hi - 1) of the arena into a
+// detached, perfectly balanced subtree. Every level but the last one is
+// full. All nodes are black except the last level when it is incomplete:
+// those are red, which keeps the black height equal on every path.
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+template <typename NodeAt>
+typename Tree<KeyTy, Compare, Augment, MULTI>::Piece
+Tree<KeyTy, Compare, Augment, MULTI>::buildPiece(NodeIdx lo, NodeIdx hi,
+                                                 NodeAt nodeAt) {
+  std::size_t n = hi - lo;
+  int red_depth = std::has_single_bit(n + 1) ? -1 : std::bit_width(n) - 1;
+
+  NodeIdx root = buildBalanced(lo, hi, NULL_IDX, 0, red_depth, nodeAt);
+  if (root != NULL_IDX)
+    arena_->nodes[root].color = Color::black;
+  return {root, static_cast<int>(std::bit_width(n + 1)) - 1};
+}
+
+// Links the sorted nodes nodeAt(lo), ..., nodeAt(hi - 1) of the arena into a
+// balanced subtree and returns its root.
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+template <typename NodeAt>
+NodeIdx Tree<KeyTy, Compare, Augment, MULTI>::buildBalanced(
+    NodeIdx lo, NodeIdx hi, NodeIdx parent, int depth, int red_depth,
+    NodeAt nodeAt) {
+  if (lo >= hi)
+    return NULL_IDX;
+
+  NodeIdx mid = lo + (hi - lo) / 2;
+  NodeIdx idx = nodeAt(mid);
+  NodeIdx left = buildBalanced(lo, mid, idx, depth + 1, red_depth, nodeAt);
+  NodeIdx right =
+      buildBalanced(mid + 1, hi, idx, depth + 1, red_depth, nodeAt);
+
+  auto &node = arena_->nodes[idx];
+  node.parent = parent;
+  node.left = left;
+  node.right = right;
+  node.subtree_size = sizeOf(left) + sizeOf(right) + weight(node);
+  node.color = (depth == red_depth) ? Color::red : Color::black;
+  pull(idx);
+
+  return idx;
+}
+
+// Returns whether the root had to be turned black, which adds a black node
+// to every path.
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+bool Tree<KeyTy, Compare, Augment, MULTI>::balanceTree(NodeIdx node,
+                                                       NodeIdx &root) {
   while (true) {
     // Get the parent of the current node.
-    auto parent_opt = node->parent;
+    NodeIdx parent = arena_->nodes[node].parent;
 
     // If a node does not have a parent, it means that it is the root, and
     // balancing is completed.
-    if (!parent_opt)
+    if (parent == NULL_IDX)
       break;
 
-    auto parent = *parent_opt;
     // If the parent is black, the tree is already balanced for that node.
-    if (parent->color != Color::red)
+    if (arena_->nodes[parent].color != Color::red)
       break;
 
     // Getting a grandparent.
-    auto grandparent_opt = parent->parent;
+    NodeIdx grandparent = arena_->nodes[parent].parent;
 
     // If there is no grandparent, the tree is balanced.
-    if (!grandparent_opt)
+    if (grandparent == NULL_IDX)
       break;
 
-    auto grandparent = *grandparent_opt;
     // We determine whether the parent is the left descendant of the
     // grandfather.
-    bool parent_is_left = (grandparent->left && *grandparent->left == parent);
+    bool parent_is_left = (arena_->nodes[grandparent].left == parent);
 
     // We determine the uncle (the parent's brother) based on whether the parent
     // is on the left.
-    auto uncle_opt = parent_is_left ? grandparent->right : grandparent->left;
+    NodeIdx uncle = parent_is_left ? arena_->nodes[grandparent].right
+                                   : arena_->nodes[grandparent].left;
 
     // Case 1: Uncle is Red.
-    if (uncle_opt && (*uncle_opt)->color == Color::red) {
-      parent->color = Color::black;
-      (*uncle_opt)->color = Color::black;
-      grandparent->color = Color::red;
+    if (uncle != NULL_IDX && arena_->nodes[uncle].color == Color::red) {
+      arena_->nodes[parent].color = Color::black;
+      arena_->nodes[uncle].color = Color::black;
+      arena_->nodes[grandparent].color = Color::red;
       node = grandparent;
       continue;
     }
@@ -245,41 +936,41 @@ template <typename KeyTy> void Tree<KeyTy>::balanceTree(It node) {
     // Uncle is black or null.
     if (parent_is_left) {
       // Case 2: Uncle is black and the node is right.
-      if (parent->right && *parent->right == node) {
+      if (arena_->nodes[parent].right == node) {
         node = parent;
-        rotateLeft(node);
+        rotateLeft(node, root);
 
         // Updating the parent after the rotation.
-        parent_opt = node->parent;
-        if (!parent_opt)
+        parent = arena_->nodes[node].parent;
+        if (parent == NULL_IDX)
           break;
-        parent = *parent_opt;
       }
 
-      parent->color = Color::black;
-      grandparent->color = Color::red;
-      rotateRight(grandparent);
+      arena_->nodes[parent].color = Color::black;
+      arena_->nodes[grandparent].color = Color::red;
+      rotateRight(grandparent, root);
     } else {
       // Case 3: Uncle is black and node is left.
-      if (parent->left && *parent->left == node) {
+      if (arena_->nodes[parent].left == node) {
         node = parent;
-        rotateRight(node);
+        rotateRight(node, root);
 
         // Updating the parent after the rotation.
-        parent_opt = node->parent;
-        if (!parent_opt)
+        parent = arena_->nodes[node].parent;
+        if (parent == NULL_IDX)
           break;
-        parent = *parent_opt;
       }
 
-      parent->color = Color::black;
-      grandparent->color = Color::red;
-      rotateLeft(grandparent);
+      arena_->nodes[parent].color = Color::black;
+      arena_->nodes[grandparent].color = Color::red;
+      rotateLeft(grandparent, root);
     }
   }
 
-  if (root_)
-    (*root_)->color = Color::black;
+  if (root == NULL_IDX || arena_->nodes[root].color == Color::black)
+    return false;
+  arena_->nodes[root].color = Color::black;
+  return true;
 }
 
 //     x                     y
@@ -287,36 +978,39 @@ template <typename KeyTy> void Tree<KeyTy>::balanceTree(It node) {
 //   z   y       -->       x   c
 //      / \               / \
 //     b   c             z   b
-template <typename KeyTy> void Tree<KeyTy>::rotateLeft(It x_it) {
-  auto &x = *x_it;
-  if (!x.right)
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+void Tree<KeyTy, Compare, Augment, MULTI>::rotateLeft(NodeIdx x_idx,
+                                                      NodeIdx &root) {
+  auto &x = arena_->nodes[x_idx];
+  if (x.right == NULL_IDX)
     return;
 
-  It y_it = *x.right;
-  auto &y = *y_it;
+  NodeIdx y_idx = x.right;
+  auto &y = arena_->nodes[y_idx];
 
   x.right = y.left;
-  if (y.left)
-    (*y.left)->parent = x_it;
+  if (y.left != NULL_IDX)
+    arena_->nodes[y.left].parent = x_idx;
 
   y.parent = x.parent;
 
-  if (!x.parent) {
-    root_ = y_it;
+  if (x.parent == NULL_IDX) {
+    root = y_idx;
   } else {
-    auto parent_it = *x.parent;
-    auto &parent = *parent_it;
-    if (x_it == parent.left)
-      parent.left = y_it;
+    auto &parent = arena_->nodes[x.parent];
+    if (x_idx == parent.left)
+      parent.left = y_idx;
     else
-      parent.right = y_it;
+      parent.right = y_idx;
   }
 
-  y.left = x_it;
-  x.parent = y_it;
+  y.left = x_idx;
+  x.parent = y_idx;
 
-  x.subtree_size = size<KeyTy>(x.left) + size<KeyTy>(x.right) + 1;
-  y.subtree_size = size<KeyTy>(y.left) + size<KeyTy>(y.right) + 1;
+  x.subtree_size = sizeOf(x.left) + sizeOf(x.right) + weight(x);
+  y.subtree_size = sizeOf(y.left) + sizeOf(y.right) + weight(y);
+  pull(x_idx);
+  pull(y_idx);
 }
 
 //       x                 y
@@ -324,35 +1018,520 @@ template <typename KeyTy> void Tree<KeyTy>::rotateLeft(It x_it) {
 //     y   z     -->     b   x
 //    / \                   / \
 //   b   c                 c   z
-template <typename KeyTy> void Tree<KeyTy>::rotateRight(It x_it) {
-  auto &x = *x_it;
-  if (!x.left)
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+void Tree<KeyTy, Compare, Augment, MULTI>::rotateRight(NodeIdx x_idx,
+                                                       NodeIdx &root) {
+  auto &x = arena_->nodes[x_idx];
+  if (x.left == NULL_IDX)
     return;
 
-  It y_it = *x.left;
-  auto &y = *y_it;
+  NodeIdx y_idx = x.left;
+  auto &y = arena_->nodes[y_idx];
 
   x.left = y.right;
-  if (y.right)
-    (*y.right)->parent = x_it;
+  if (y.right != NULL_IDX)
+    arena_->nodes[y.right].parent = x_idx;
 
   y.parent = x.parent;
 
-  if (!x.parent) {
-    root_ = y_it;
+  if (x.parent == NULL_IDX) {
+    root = y_idx;
   } else {
-    auto parent_it = *x.parent;
-    auto &parent = *parent_it;
-    if (x_it == parent.right)
-      parent.right = y_it;
+    auto &parent = arena_->nodes[x.parent];
+    if (x_idx == parent.right)
+      parent.right = y_idx;
     else
-      parent.left = y_it;
+      parent.left = y_idx;
+  }
+
+  y.right = x_idx;
+  x.parent = y_idx;
+
+  x.subtree_size = sizeOf(x.left) + sizeOf(x.right) + weight(x);
+  y.subtree_size = sizeOf(y.left) + sizeOf(y.right) + weight(y);
+  pull(x_idx);
+  pull(y_idx);
+}
+
+// A node for the key, taken from the free list if it has one. The children
+// of a reused free subtree root become free roots themselves.
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+NodeIdx Tree<KeyTy, Compare, Augment, MULTI>::allocate(const KeyTy &key) {
+  if (arena_->free == NULL_IDX) {
+    // Trees sharing the arena may hold more nodes than this one has keys.
+    if (arena_->nodes.size() >= MAX_NODES)
+      throw std::length_error("RB_Tree::Tree: too many nodes");
+    arena_->nodes.emplace_back(key);
+    return static_cast<NodeIdx>(arena_->nodes.size() - 1);
+  }
+
+  NodeIdx idx = arena_->free;
+  arena_->free = arena_->nodes[idx].parent;
+  for (NodeIdx child : {arena_->nodes[idx].left, arena_->nodes[idx].right}) {
+    if (child != NULL_IDX) {
+      arena_->nodes[child].parent = arena_->free;
+      arena_->free = child;
+    }
+  }
+  arena_->nodes[idx] = NodeTy(key);
+  return idx;
+}
+
+// Puts the whole subtree of `root` on the free list in O(1): its nodes are
+// taken apart only as allocate() reaches them.
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+void Tree<KeyTy, Compare, Augment, MULTI>::release(NodeIdx root) {
+  arena_->nodes[root].parent = arena_->free;
+  arena_->free = root;
+}
+
+// Empties the tree. Its nodes go back to the free list of an arena shared
+// with other trees, or are dropped with an arena of its own.
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+void Tree<KeyTy, Compare, Augment, MULTI>::clearArena() {
+  if (arena_.use_count() > 1) {
+    if (root_ != NULL_IDX)
+      release(root_);
+    arena_ = std::make_shared<Arena>();
+  } else {
+    arena_->nodes.clear();
+    arena_->free = NULL_IDX;
+  }
+  root_ = NULL_IDX;
+}
+
+// Puts the subtree of new_idx, possibly empty, where the subtree of old_idx
+// hangs.
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+void Tree<KeyTy, Compare, Augment, MULTI>::transplant(NodeIdx old_idx,
+                                                      NodeIdx new_idx) {
+  NodeIdx parent = arena_->nodes[old_idx].parent;
+  if (parent == NULL_IDX)
+    root_ = new_idx;
+  else if (arena_->nodes[parent].left == old_idx)
+    arena_->nodes[parent].left = new_idx;
+  else
+    arena_->nodes[parent].right = new_idx;
+
+  if (new_idx != NULL_IDX)
+    arena_->nodes[new_idx].parent = parent;
+}
+
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+template <LookupKey<KeyTy, Compare> K>
+std::size_t Tree<KeyTy, Compare, Augment, MULTI>::erase(const K &key) {
+  if (root_ == NULL_IDX)
+    return 0;
+
+  auto descent = descend<false>(root_, [this, &key](const KeyTy &node_key) {
+    return less(node_key, key);
+  });
+  if (descent.bound == NULL_IDX || less(key, arena_->nodes[descent.bound].key))
+    return 0;
+
+  std::size_t removed = weight(arena_->nodes[descent.bound]);
+  eraseNode(descent.bound);
+  return removed;
+}
+
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+typename Tree<KeyTy, Compare, Augment, MULTI>::Iterator
+Tree<KeyTy, Compare, Augment, MULTI>::erase(Iterator pos) {
+  NodeIdx idx = pos.node()->index();
+  NodeIdx next = successor(idx);
+  eraseNode(idx);
+  return Iterator(this, next);
+}
+
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+bool Tree<KeyTy, Compare, Augment, MULTI>::eraseOne(const KeyTy &key)
+  requires MULTI
+{
+  if (root_ == NULL_IDX)
+    return false;
+
+  auto descent = descend<false>(root_, [this, &key](const KeyTy &node_key) {
+    return less(node_key, key);
+  });
+  if (descent.bound == NULL_IDX || less(key, arena_->nodes[descent.bound].key))
+    return false;
+
+  if (arena_->nodes[descent.bound].count == 1) {
+    eraseNode(descent.bound);
+    return true;
   }
 
-  y.right = x_it;
-  x.parent = y_it;
+  --arena_->nodes[descent.bound].count;
+  for (NodeIdx tmp = descent.bound; tmp != NULL_IDX;
+       tmp = arena_->nodes[tmp].parent) {
+    --arena_->nodes[tmp].subtree_size;
+    pull(tmp);
+  }
+  return true;
+}
+
+// Unlinks the node. A node with two children is replaced by its successor,
+// which is relinked into its place rather than having its key copied, so no
+// other node changes its index. The sizes are then recomputed up from the
+// lowest changed node, and a removed black position is fixed up.
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+void Tree<KeyTy, Compare, Augment, MULTI>::eraseNode(NodeIdx node) {
+  NodeIdx left = arena_->nodes[node].left;
+  NodeIdx right = arena_->nodes[node].right;
+
+  // The child that moves up into the removed position and its new parent.
+  NodeIdx child, parent;
+  Color removed_color = arena_->nodes[node].color;
+
+  if (left == NULL_IDX || right == NULL_IDX) {
+    child = left != NULL_IDX ? left : right;
+    parent = arena_->nodes[node].parent;
+    transplant(node, child);
+  } else {
+    NodeIdx next = leftmost(right);
+    removed_color = arena_->nodes[next].color;
+    child = arena_->nodes[next].right;
+
+    if (arena_->nodes[next].parent == node) {
+      parent = next;
+    } else {
+      parent = arena_->nodes[next].parent;
+      transplant(next, child);
+      arena_->nodes[next].right = right;
+      arena_->nodes[right].parent = next;
+    }
+
+    transplant(node, next);
+    arena_->nodes[next].left = left;
+    arena_->nodes[left].parent = next;
+    arena_->nodes[next].color = arena_->nodes[node].color;
+  }
+
+  for (NodeIdx tmp = parent; tmp != NULL_IDX; tmp = arena_->nodes[tmp].parent) {
+    auto &tmp_node = arena_->nodes[tmp];
+    tmp_node.subtree_size =
+        sizeOf(tmp_node.left) + sizeOf(tmp_node.right) + weight(tmp_node);
+    pull(tmp);
+  }
+
+  arena_->nodes[node].left = NULL_IDX;
+  arena_->nodes[node].right = NULL_IDX;
+  release(node);
+
+  if (removed_color == Color::black)
+    eraseFixup(child, parent);
+}
+
+// `node`, possibly null, carries an extra black. Either it is pushed up to a
+// red node that absorbs it, or a rotation at a black sibling removes it.
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+void Tree<KeyTy, Compare, Augment, MULTI>::eraseFixup(NodeIdx node,
+                                                      NodeIdx parent) {
+  auto isBlack = [this](NodeIdx idx) {
+    return idx == NULL_IDX || arena_->nodes[idx].color == Color::black;
+  };
+
+  while (node != root_ && isBlack(node)) {
+    bool node_is_left = (arena_->nodes[parent].left == node);
+    // The sibling cannot be null: its side has an extra black level.
+    NodeIdx sibling =
+        node_is_left ? arena_->nodes[parent].right : arena_->nodes[parent].left;
+
+    // Case 1: red sibling. Rotate it up so the sibling becomes black.
+    if (arena_->nodes[sibling].color == Color::red) {
+      arena_->nodes[sibling].color = Color::black;
+      arena_->nodes[parent].color = Color::red;
+      if (node_is_left) {
+        rotateLeft(parent, root_);
+        sibling = arena_->nodes[parent].right;
+      } else {
+        rotateRight(parent, root_);
+        sibling = arena_->nodes[parent].left;
+      }
+    }
+
+    NodeIdx near = node_is_left ? arena_->nodes[sibling].left
+                                : arena_->nodes[sibling].right;
+    NodeIdx far = node_is_left ? arena_->nodes[sibling].right
+                               : arena_->nodes[sibling].left;
+
+    // Case 2: black sibling with black children. Recolor and move up.
+    if (isBlack(near) && isBlack(far)) {
+      arena_->nodes[sibling].color = Color::red;
+      node = parent;
+      parent = arena_->nodes[node].parent;
+      continue;
+    }
+
+    // Case 3: only the near nephew is red. Rotate it over the sibling.
+    if (isBlack(far)) {
+      arena_->nodes[near].color = Color::black;
+      arena_->nodes[sibling].color = Color::red;
+      if (node_is_left)
+        rotateRight(sibling, root_);
+      else
+        rotateLeft(sibling, root_);
+      far = sibling;
+      sibling = near;
+    }
+
+    // Case 4: the far nephew is red. One rotation at the parent ends it.
+    arena_->nodes[sibling].color = arena_->nodes[parent].color;
+    arena_->nodes[parent].color = Color::black;
+    arena_->nodes[far].color = Color::black;
+    if (node_is_left)
+      rotateLeft(parent, root_);
+    else
+      rotateRight(parent, root_);
+    node = root_;
+  }
+
+  if (node != NULL_IDX)
+    arena_->nodes[node].color = Color::black;
+}
+
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+Tree<KeyTy, Compare, Augment, MULTI>
+Tree<KeyTy, Compare, Augment, MULTI>::join(Tree &&left, const KeyTy &key,
+                                           Tree &&right) {
+  if ((left.root_ != NULL_IDX &&
+       !left.less(left.arena_->nodes[left.rightmost(left.root_)].key, key)) ||
+      (right.root_ != NULL_IDX &&
+       !left.less(key, right.arena_->nodes[right.leftmost(right.root_)].key)))
+    throw std::invalid_argument("RB_Tree::Tree::join: keys are out of order");
+  if (left.size() + right.size() >= MAX_NODES)
+    throw std::length_error("RB_Tree::Tree: too many nodes");
+
+  if (left.arena_ == right.arena_) {
+    NodeIdx mid = left.allocate(key);
+    left.root_ = left.joinNodes(left.piece(left.root_), mid,
+                                left.piece(right.root_))
+                     .root;
+    right.root_ = NULL_IDX;
+    return std::move(left);
+  }
+
+  // The nodes of the smaller tree are copied into the other one's arena.
+  bool into_left = left.size() >= right.size();
+  Tree &base = into_left ? left : right;
+  Tree &other = into_left ? right : left;
+  NodeIdx copied = base.copySubtree(other, other.root_, NULL_IDX);
+  NodeIdx mid = base.allocate(key);
+
+  if (into_left)
+    base.root_ =
+        base.joinNodes(base.piece(base.root_), mid, base.piece(copied)).root;
+  else
+    base.root_ =
+        base.joinNodes(base.piece(copied), mid, base.piece(base.root_)).root;
+
+  other = Tree(other.comp_);
+  return std::move(base);
+}
+
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+template <LookupKey<KeyTy, Compare> K>
+Tree<KeyTy, Compare, Augment, MULTI>
+Tree<KeyTy, Compare, Augment, MULTI>::split(const K &key) {
+  auto [left, right] = splitNodes(
+      piece(root_),
+      [this, &key](const KeyTy &node_key) { return less(node_key, key); });
+  root_ = left.root;
+  return takeSubtree(right.root);
+}
+
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+template <LookupKey<KeyTy, Compare> K>
+std::size_t Tree<KeyTy, Compare, Augment, MULTI>::eraseRange(const K &lo,
+                                                            const K &hi) {
+  auto [left, rest] = splitNodes(
+      piece(root_),
+      [this, &lo](const KeyTy &node_key) { return less(node_key, lo); });
+  auto [middle, right] = splitNodes(
+      rest, [this, &hi](const KeyTy &node_key) { return !less(hi, node_key); });
+  root_ = joinNodes(left, right).root;
+
+  if (middle.root == NULL_IDX)
+    return 0;
+  std::size_t removed = sizeOf(middle.root);
+  release(middle.root);
+  return removed;
+}
+
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+template <LookupKey<KeyTy, Compare> K>
+Tree<KeyTy, Compare, Augment, MULTI>
+Tree<KeyTy, Compare, Augment, MULTI>::extractRange(const K &lo, const K &hi) {
+  auto [left, rest] = splitNodes(
+      piece(root_),
+      [this, &lo](const KeyTy &node_key) { return less(node_key, lo); });
+  auto [middle, right] = splitNodes(
+      rest, [this, &hi](const KeyTy &node_key) { return !less(hi, node_key); });
+  root_ = joinNodes(left, right).root;
+  return takeSubtree(middle.root);
+}
+
+// A detached subtree with its black height, measured once along the left
+// spine.
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+typename Tree<KeyTy, Compare, Augment, MULTI>::Piece
+Tree<KeyTy, Compare, Augment, MULTI>::piece(NodeIdx root) const {
+  Piece result{root, 0};
+  for (NodeIdx idx = root; idx != NULL_IDX; idx = arena_->nodes[idx].left)
+    result.height += arena_->nodes[idx].color == Color::black;
+  return result;
+}
+
+// Joins two detached subtrees and a detached node whose key lies between
+// them. The shorter subtree hangs under `mid`, which is linked as a red node
+// into the spine of the taller one at the same black height; a red parent
+// is then fixed up as after an insert. Takes O(difference of the heights).
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+typename Tree<KeyTy, Compare, Augment, MULTI>::Piece
+Tree<KeyTy, Compare, Augment, MULTI>::joinNodes(Piece left, NodeIdx mid,
+                                                Piece right) {
+  // A detached subtree stays valid with its root made black.
+  for (Piece *part : {&left, &right}) {
+    if (part->root != NULL_IDX) {
+      auto &root = arena_->nodes[part->root];
+      root.parent = NULL_IDX;
+      part->height += root.color == Color::red;
+      root.color = Color::black;
+    }
+  }
+
+  bool left_taller = left.height > right.height;
+  const Piece &taller = left_taller ? left : right;
+  int target = std::min(left.height, right.height);
+
+  // The first black node (or null link) of the taller subtree's inner spine
+  // whose black height is that of the shorter one.
+  auto isBlack = [this](NodeIdx idx) {
+    return idx == NULL_IDX || arena_->nodes[idx].color == Color::black;
+  };
+  NodeIdx parent = NULL_IDX, current = taller.root;
+  int height = taller.height;
+  while (height != target || !isBlack(current)) {
+    if (isBlack(current))
+      --height;
+    parent = current;
+    current = left_taller ? arena_->nodes[current].right
+                          : arena_->nodes[current].left;
+  }
+
+  auto &node = arena_->nodes[mid];
+  node.parent = parent;
+  node.left = left_taller ? current : left.root;
+  node.right = left_taller ? right.root : current;
+  node.color = parent == NULL_IDX ? Color::black : Color::red;
+  for (NodeIdx child : {node.left, node.right})
+    if (child != NULL_IDX)
+      arena_->nodes[child].parent = mid;
+
+  if (parent != NULL_IDX && left_taller)
+    arena_->nodes[parent].right = mid;
+  else if (parent != NULL_IDX)
+    arena_->nodes[parent].left = mid;
+
+  for (NodeIdx tmp = mid; tmp != NULL_IDX; tmp = arena_->nodes[tmp].parent) {
+    auto &tmp_node = arena_->nodes[tmp];
+    tmp_node.subtree_size =
+        sizeOf(tmp_node.left) + sizeOf(tmp_node.right) + weight(tmp_node);
+    pull(tmp);
+  }
+
+  // Equal heights: `mid` is the new black root.
+  if (parent == NULL_IDX)
+    return {mid, taller.height + 1};
+
+  NodeIdx root = taller.root;
+  bool grew = balanceTree(mid, root);
+  return {root, taller.height + grew};
+}
+
+// Joins two detached subtrees, all keys of `left` being less than those of
+// `right`: the last node of `left` is split off and joins them.
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+typename Tree<KeyTy, Compare, Augment, MULTI>::Piece
+Tree<KeyTy, Compare, Augment, MULTI>::joinNodes(Piece left, Piece right) {
+  if (left.root == NULL_IDX || right.root == NULL_IDX) {
+    Piece result = left.root != NULL_IDX ? left : right;
+    if (result.root != NULL_IDX) {
+      auto &root = arena_->nodes[result.root];
+      root.parent = NULL_IDX;
+      result.height += root.color == Color::red;
+      root.color = Color::black;
+    }
+    return result;
+  }
+
+  NodeIdx last = rightmost(left.root);
+  auto [rest, single] =
+      splitNodes(left, [this, last](const KeyTy &node_key) {
+        return less(node_key, arena_->nodes[last].key);
+      });
+  return joinNodes(rest, single.root, right);
+}
+
+// Splits a detached subtree into the keys for which inLeft holds and the
+// rest, which must follow them in key order. Every node on the search path
+// joins the pieces on its side; the heights of the pieces telescope, so the
+// joins take O(log n) in total.
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+template <typename InLeft>
+std::pair<typename Tree<KeyTy, Compare, Augment, MULTI>::Piece,
+          typename Tree<KeyTy, Compare, Augment, MULTI>::Piece>
+Tree<KeyTy, Compare, Augment, MULTI>::splitNodes(Piece root, InLeft inLeft) {
+  if (root.root == NULL_IDX)
+    return {};
+
+  const auto &node = arena_->nodes[root.root];
+  int child_height = root.height - (node.color == Color::black);
+  Piece left{node.left, child_height};
+  Piece right{node.right, child_height};
+
+  if (inLeft(node.key)) {
+    auto [lower, upper] = splitNodes(right, inLeft);
+    return {joinNodes(left, root.root, lower), upper};
+  }
+
+  auto [lower, upper] = splitNodes(left, inLeft);
+  return {lower, joinNodes(upper, root.root, right)};
+}
+
+// Copies a subtree of another tree as it is, colors and sizes included.
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+NodeIdx Tree<KeyTy, Compare, Augment, MULTI>::copySubtree(const Tree &from,
+                                                          NodeIdx idx,
+                                                          NodeIdx parent) {
+  if (idx == NULL_IDX)
+    return NULL_IDX;
+
+  const auto &source = from.arena_->nodes[idx];
+  NodeIdx copy = allocate(source.key);
+  arena_->nodes[copy] = source;
+  arena_->nodes[copy].parent = parent;
+
+  NodeIdx left = copySubtree(from, source.left, copy);
+  NodeIdx right = copySubtree(from, source.right, copy);
+  arena_->nodes[copy].left = left;
+  arena_->nodes[copy].right = right;
+  return copy;
+}
 
-  x.subtree_size = size<KeyTy>(x.left) + size<KeyTy>(x.right) + 1;
-  y.subtree_size = size<KeyTy>(y.left) + size<KeyTy>(y.right) + 1;
+// Hands a detached subtree, split off the tree at root_, to a tree that
+// shares the arena: no node moves.
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+Tree<KeyTy, Compare, Augment, MULTI>
+Tree<KeyTy, Compare, Augment, MULTI>::takeSubtree(NodeIdx part) {
+  Tree result(comp_);
+  if (part == NULL_IDX)
+    return result;
+
+  result.arena_ = arena_;
+  result.root_ = part;
+  arena_->nodes[part].parent = NULL_IDX;
+  arena_->nodes[part].color = Color::black;
+  return result;
 }
 } // namespace RB_Tree
@@ -0,0 +1,308 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+#include "thread_pool.hpp"
+#include "tree.hpp"
+
+namespace RB_Tree {
+
+namespace batch {
+// Below this many keys a single std::sort beats splitting the work.
+inline constexpr std::size_t MIN_PARALLEL_SORT = 1 << 14;
+// A batch with this many times more new keys than the tree holds is merged
+// by rebuilding the whole tree in one linear pass.
+inline constexpr std::size_t REBUILD_RATIO = 4;
+
+// Sorts one run per thread in parallel, then merges neighbouring runs
+// pairwise, the pairs of every round in parallel.
+template <typename KeyTy, typename Less>
+void parallelSort(std::vector<KeyTy> &keys, Less less,
+                  Parallel::ThreadPool &pool) {
+  std::size_t runs = std::bit_ceil(std::size_t{pool.size()});
+  if (runs == 1 || keys.size() < MIN_PARALLEL_SORT) {
+    std::sort(keys.begin(), keys.end(), less);
+    return;
+  }
+
+  std::size_t run = (keys.size() + runs - 1) / runs;
+  auto bound = [&keys, run](std::size_t i) {
+    return keys.begin() +
+           static_cast<std::ptrdiff_t>(std::min(i * run, keys.size()));
+  };
+
+  pool.parallelFor(runs, [&](std::size_t begin, std::size_t end) {
+    for (std::size_t i = begin; i < end; ++i)
+      std::sort(bound(i), bound(i + 1), less);
+  });
+
+  for (std::size_t width = 1; width < runs; width *= 2) {
+    pool.parallelFor(runs / (2 * width), [&](std::size_t begin,
+                                             std::size_t end) {
+      for (std::size_t pair = begin; pair < end; ++pair) {
+        std::size_t first = pair * 2 * width;
+        std::inplace_merge(bound(first), bound(first + width),
+                           bound(first + 2 * width), less);
+      }
+    });
+  }
+}
+} // namespace batch
+
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+void Tree<KeyTy, Compare, Augment, MULTI>::insertBatch(
+    std::span<const KeyTy> keys) {
+  Parallel::ThreadPool inline_pool(1);
+  insertBatch(keys, inline_pool);
+}
+
+// The batch is sorted and its runs of equal keys collapsed. Its keys get
+// nodes from the free list, or appended to the arena once it runs dry, and
+// are merged in by unite(): the top levels of the tree split the batch into
+// independent tasks that run on the pool, and their results are joined back
+// under the top-level nodes. A key already in the tree is dropped, or
+// counted in its node in a multiset, and its new node is released.
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+void Tree<KeyTy, Compare, Augment, MULTI>::insertBatch(
+    std::span<const KeyTy> keys, Parallel::ThreadPool &pool) {
+  std::vector<KeyTy> sorted(keys.begin(), keys.end());
+  auto key_less = [this](const KeyTy &lhs, const KeyTy &rhs) {
+    return less(lhs, rhs);
+  };
+  batch::parallelSort(sorted, key_less, pool);
+
+  // Runs of equal keys are collapsed in parallel slices. The slices start
+  // at run boundaries, so each one keeps its distinct keys at its front.
+  std::size_t slices =
+      sorted.size() < batch::MIN_PARALLEL_SORT ? 1 : pool.size();
+  std::vector<std::size_t> starts(slices + 1, sorted.size());
+  starts[0] = 0;
+  for (std::size_t s = 1; s < slices; ++s) {
+    std::size_t at = std::max(starts[s - 1], s * sorted.size() / slices);
+    if (at > 0 && at < sorted.size())
+      at = static_cast<std::size_t>(
+          std::upper_bound(sorted.begin() + static_cast<std::ptrdiff_t>(at),
+                           sorted.end(), sorted[at - 1], key_less) -
+          sorted.begin());
+    starts[s] = at;
+  }
+
+  std::vector<std::size_t> distinct(slices);
+  std::vector<std::uint32_t> counts(MULTI ? sorted.size() : 0);
+  pool.parallelFor(slices, [&](std::size_t begin, std::size_t end) {
+    for (std::size_t s = begin; s < end; ++s) {
+      std::size_t out = starts[s];
+      for (std::size_t i = starts[s]; i < starts[s + 1]; ++i) {
+        if (out > starts[s] && !less(sorted[out - 1], sorted[i])) {
+          if constexpr (MULTI)
+            ++counts[out - 1];
+          continue;
+        }
+        sorted[out] = sorted[i];
+        if constexpr (MULTI)
+          counts[out] = 1;
+        ++out;
+      }
+      distinct[s] = out - starts[s];
+    }
+  });
+
+  std::size_t new_nodes = 0;
+  for (std::size_t count : distinct)
+    new_nodes += count;
+  if (new_nodes == 0)
+    return;
+  // Like insert(), keys that turn out to be there already count against
+  // the limit.
+  if (size() + (MULTI ? keys.size() : new_nodes) > MAX_NODES)
+    throw std::length_error("RB_Tree::Tree: too many nodes");
+
+  // allocate() also keeps the arena, which trees split off this one share,
+  // within the index range; a batch that runs past it gives its nodes back.
+  BatchNodes incoming;
+  incoming.fresh.reserve(new_nodes);
+  try {
+    for (std::size_t s = 0; s < slices; ++s) {
+      for (std::size_t i = starts[s]; i < starts[s] + distinct[s]; ++i) {
+        incoming.fresh.push_back(allocate(sorted[i]));
+        if constexpr (MULTI)
+          arena_->nodes[incoming.fresh.back()].count = counts[i];
+      }
+    }
+  } catch (...) {
+    for (NodeIdx idx : incoming.fresh)
+      release(idx);
+    throw;
+  }
+  auto fresh = static_cast<NodeIdx>(incoming.fresh.size());
+
+  // A shared arena is not rebuilt: the other trees' nodes stay in it.
+  if (root_ != NULL_IDX && arena_.use_count() == 1 &&
+      fresh >= batch::REBUILD_RATIO * size()) {
+    rebuildWith(incoming);
+    return;
+  }
+
+  // About four tasks per thread even out the uneven slices.
+  int depth =
+      pool.size() == 1 ? 0 : static_cast<int>(std::bit_width(4 * pool.size()));
+  incoming.merged.assign(fresh, 0);
+  std::vector<UnionTask> tasks;
+  std::vector<NodeIdx> program;
+  planUnion(piece(root_), 0, fresh, depth, incoming, tasks, program);
+
+  pool.parallelFor(tasks.size(), [&](std::size_t begin, std::size_t end) {
+    for (std::size_t i = begin; i < end; ++i)
+      tasks[i].result =
+          unite(tasks[i].tree, tasks[i].lo, tasks[i].hi, incoming);
+  });
+
+  // The program is in post-order: a null entry stands for the next task's
+  // result, a node joins the two pieces before it.
+  std::vector<Piece> pieces;
+  std::size_t next_task = 0;
+  for (NodeIdx node : program) {
+    if (node == NULL_IDX) {
+      pieces.push_back(tasks[next_task++].result);
+      continue;
+    }
+    Piece right = pieces.back();
+    pieces.pop_back();
+    Piece left = pieces.back();
+    pieces.pop_back();
+    pieces.push_back(joinNodes(left, node, right));
+  }
+  root_ = pieces.back().root;
+
+  // New nodes whose key was already in the tree are left over.
+  for (NodeIdx pos = 0; pos < fresh; ++pos) {
+    if (incoming.merged[pos]) {
+      NodeIdx idx = incoming.fresh[pos];
+      arena_->nodes[idx].left = NULL_IDX;
+      arena_->nodes[idx].right = NULL_IDX;
+      release(idx);
+    }
+  }
+}
+
+// The first new node in the slice [lo, hi) of the batch whose key is not
+// less than `key`.
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+NodeIdx Tree<KeyTy, Compare, Augment, MULTI>::partitionBatch(
+    NodeIdx lo, NodeIdx hi, const KeyTy &key,
+    const BatchNodes &incoming) const {
+  NodeIdx count = hi - lo;
+  while (count > 0) {
+    NodeIdx step = count / 2;
+    if (less(arena_->nodes[incoming.fresh[lo + step]].key, key)) {
+      lo += step + 1;
+      count -= step + 1;
+    } else {
+      count = step;
+    }
+  }
+  return lo;
+}
+
+// Union of a detached subtree with the slice [lo, hi) of the new nodes: the
+// root splits the slice, both sides are merged recursively and joined back
+// at the root. A new node with the root's key is merged into it and flagged
+// in `merged`. Only nodes of the subtree and of the slice are touched, so
+// tasks on disjoint subtrees can run concurrently.
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+typename Tree<KeyTy, Compare, Augment, MULTI>::Piece
+Tree<KeyTy, Compare, Augment, MULTI>::unite(Piece tree, NodeIdx lo,
+                                            NodeIdx hi, BatchNodes &incoming) {
+  if (lo == hi)
+    return tree;
+  if (tree.root == NULL_IDX)
+    return buildPiece(lo, hi, [&incoming](NodeIdx pos) {
+      return incoming.fresh[pos];
+    });
+
+  auto &node = arena_->nodes[tree.root];
+  int child_height = tree.height - (node.color == Color::black);
+  Piece left{node.left, child_height};
+  Piece right{node.right, child_height};
+  NodeIdx mid = partitionBatch(lo, hi, node.key, incoming);
+  NodeIdx right_lo = mid;
+  if (mid < hi && !less(node.key, arena_->nodes[incoming.fresh[mid]].key)) {
+    if constexpr (MULTI)
+      node.count += arena_->nodes[incoming.fresh[mid]].count;
+    incoming.merged[mid] = 1;
+    ++right_lo;
+  }
+
+  left = unite(left, lo, mid, incoming);
+  right = unite(right, right_lo, hi, incoming);
+  return joinNodes(left, tree.root, right);
+}
+
+// Splits the union into tasks at the subtrees `depth` levels down, or
+// higher where the tree or the slice runs out.
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+void Tree<KeyTy, Compare, Augment, MULTI>::planUnion(
+    Piece tree, NodeIdx lo, NodeIdx hi, int depth, BatchNodes &incoming,
+    std::vector<UnionTask> &tasks, std::vector<NodeIdx> &program) {
+  if (depth == 0 || tree.root == NULL_IDX || lo == hi) {
+    tasks.push_back({tree, lo, hi, {}});
+    program.push_back(NULL_IDX);
+    return;
+  }
+
+  // A new node with the root's key is merged into it here and left out of
+  // both tasks.
+  auto &node = arena_->nodes[tree.root];
+  int child_height = tree.height - (node.color == Color::black);
+  NodeIdx mid = partitionBatch(lo, hi, node.key, incoming);
+  NodeIdx right_lo = mid;
+  if (mid < hi && !less(node.key, arena_->nodes[incoming.fresh[mid]].key)) {
+    if constexpr (MULTI)
+      node.count += arena_->nodes[incoming.fresh[mid]].count;
+    incoming.merged[mid] = 1;
+    ++right_lo;
+  }
+  planUnion({node.left, child_height}, lo, mid, depth - 1, incoming, tasks,
+            program);
+  planUnion({node.right, child_height}, right_lo, hi, depth - 1, incoming,
+            tasks, program);
+  program.push_back(tree.root);
+}
+
+// Merges the nodes of the tree with the new nodes into a fresh, compact
+// arena and builds a balanced tree over it.
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+void Tree<KeyTy, Compare, Augment, MULTI>::rebuildWith(
+    const BatchNodes &incoming) {
+  std::vector<NodeTy> merged;
+  merged.reserve(sizeOf(root_) + incoming.fresh.size());
+  const auto &fresh = incoming.fresh;
+  std::size_t next = 0;
+  auto nextKey = [&]() -> const KeyTy & {
+    return arena_->nodes[fresh[next]].key;
+  };
+  forEachInOrder([&](const NodeTy &node) {
+    for (; next < fresh.size() && less(nextKey(), node.key); ++next)
+      merged.push_back(arena_->nodes[fresh[next]]);
+    merged.push_back(node);
+    if (next < fresh.size() && !less(node.key, nextKey())) {
+      if constexpr (MULTI)
+        merged.back().count += arena_->nodes[fresh[next]].count;
+      ++next;
+    }
+  });
+  for (; next < fresh.size(); ++next)
+    merged.push_back(arena_->nodes[fresh[next]]);
+
+  arena_->nodes = std::move(merged);
+  arena_->free = NULL_IDX;
+  auto built = static_cast<NodeIdx>(arena_->nodes.size());
+  root_ = buildPiece(0, built, std::identity()).root;
+}
+} // namespace RB_Tree
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "tree.hpp"
+#include "verify_tree.hpp"
+
+namespace RB_Tree {
+
+// On-disk image of a Tree: a 64-byte header followed by the node arena as it
+// is laid out in memory, so loading needs no parsing and no rebalancing.
+//
+// Header, native byte order (BYTE_ORDER_MARK tells a foreign one):
+//   0  "RQTR"
+//   4  version, u32
+//   8  byte order mark, u32
+//   12 sizeof(KeyTy), u32
+//   16 sizeof(Node<KeyTy>), u32
+//   20 root index, u32
+//   24 number of nodes, u64
+//   32 checksum of the nodes, u64
+//   40 head of the free list, u32
+//   44 reserved, zero
+namespace image {
+inline constexpr char MAGIC[4] = {'R', 'Q', 'T', 'R'};
+inline constexpr std::uint32_t VERSION = 2;
+inline constexpr std::uint32_t BYTE_ORDER_MARK = 0x01020304;
+inline constexpr std::size_t HEADER_SIZE = 64;
+
+// Word-at-a-time FNV-1a variant: fast enough not to dominate a load.
+inline std::uint64_t checksum(const void *data, std::size_t size) {
+  constexpr std::uint64_t PRIME = 0x100000001b3;
+  std::uint64_t hash = 0xcbf29ce484222325;
+  const auto *bytes = static_cast<const unsigned char *>(data);
+
+  std::size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    std::uint64_t word;
+    std::memcpy(&word, bytes + i, 8);
+    hash = (hash ^ word) * PRIME;
+  }
+  for (; i < size; ++i)
+    hash = (hash ^ bytes[i]) * PRIME;
+
+  return hash ^ size;
+}
+
+struct Header final {
+  char magic[4];
+  std::uint32_t version;
+  std::uint32_t byte_order;
+  std::uint32_t key_size;
+  std::uint32_t node_size;
+  std::uint32_t root;
+  std::uint64_t node_count;
+  std::uint64_t checksum;
+  std::uint32_t free_head;
+  char reserved[HEADER_SIZE - 44];
+};
+static_assert(sizeof(Header) == HEADER_SIZE);
+
+inline void writeAll(int fd, const void *data, std::size_t size,
+                     const std::string &path) {
+  const char *bytes = static_cast<const char *>(data);
+  while (size > 0) {
+    ssize_t n = ::write(fd, bytes, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      throw std::runtime_error("Failed to write " + path);
+    bytes += n;
+    size -= static_cast<std::size_t>(n);
+  }
+}
+} // namespace image
+
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+void Tree<KeyTy, Compare, Augment, MULTI>::save(const std::string &path) const {
+  static_assert(std::is_trivially_copyable_v<NodeTy>,
+                "only trivially copyable keys can be saved");
+
+  // The image holds only this tree's nodes.
+  if (arena_.use_count() > 1) {
+    Tree own(comp_);
+    own.root_ = own.copySubtree(*this, root_, NULL_IDX);
+    own.save(path);
+    return;
+  }
+
+  image::Header header{};
+  std::memcpy(header.magic, image::MAGIC, sizeof(header.magic));
+  header.version = image::VERSION;
+  header.byte_order = image::BYTE_ORDER_MARK;
+  header.key_size = sizeof(KeyTy);
+  header.node_size = sizeof(NodeTy);
+  header.root = root_;
+  header.free_head = arena_->free;
+  header.node_count = arena_->nodes.size();
+  header.checksum = image::checksum(arena_->nodes.data(),
+                                    arena_->nodes.size() * sizeof(NodeTy));
+
+  int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    throw std::runtime_error("Failed to open file: " + path);
+
+  try {
+    image::writeAll(fd, &header, sizeof(header), path);
+    image::writeAll(fd, arena_->nodes.data(),
+                    arena_->nodes.size() * sizeof(NodeTy), path);
+  } catch (...) {
+    ::close(fd);
+    throw;
+  }
+  if (::close(fd) != 0)
+    throw std::runtime_error("Failed to write " + path);
+}
+
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+Tree<KeyTy, Compare, Augment, MULTI>
+Tree<KeyTy, Compare, Augment, MULTI>::load(const std::string &path,
+                                           bool verify, const Compare &comp) {
+  static_assert(std::is_trivially_copyable_v<NodeTy>,
+                "only trivially copyable keys can be loaded");
+  static_assert(image::HEADER_SIZE % alignof(NodeTy) == 0,
+                "the nodes of a mapped image must be aligned");
+
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error("Failed to open file: " + path);
+
+  struct stat st {};
+  if (::fstat(fd, &st) != 0) {
+    ::close(fd);
+    throw std::runtime_error("Failed to read " + path);
+  }
+  auto size = static_cast<std::size_t>(st.st_size);
+  if (size < image::HEADER_SIZE) {
+    ::close(fd);
+    throw std::runtime_error(path + ": not a tree image");
+  }
+
+  void *map = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED)
+    throw std::runtime_error("Failed to map " + path);
+
+  auto fail = [&](const std::string &what) {
+    ::munmap(map, size);
+    throw std::runtime_error(path + ": " + what);
+  };
+
+  image::Header header;
+  std::memcpy(&header, map, sizeof(header));
+  if (std::memcmp(header.magic, image::MAGIC, sizeof(header.magic)) != 0)
+    fail("not a tree image");
+  if (header.version != image::VERSION)
+    fail("unsupported image version " + std::to_string(header.version));
+  if (header.byte_order != image::BYTE_ORDER_MARK)
+    fail("image has a different byte order");
+  if (header.key_size != sizeof(KeyTy) || header.node_size != sizeof(NodeTy))
+    fail("image has a different key or node type");
+  if (header.node_count > MAX_NODES ||
+      size != image::HEADER_SIZE + header.node_count * sizeof(NodeTy))
+    fail("image size does not match its node count");
+
+  const char *data = static_cast<const char *>(map) + image::HEADER_SIZE;
+  std::size_t data_size = header.node_count * sizeof(NodeTy);
+  if (image::checksum(data, data_size) != header.checksum)
+    fail("checksum mismatch");
+
+  // The mapping is page-aligned, so the nodes after the header are aligned
+  // too, and the arena is copied straight from them in one pass.
+  Tree tree(comp);
+  const auto *nodes = reinterpret_cast<const NodeTy *>(data);
+  tree.arena_->nodes.assign(nodes, nodes + header.node_count);
+  tree.root_ = header.root;
+  tree.arena_->free = header.free_head;
+  ::munmap(map, size);
+
+  // Links must stay inside the arena even for a tree that is not verified.
+  auto inArena = [&tree](NodeIdx idx) {
+    return idx == NULL_IDX || idx < tree.arena_->nodes.size();
+  };
+  bool links_ok =
+      inArena(tree.root_) && inArena(tree.arena_->free) &&
+      (tree.root_ != NULL_IDX || tree.arena_->free != NULL_IDX) ==
+          !tree.arena_->nodes.empty();
+  for (const auto &node : tree.arena_->nodes)
+    links_ok = links_ok && inArena(node.parent) && inArena(node.left) &&
+               inArena(node.right);
+  if (!links_ok)
+    throw std::runtime_error(path + ": node links out of range");
+
+  if (verify && !tree.verifyTree())
+    throw std::runtime_error(path + ": loaded tree is not a valid red-black "
+                                    "tree");
+
+  return tree;
+}
+} // namespace RB_Tree
@@ -0,0 +1,120 @@
+#pragma once
+#include "btree.hpp"
+#include <iostream>
+
+namespace RB_Tree {
+template <typename KeyTy> struct BTree<KeyTy>::VerifyState final {
+  const KeyTy *prev_key = nullptr;
+  NodeIdx prev_leaf = NULL_IDX;
+  std::size_t leaves_seen = 0;
+  std::size_t inners_seen = 0;
+};
+
+template <typename KeyTy> bool BTree<KeyTy>::verifyTree() const {
+  if (root_ == NULL_IDX) {
+    if (!leaves_.empty() || !inners_.empty()) {
+      std::cerr << "Violation: arena with nodes is not empty but root is null."
+                << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  if (root_ >= (height_ == 0 ? leaves_.size() : inners_.size())) {
+    std::cerr << "Violation: root index is out of the node arena."
+              << std::endl;
+    return false;
+  }
+
+  VerifyState state;
+  std::size_t count = 0;
+  const KeyTy *min_key = nullptr;
+  if (const char *violation =
+          checkNode(root_, height_, NULL_IDX, state, count, min_key)) {
+    std::cerr << "Violation: " << violation << std::endl;
+    return false;
+  }
+
+  // The leaves are chained in key order.
+  if (leaves_[state.prev_leaf].next != NULL_IDX) {
+    std::cerr << "Violation: Last leaf has a next leaf." << std::endl;
+    return false;
+  }
+
+  if (state.leaves_seen != leaves_.size() ||
+      state.inners_seen != inners_.size()) {
+    std::cerr << "Violation: Some nodes are unreachable from the root."
+              << std::endl;
+    return false;
+  }
+
+  return true;
+}
+
+// Checks the subtree of `node` at height `level`; returns the violated
+// property or nullptr. Counts its keys and finds its smallest key.
+template <typename KeyTy>
+const char *BTree<KeyTy>::checkNode(NodeIdx node, int level, NodeIdx parent,
+                                    VerifyState &state, std::size_t &count,
+                                    const KeyTy *&min_key) const {
+  const bool is_root = (parent == NULL_IDX);
+
+  if (level == 0) {
+    const auto &leaf = leaves_[node];
+    ++state.leaves_seen;
+
+    if (leaf.parent != parent)
+      return "Parent links are incorrect.";
+    if (leaf.size > ORDER || leaf.size < (is_root ? 1 : ORDER / 2))
+      return "Leaf occupancy is out of bounds.";
+    if (state.prev_leaf != NULL_IDX && leaves_[state.prev_leaf].next != node)
+      return "Leaf chain is broken.";
+    state.prev_leaf = node;
+
+    for (std::uint32_t i = 0; i < leaf.size; ++i) {
+      if (state.prev_key && !(*state.prev_key < leaf.keys[i]))
+        return "Keys are not strictly increasing.";
+      state.prev_key = &leaf.keys[i];
+    }
+
+    count = leaf.size;
+    min_key = &leaf.keys[0];
+    return nullptr;
+  }
+
+  if (node >= inners_.size())
+    return "Inner node index is out of the node arena.";
+
+  const auto &inner = inners_[node];
+  ++state.inners_seen;
+
+  if (inner.parent != parent)
+    return "Parent links are incorrect.";
+  if (inner.size > ORDER || inner.size < (is_root ? 2 : ORDER / 2))
+    return "Inner node occupancy is out of bounds.";
+
+  count = 0;
+  for (std::uint32_t i = 0; i < inner.size; ++i) {
+    NodeIdx child = inner.children[i];
+    if (level == 1 && child >= leaves_.size())
+      return "Leaf index is out of the node arena.";
+
+    std::size_t child_count = 0;
+    const KeyTy *child_min = nullptr;
+    if (const char *violation =
+            checkNode(child, level - 1, node, state, child_count, child_min))
+      return violation;
+
+    if (inner.counts[i] != child_count)
+      return "Subtree sizes are incorrect.";
+    if (*child_min < inner.keys[i] || inner.keys[i] < *child_min)
+      return "Separator key is not the smallest key of its child.";
+
+    count += child_count;
+    if (i == 0)
+      min_key = child_min;
+  }
+
+  return nullptr;
+}
+} // namespace RB_Tree
@@ -1,26 +1,34 @@
 #pragma once
 #include "tree.hpp"
+#include <algorithm>
+#include <concepts>
 #include <iostream>
+#include <vector>
 
 namespace RB_Tree {
-template <typename KeyTy> bool Tree<KeyTy>::verifyTree() const {
-  if (!root_)
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+bool Tree<KeyTy, Compare, Augment, MULTI>::verifyTree() const {
+  // Nodes reached so far, to tell that the tree and the free list cover the
+  // arena without sharing nodes.
+  std::vector<bool> seen(arena_->nodes.size());
+
+  if (root_ == NULL_IDX) {
+    if (!checkFreeList(seen)) {
+      std::cerr << "Violation: root is null but not all nodes are free."
+                << std::endl;
+      return false;
+    }
     return true;
-
-  if (!root_.has_value() && !nodes_.empty()) {
-    std::cerr << "Violation: list with nodes is not empty but root is null."
-              << std::endl;
-    return false;
   }
 
-  if (root_.has_value() && nodes_.empty()) {
-    std::cerr << "Violation: root is set but list with nodes is empty."
+  if (root_ >= arena_->nodes.size()) {
+    std::cerr << "Violation: root index is out of the node arena."
               << std::endl;
     return false;
   }
 
   // The root must be black.
-  if ((*root_)->color != Color::black) {
+  if (arena_->nodes[root_].color != Color::black) {
     std::cerr << "Violation: Root is not black." << std::endl;
     return false;
   }
@@ -39,13 +47,13 @@ template <typename KeyTy> bool Tree<KeyTy>::verifyTree() const {
   }
 
   // Checking the BST property.
-  if (!checkBSTProperty(root_, std::nullopt, std::nullopt)) {
+  if (!checkBSTProperty(root_, NULL_IDX, NULL_IDX)) {
     std::cerr << "Violation: BST property is broken." << std::endl;
     return false;
   }
 
   // Checking the correctness of parent links.
-  if (!checkParentLinks(root_, std::nullopt)) {
+  if (!checkParentLinks(root_, NULL_IDX)) {
     std::cerr << "Violation: Parent links are incorrect." << std::endl;
     return false;
   }
@@ -56,35 +64,54 @@ template <typename KeyTy> bool Tree<KeyTy>::verifyTree() const {
     return false;
   }
 
+  // Checking the aggregates of the augmentation policy.
+  if (!checkAggregates(root_)) {
+    std::cerr << "Violation: Subtree aggregates are incorrect." << std::endl;
+    return false;
+  }
+
+  // Every node of the arena is either in the tree or on the free list, or
+  // belongs to another tree sharing the arena.
+  forEachInOrder([this, &seen](const NodeTy &node) {
+    seen[static_cast<std::size_t>(&node - arena_->nodes.data())] = true;
+  });
+  if (!checkFreeList(seen)) {
+    std::cerr << "Violation: Free list does not hold exactly the nodes "
+                 "outside the tree."
+              << std::endl;
+    return false;
+  }
+
   return true;
 }
 
-template <typename KeyTy>
-bool Tree<KeyTy>::checkRedProperty(std::optional<It> node_opt) const {
-  if (!node_opt)
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+bool Tree<KeyTy, Compare, Augment, MULTI>::checkRedProperty(
+    NodeIdx node_idx) const {
+  if (node_idx == NULL_IDX)
     return true;
 
-  const auto &node = **node_opt;
+  const auto &node = arena_->nodes[node_idx];
   if (node.color == Color::red) {
-    if (node.left && (*node.left)->color == Color::red)
+    if (node.left != NULL_IDX && arena_->nodes[node.left].color == Color::red)
       return false;
-    if (node.right && (*node.right)->color == Color::red)
+    if (node.right != NULL_IDX && arena_->nodes[node.right].color == Color::red)
       return false;
   }
 
   return checkRedProperty(node.left) && checkRedProperty(node.right);
 }
 
-template <typename KeyTy>
-bool Tree<KeyTy>::checkBlackHeight(std::optional<It> node_opt, int black_count,
-                                   int &path_black_count) const {
-  if (!node_opt) {
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+bool Tree<KeyTy, Compare, Augment, MULTI>::checkBlackHeight(
+    NodeIdx node_idx, int black_count, int &path_black_count) const {
+  if (node_idx == NULL_IDX) {
     if (path_black_count == -1)
       path_black_count = black_count;
     return path_black_count == black_count;
   }
 
-  const auto &node = **node_opt;
+  const auto &node = arena_->nodes[node_idx];
   if (node.color == Color::black)
     ++black_count;
 
@@ -92,49 +119,96 @@ bool Tree<KeyTy>::checkBlackHeight(std::optional<It> node_opt, int black_count,
          checkBlackHeight(node.right, black_count, path_black_count);
 }
 
-template <typename KeyTy>
-bool Tree<KeyTy>::checkBSTProperty(std::optional<It> node_opt,
-                                   std::optional<It> min,
-                                   std::optional<It> max) const {
-  if (!node_opt)
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+bool Tree<KeyTy, Compare, Augment, MULTI>::checkBSTProperty(
+    NodeIdx node_idx, NodeIdx min, NodeIdx max) const {
+  if (node_idx == NULL_IDX)
     return true;
 
-  const auto &node = **node_opt;
-  if (min && (*min)->key >= node.key)
+  const auto &node = arena_->nodes[node_idx];
+  if (min != NULL_IDX && !less(arena_->nodes[min].key, node.key))
     return false;
-  if (max && (*max)->key <= node.key)
+  if (max != NULL_IDX && !less(node.key, arena_->nodes[max].key))
     return false;
 
-  return checkBSTProperty(node.left, min, node_opt) &&
-         checkBSTProperty(node.right, node_opt, max);
+  return checkBSTProperty(node.left, min, node_idx) &&
+         checkBSTProperty(node.right, node_idx, max);
 }
 
-template <typename KeyTy>
-bool Tree<KeyTy>::checkParentLinks(std::optional<It> node_opt,
-                                   std::optional<It> parent_opt) const {
-  if (!node_opt)
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+bool Tree<KeyTy, Compare, Augment, MULTI>::checkParentLinks(
+    NodeIdx node_idx, NodeIdx parent_idx) const {
+  if (node_idx == NULL_IDX)
     return true;
 
-  const auto &node = **node_opt;
-  if (node.parent != parent_opt)
+  const auto &node = arena_->nodes[node_idx];
+  if (node.parent != parent_idx)
     return false;
 
-  return checkParentLinks(node.left, node_opt) &&
-         checkParentLinks(node.right, node_opt);
+  return checkParentLinks(node.left, node_idx) &&
+         checkParentLinks(node.right, node_idx);
 }
 
-template <typename KeyTy>
-bool Tree<KeyTy>::checkSubtreeSizes(std::optional<It> node_opt) const {
-  if (!node_opt)
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+bool Tree<KeyTy, Compare, Augment, MULTI>::checkSubtreeSizes(
+    NodeIdx node_idx) const {
+  if (node_idx == NULL_IDX)
     return true;
 
-  const auto &node = **node_opt;
-  std::size_t left_size = node.left ? (*node.left)->subtree_size : 0;
-  std::size_t right_size = node.right ? (*node.right)->subtree_size : 0;
-
-  if (node.subtree_size != 1 + left_size + right_size)
+  const auto &node = arena_->nodes[node_idx];
+  if (weight(node) == 0 || node.subtree_size != weight(node) +
+                                                   sizeOf(node.left) +
+                                                   sizeOf(node.right))
     return false;
 
   return checkSubtreeSizes(node.left) && checkSubtreeSizes(node.right);
 }
+
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+bool Tree<KeyTy, Compare, Augment, MULTI>::checkAggregates(
+    NodeIdx node_idx) const {
+  if constexpr (!AUGMENTED || !std::equality_comparable<AggregateTy>) {
+    return true;
+  } else {
+    if (node_idx == NULL_IDX)
+      return true;
+
+    const auto &node = arena_->nodes[node_idx];
+    auto expected = Augment::combine(
+        Augment::combine(aggregateOf(node.left), liftNode(node)),
+        aggregateOf(node.right));
+    if (!(node.aggregate == expected))
+      return false;
+
+    return checkAggregates(node.left) && checkAggregates(node.right);
+  }
+}
+
+// Free subtrees hang from the free list by their roots; their nodes must
+// be inside the arena and appear nowhere else, and together with the nodes
+// already seen they must cover the arena unless other trees share it.
+template <typename KeyTy, typename Compare, typename Augment, bool MULTI>
+bool Tree<KeyTy, Compare, Augment, MULTI>::checkFreeList(
+    std::vector<bool> &seen) const {
+  std::vector<NodeIdx> pending;
+  for (NodeIdx root = arena_->free; root != NULL_IDX;
+       root = arena_->nodes[root].parent) {
+    pending.push_back(root);
+    while (!pending.empty()) {
+      NodeIdx idx = pending.back();
+      pending.pop_back();
+      if (idx == NULL_IDX)
+        continue;
+      if (idx >= arena_->nodes.size() || seen[idx])
+        return false;
+
+      seen[idx] = true;
+      pending.push_back(arena_->nodes[idx].left);
+      pending.push_back(arena_->nodes[idx].right);
+    }
+  }
+
+  return arena_.use_count() > 1 ||
+         std::find(seen.begin(), seen.end(), false) == seen.end();
+}
 } // namespace RB_Tree
@@ -11,12 +11,21 @@ STATS_DIR = os.path.join(PROJECT_ROOT, "statistics")
 TESTS_DIR = os.path.join(PROJECT_ROOT, "tests")
 TREE_OUT_DIR = os.path.join(STATS_DIR, "tree-time-results")
 SET_OUT_DIR = os.path.join(STATS_DIR, "set-time-results")
+OFFLINE_OUT_DIR = os.path.join(STATS_DIR, "offline-time-results")
+BTREE_OUT_DIR = os.path.join(STATS_DIR, "btree-time-results")
+PERF_OUT_DIR = os.path.join(STATS_DIR, "perf-counters")
 TIME_FILE = os.path.join(STATS_DIR, "time_comparison.txt")
+PERF_FILE = os.path.join(STATS_DIR, "perf_counters.txt")
+LATENCY_OUT_DIR = os.path.join(STATS_DIR, "latency")
 
 BUILD_DIR = os.path.join(PROJECT_ROOT, "build")
 
 os.makedirs(TREE_OUT_DIR, exist_ok=True)
 os.makedirs(SET_OUT_DIR, exist_ok=True)
+os.makedirs(OFFLINE_OUT_DIR, exist_ok=True)
+os.makedirs(BTREE_OUT_DIR, exist_ok=True)
+os.makedirs(PERF_OUT_DIR, exist_ok=True)
+os.makedirs(LATENCY_OUT_DIR, exist_ok=True)
 
 TESTS_NUM = 8
 
@@ -37,6 +46,86 @@ def run_benchmark(exe_name, output_dir):
         relative_out = os.path.relpath(out_path, PROJECT_ROOT)
         print(f"  {test} --> /{relative_out}")
 
+def run_perf_counters():
+    print("\nCollecting hardware counters with tree_bench --perf-counters:")
+    exe_path = os.path.join(BUILD_DIR, "tree_bench")
+    for test in test_files:
+        test_path = os.path.join(TESTS_DIR, test)
+        out_path = os.path.join(PERF_OUT_DIR, test.replace(".dat", ".txt"))
+
+        with open(test_path, 'r') as fin, open(out_path, 'w') as fout:
+            subprocess.run([exe_path, "--perf-counters"], stdin=fin, stdout=fout, stderr=subprocess.STDOUT, text=True)
+
+        relative_out = os.path.relpath(out_path, PROJECT_ROOT)
+        print(f"  {test} --> /{relative_out}")
+
+def collect_perf_counters():
+    """Сводит строки вида '<фаза> <событие>/op: <значение>' в одну таблицу"""
+    rows = []
+    metrics = []
+    for i in range(1, TESTS_NUM + 1):
+        values = {}
+        try:
+            with open(os.path.join(PERF_OUT_DIR, f"test{i}.txt"), 'r') as f:
+                for line in f:
+                    if "/op:" not in line:
+                        continue
+                    name, value = line.rsplit(":", 1)
+                    name = name.replace("/op", "")
+                    values[name] = value.strip()
+                    if name not in metrics:
+                        metrics.append(name)
+        except Exception as e:
+            print(f"Error reading perf counters of test{i}: {e}")
+        rows.append(values)
+
+    with open(PERF_FILE, 'w') as f:
+        f.write("per operation".ljust(24) + "".join(f"test{i}".rjust(12) for i in range(1, TESTS_NUM + 1)) + "\n")
+        for metric in metrics:
+            f.write(metric.ljust(24) + "".join(row.get(metric, "n/a").rjust(12) for row in rows) + "\n")
+
+    print(f"\nHardware counters saved to {PERF_FILE}")
+
+def run_latency():
+    print("\nMeasuring per-command latency with tree_bench --latency:")
+    exe_path = os.path.join(BUILD_DIR, "tree_bench")
+    for test in test_files:
+        test_path = os.path.join(TESTS_DIR, test)
+        csv_path = os.path.join(LATENCY_OUT_DIR, test.replace(".dat", ".csv"))
+        out_path = os.path.join(LATENCY_OUT_DIR, test.replace(".dat", ".txt"))
+
+        with open(test_path, 'r') as fin, open(out_path, 'w') as fout:
+            subprocess.run([exe_path, "--latency", csv_path], stdin=fin, stdout=fout, stderr=subprocess.STDOUT, text=True)
+
+        relative_out = os.path.relpath(out_path, PROJECT_ROOT)
+        print(f"  {test} --> /{relative_out}")
+
+def plot_latency(test):
+    """Гистограммы задержек вставок и запросов одного теста"""
+    buckets = {"k": ([], []), "q": ([], [])}
+    with open(os.path.join(LATENCY_OUT_DIR, test.replace(".dat", ".csv")), 'r') as f:
+        next(f)
+        for line in f:
+            command, low, high, count = line.strip().split(",")
+            buckets[command][0].append((float(low) + float(high)) / 2)
+            buckets[command][1].append(int(count))
+
+    fig, ax = plt.subplots(figsize=(12, 6))
+    ax.plot(*buckets["k"], '-', color='tab:blue', linewidth=1.5, label='k (insert)')
+    ax.plot(*buckets["q"], '-', color='tab:orange', linewidth=1.5, label='q (query)')
+    ax.set_xscale('log')
+    ax.set_yscale('log')
+    ax.set_xlabel('Задержка, нс')
+    ax.set_ylabel('Число команд')
+    ax.set_title(f'Распределение задержек команд ({test})')
+    ax.legend()
+    ax.grid(True, which="both", ls="--", linewidth=0.5)
+
+    plot_path = os.path.join(STATS_DIR, "latency_histogram.png")
+    plt.savefig(plot_path, dpi=300, bbox_inches='tight')
+    print(f"Latency plot saved to {plot_path}")
+    plt.close()
+
 def extract_time(output_file):
     """Извлекает время из файла вида '... Time: X.XXX s'"""
     try:
@@ -57,12 +146,17 @@ def collect_results():
     print("\nCollecting results into time_comparison.txt...")
     tree_times = []
     set_times = []
+    offline_times = []
+    btree_times = []
 
     for i in range(1, TESTS_NUM + 1):
         rb_t = extract_time(os.path.join(TREE_OUT_DIR, f"test{i}.txt"))
         set_t = extract_time(os.path.join(SET_OUT_DIR, f"test{i}.txt"))
+        offline_t = extract_time(os.path.join(OFFLINE_OUT_DIR, f"test{i}.txt"))
         tree_times.append(rb_t)
         set_times.append(set_t)
+        offline_times.append(offline_t)
+        btree_times.append(extract_time(os.path.join(BTREE_OUT_DIR, f"test{i}.txt")))
 
     # Сохраняем time.txt
     with open(TIME_FILE, 'w') as f:
@@ -72,18 +166,28 @@ def collect_results():
         f.write("\n============SET============\n")
         for i, t in enumerate(set_times, 1):
             f.write(f"test{i}: {t:.3f} s\n")
+        f.write("\n==========OFFLINE==========\n")
+        for i, t in enumerate(offline_times, 1):
+            f.write(f"test{i}: {t:.3f} s\n")
+        f.write("\n===========BTREE===========\n")
+        for i, t in enumerate(btree_times, 1):
+            f.write(f"test{i}: {t:.3f} s\n")
 
     print(f"\nResults saved to {TIME_FILE}")
-    return np.array(tree_times), np.array(set_times)
+    return np.array(tree_times), np.array(set_times), np.array(offline_times), np.array(btree_times)
 
-def plot_results(tree_times, set_times):
+def plot_results(tree_times, set_times, offline_times, btree_times):
     print("\nGenerating plots...")
     sizes_smooth = np.linspace(SIZES.min(), SIZES.max(), 300)
 
     spl_rb = make_interp_spline(SIZES, tree_times, k=2)
     spl_set = make_interp_spline(SIZES, set_times, k=2)
+    spl_offline = make_interp_spline(SIZES, offline_times, k=2)
+    spl_btree = make_interp_spline(SIZES, btree_times, k=2)
     rb_smooth = np.maximum(spl_rb(sizes_smooth), 0)
     set_smooth = np.maximum(spl_set(sizes_smooth), 0)
+    offline_smooth = np.maximum(spl_offline(sizes_smooth), 0)
+    btree_smooth = np.maximum(spl_btree(sizes_smooth), 0)
 
     fig, (ax1, ax2) = plt.subplots(2, 1, figsize=(12, 10))
 
@@ -91,7 +195,11 @@ def plot_results(tree_times, set_times):
     ax1.plot(sizes_smooth, rb_smooth, '-', color='tab:blue', linewidth=2.5, label='RB-Tree (O(log n) distance)')
     ax1.plot(sizes_smooth, set_smooth, '-', color='tab:red', linewidth=2.5, label='std::set (O(k) distance)')
     ax1.plot(SIZES, tree_times, 'o', color='tab:blue', markersize=6)
+    ax1.plot(sizes_smooth, offline_smooth, '-', color='tab:green', linewidth=2.5, label='Offline (Fenwick tree)')
     ax1.plot(SIZES, set_times, 's', color='tab:red', markersize=6)
+    ax1.plot(SIZES, offline_times, '^', color='tab:green', markersize=6)
+    ax1.plot(sizes_smooth, btree_smooth, '-', color='tab:purple', linewidth=2.5, label='B+ tree (SIMD nodes)')
+    ax1.plot(SIZES, btree_times, 'D', color='tab:purple', markersize=6)
     ax1.set_yscale('log')
     ax1.set_xlabel('Количество операций')
     ax1.set_ylabel('Время, с')
@@ -103,7 +211,11 @@ def plot_results(tree_times, set_times):
     ax2.plot(sizes_smooth, rb_smooth, '-', color='tab:blue', linewidth=2.5, label='RB-Tree (O(log n) distance)')
     ax2.plot(sizes_smooth, set_smooth, '-', color='tab:red', linewidth=2.5, label='std::set (O(k) distance)')
     ax2.plot(SIZES, tree_times, 'o', color='tab:blue', markersize=6)
+    ax2.plot(sizes_smooth, offline_smooth, '-', color='tab:green', linewidth=2.5, label='Offline (Fenwick tree)')
     ax2.plot(SIZES, set_times, 's', color='tab:red', markersize=6)
+    ax2.plot(SIZES, offline_times, '^', color='tab:green', markersize=6)
+    ax2.plot(sizes_smooth, btree_smooth, '-', color='tab:purple', linewidth=2.5, label='B+ tree (SIMD nodes)')
+    ax2.plot(SIZES, btree_times, 'D', color='tab:purple', markersize=6)
     ax2.set_xlabel('Количество операций')
     ax2.set_ylabel('Время, с')
     ax2.set_title('Сравнение производительности: RB-Tree vs std::set (линейная шкала)')
@@ -133,11 +245,19 @@ def plot_results(tree_times, set_times):
 if __name__ == "__main__":
     tree_exe = "tree_bench"
     set_exe = "set_bench"
+    offline_exe = "offline_bench"
+    btree_exe = "btree_bench"
 
     run_benchmark(tree_exe, TREE_OUT_DIR)
     run_benchmark(set_exe, SET_OUT_DIR)
+    run_benchmark(offline_exe, OFFLINE_OUT_DIR)
+    run_benchmark(btree_exe, BTREE_OUT_DIR)
+    run_perf_counters()
+    collect_perf_counters()
+    run_latency()
 
-    tree_times, set_times = collect_results()
+    tree_times, set_times, offline_times, btree_times = collect_results()
 
-    plot_results(tree_times, set_times)
+    plot_results(tree_times, set_times, offline_times, btree_times)
+    plot_latency(test_files[-1])
     
\ No newline at end of file
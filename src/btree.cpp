@@ -0,0 +1,81 @@
+#include "../include/btree.hpp"
+#include "../include/command_reader.hpp"
+#include "../include/result_writer.hpp"
+#include <iostream>
+#include <string>
+
+#ifdef TIME
+#include <chrono>
+#endif // TIME
+
+int main([[maybe_unused]] int argc, [[maybe_unused]] char **argv) {
+  using KeyTy = int;
+#ifdef BENCHMARK
+  [[maybe_unused]] volatile std::size_t benchmark_sink = 0;
+#endif
+
+  char command = 0;
+  KeyTy first = 0, second = 0;
+
+  RB_Tree::BTree<KeyTy> tree;
+
+#ifdef TIME
+  auto begin = std::chrono::steady_clock::now();
+#endif // TIME
+
+#ifndef BENCHMARK
+  Output::ResultWriter writer(Output::parseFormat(argc, argv));
+#endif
+
+  Input::CommandReader reader;
+
+  try {
+    while (reader.nextCommand(command)) {
+      switch (command) {
+      case 'k': {
+        first = reader.nextInt<KeyTy>();
+        tree.insert(first);
+
+        break;
+      }
+
+      case 'q': {
+        first = reader.nextInt<KeyTy>();
+        second = reader.nextInt<KeyTy>();
+
+        std::size_t distance = 0;
+        if (second > first)
+          distance = tree.countRange(first, second);
+
+#ifdef BENCHMARK
+        benchmark_sink = distance;
+#else
+        writer.write(distance);
+#endif
+
+        break;
+      }
+
+      default:
+        reader.fail(std::string("unknown command '") + command + "'");
+      }
+    }
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+#ifndef BENCHMARK
+  writer.flush();
+#endif
+
+#ifdef TIME
+  auto end = std::chrono::steady_clock::now();
+  auto elapsed_ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(end - begin);
+  std::cout << "\n\nTime: " << static_cast<float>(elapsed_ms.count()) / 1000
+            << " s\n";
+#endif // TIME
+
+  return 0;
+}
@@ -1,10 +1,46 @@
+#include "../include/binary_format.hpp"
+#include "../include/command_reader.hpp"
+#include "../include/fenwick.hpp"
+#include "../include/frozen_index.hpp"
+#include "../include/latency_histogram.hpp"
+#include "../include/persistent_tree.hpp"
+#include "../include/result_writer.hpp"
+#include "../include/sharded_tree.hpp"
+#include "../include/thread_pool.hpp"
+#include "../include/tree_batch.hpp"
+#include "../include/tree_image.hpp"
+#include "../include/verify_btree.hpp"
 #include "../include/verify_tree.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <functional>
 #include <gtest/gtest.h>
+#include <iterator>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <ranges>
+#include <set>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
 
 using KeyTy = int;
 
-TEST(RB_Tree, InvalidInput) {
-  RB_Tree::Tree<KeyTy> tree;
+// Tests shared by every order-statistics tree implementation.
+template <typename TreeTy> class OrderedTree : public ::testing::Test {};
+
+using TreeTypes = ::testing::Types<RB_Tree::Tree<KeyTy>, RB_Tree::BTree<KeyTy>>;
+TYPED_TEST_SUITE(OrderedTree, TreeTypes);
+
+TYPED_TEST(OrderedTree, InvalidInput) {
+  TypeParam tree;
 
   tree.insert(2);
   tree.insert(5);
@@ -22,8 +58,8 @@ TEST(RB_Tree, NullTree) {
   EXPECT_TRUE(tree.verifyTree());
 }
 
-TEST(RB_Tree, EmptyTree) {
-  RB_Tree::Tree<KeyTy> tree;
+TYPED_TEST(OrderedTree, EmptyTree) {
+  TypeParam tree;
 
   auto lb = tree.lowerBound(6);
   auto ub = tree.upperBound(1);
@@ -32,15 +68,15 @@ TEST(RB_Tree, EmptyTree) {
   EXPECT_EQ(tree.distance(ub, lb), 0);
 }
 
-TEST(RB_Tree, ZeroElements) {
-  RB_Tree::Tree<KeyTy> tree1;
+TYPED_TEST(OrderedTree, ZeroElements) {
+  TypeParam tree1;
   tree1.insert(0);
   auto lb1 = tree1.lowerBound(1);
   auto ub1 = tree1.upperBound(9);
   EXPECT_EQ(tree1.distance(lb1, ub1), 0);
   EXPECT_EQ(tree1.distance(ub1, lb1), 0);
 
-  RB_Tree::Tree<KeyTy> tree2;
+  TypeParam tree2;
   tree2.insert(10);
   auto lb2 = tree2.lowerBound(1);
   auto ub2 = tree2.upperBound(9);
@@ -48,15 +84,15 @@ TEST(RB_Tree, ZeroElements) {
   EXPECT_EQ(tree2.distance(ub2, lb2), 0);
 }
 
-TEST(RB_Tree, EdgeElement) {
-  RB_Tree::Tree<KeyTy> tree1;
+TYPED_TEST(OrderedTree, EdgeElement) {
+  TypeParam tree1;
   tree1.insert(1);
   auto lb1 = tree1.lowerBound(1);
   auto ub1 = tree1.upperBound(9);
   EXPECT_EQ(tree1.distance(lb1, ub1), 1);
   EXPECT_EQ(tree1.distance(ub1, lb1), 0);
 
-  RB_Tree::Tree<KeyTy> tree2;
+  TypeParam tree2;
   tree2.insert(9);
   auto lb2 = tree2.lowerBound(1);
   auto ub2 = tree2.upperBound(9);
@@ -87,6 +123,420 @@ TEST(RB_Tree, DuplicateInsert) {
   EXPECT_TRUE(tree.verifyTree());
 }
 
+TEST(RB_Tree, MultisetInsert) {
+  RB_Tree::MultiTree<KeyTy> tree;
+  tree.insert(42);
+  tree.insert(42);
+  tree.insert(7);
+  tree.insert(42);
+
+  EXPECT_EQ(tree.size(), 4);
+  EXPECT_EQ(std::distance(tree.begin(), tree.end()), 2);
+  EXPECT_EQ((*tree.lowerBound(42))->count, 3);
+  EXPECT_EQ(tree.countRange(42, 42), 3);
+  EXPECT_EQ(tree.rank(42), 1);
+  EXPECT_EQ((*tree.select(3))->key, 42);
+  EXPECT_FALSE(tree.select(4));
+  EXPECT_TRUE(tree.verifyTree());
+}
+
+TEST(RB_Tree, MultisetMatchesStd) {
+  std::mt19937 gen(22);
+  std::uniform_int_distribution<KeyTy> dist(-200, 200);
+  RB_Tree::MultiTree<KeyTy, std::less<KeyTy>, RB_Tree::augment::Sum<long long>>
+      tree;
+  std::multiset<KeyTy> set;
+  std::vector<KeyTy> keys;
+
+  for (int i = 0; i < 3000; ++i) {
+    KeyTy key = dist(gen);
+    tree.insert(key);
+    set.insert(key);
+    keys.push_back(key);
+  }
+  ASSERT_TRUE(tree.verifyTree());
+  ASSERT_EQ(tree.size(), set.size());
+
+  // The bulk build collapses runs of equal keys the same way.
+  RB_Tree::MultiTree<KeyTy, std::less<KeyTy>, RB_Tree::augment::Sum<long long>>
+      built(keys.begin(), keys.end());
+  ASSERT_TRUE(built.verifyTree());
+  ASSERT_EQ(built.size(), set.size());
+  std::set<KeyTy> distinct(keys.begin(), keys.end());
+  EXPECT_EQ(static_cast<size_t>(std::distance(built.begin(), built.end())),
+            distinct.size());
+
+  auto frozen = tree.freeze();
+  ASSERT_EQ(frozen.size(), set.size());
+
+  for (int i = 0; i < 500; ++i) {
+    KeyTy lo = dist(gen), hi = dist(gen);
+    auto less = static_cast<size_t>(
+        std::distance(set.begin(), set.lower_bound(lo)));
+    auto less_equal = static_cast<size_t>(
+        std::distance(set.begin(), set.upper_bound(lo)));
+    size_t in_range = 0;
+    long long sum = 0;
+    for (auto it = set.lower_bound(lo); it != set.end() && *it <= hi; ++it) {
+      ++in_range;
+      sum += *it;
+    }
+
+    ASSERT_EQ(tree.countLess(lo), less);
+    ASSERT_EQ(tree.countLessEqual(lo), less_equal);
+    ASSERT_EQ(tree.countRange(lo, hi), in_range);
+    ASSERT_EQ(built.countRange(lo, hi), in_range);
+    ASSERT_EQ(frozen.countLess(lo), less);
+    ASSERT_EQ(frozen.countRange(lo, hi), in_range);
+    ASSERT_EQ(tree.aggregate(lo, hi), sum);
+    ASSERT_EQ(built.aggregate(lo, hi), sum);
+
+    size_t k = static_cast<size_t>(i) % set.size();
+    ASSERT_EQ((*tree.select(k))->key, *std::next(set.begin(), k));
+  }
+}
+
+TEST(RB_Tree, EraseMatchesSet) {
+  std::mt19937 gen(23);
+  std::uniform_int_distribution<KeyTy> dist(-300, 300);
+  RB_Tree::Tree<KeyTy, std::less<KeyTy>, RB_Tree::augment::Sum<long long>>
+      tree;
+  std::set<KeyTy> set;
+  size_t largest = 0;
+
+  for (int i = 0; i < 5000; ++i) {
+    KeyTy key = dist(gen);
+    if (gen() % 2) {
+      tree.insert(key);
+      set.insert(key);
+    } else {
+      ASSERT_EQ(tree.erase(key), set.erase(key));
+    }
+    ASSERT_TRUE(tree.verifyTree());
+    ASSERT_EQ(tree.size(), set.size());
+    largest = std::max(largest, set.size());
+
+    KeyTy lo = dist(gen);
+    ASSERT_EQ(tree.countLess(lo), static_cast<size_t>(std::distance(
+                                      set.begin(), set.lower_bound(lo))));
+    long long sum = 0;
+    for (auto it = set.lower_bound(lo); it != set.end() && *it <= lo + 50;
+         ++it)
+      sum += *it;
+    ASSERT_EQ(tree.aggregate(lo, lo + 50), sum);
+  }
+
+  // Erased nodes are reused: the arena never outgrows the largest size.
+  EXPECT_EQ(tree.get_nodes().size(), largest);
+  EXPECT_TRUE(std::ranges::equal(tree, set));
+
+  // erase(iterator) returns the next key; erasing everything leaves only
+  // free nodes.
+  auto it = tree.begin();
+  while (it != tree.end()) {
+    set.erase(set.begin());
+    it = tree.erase(it);
+    ASSERT_TRUE(tree.verifyTree());
+    if (!set.empty()) {
+      ASSERT_EQ(*it, *set.begin());
+    }
+  }
+  EXPECT_EQ(tree.size(), 0);
+  EXPECT_EQ(tree.erase(0), 0);
+
+  tree.insert(1);
+  EXPECT_EQ(tree.get_nodes().size(), largest);
+  EXPECT_TRUE(tree.verifyTree());
+}
+
+TEST(RB_Tree, MultisetErase) {
+  std::mt19937 gen(123);
+  std::uniform_int_distribution<KeyTy> dist(-50, 50);
+  RB_Tree::MultiTree<KeyTy> tree;
+  std::multiset<KeyTy> set;
+
+  for (int i = 0; i < 3000; ++i) {
+    KeyTy key = dist(gen);
+    switch (gen() % 4) {
+    case 0:
+    case 1:
+      tree.insert(key);
+      set.insert(key);
+      break;
+    case 2: {
+      auto found = set.find(key);
+      ASSERT_EQ(tree.eraseOne(key), found != set.end());
+      if (found != set.end())
+        set.erase(found);
+      break;
+    }
+    default:
+      ASSERT_EQ(tree.erase(key), set.erase(key));
+    }
+    ASSERT_TRUE(tree.verifyTree());
+    ASSERT_EQ(tree.size(), set.size());
+    ASSERT_EQ(tree.countRange(key, key + 10),
+              static_cast<size_t>(std::distance(set.lower_bound(key),
+                                                set.upper_bound(key + 10))));
+  }
+}
+
+TEST(RB_Tree, SplitAndJoin) {
+  using SumTree =
+      RB_Tree::Tree<KeyTy, std::less<KeyTy>, RB_Tree::augment::Sum<long long>>;
+
+  for (int n : {0, 1, 2, 10, 1000}) {
+    std::vector<KeyTy> keys;
+    for (int i = 0; i < n; ++i)
+      keys.push_back(2 * i);
+
+    for (int at : {-1, 0, 1, n / 3, n, 2 * n - 1, 2 * n}) {
+      SumTree tree;
+      for (KeyTy key : keys)
+        tree.insert(key);
+
+      auto upper = tree.split(at);
+      ASSERT_TRUE(tree.verifyTree());
+      ASSERT_TRUE(upper.verifyTree());
+      auto first_upper = std::lower_bound(keys.begin(), keys.end(), at);
+      ASSERT_TRUE(std::ranges::equal(
+          tree, std::ranges::subrange(keys.begin(), first_upper)));
+      ASSERT_TRUE(std::ranges::equal(
+          upper, std::ranges::subrange(first_upper, keys.end())));
+
+      // Both halves stay usable on their own.
+      tree.insert(-5);
+      upper.insert(5000);
+      upper.erase(5000);
+      ASSERT_TRUE(tree.verifyTree());
+      ASSERT_TRUE(upper.verifyTree());
+      tree.erase(-5);
+
+      // Put back together around a key missing from both sides.
+      if (at % 2 != 0 && at > -1 && at < 2 * n) {
+        auto joined = SumTree::join(std::move(tree), at, std::move(upper));
+        ASSERT_TRUE(joined.verifyTree());
+        ASSERT_EQ(joined.size(), keys.size() + 1);
+        ASSERT_EQ(joined.rank(at), static_cast<size_t>(first_upper -
+                                                       keys.begin()));
+      }
+    }
+  }
+
+  // A handle into the tree survives a split that hands out most of it.
+  SumTree tree;
+  for (int i = 0; i < 1000; ++i)
+    tree.insert(2 * i);
+  auto handle = *tree.select(10);
+  auto upper = tree.split(100);
+  EXPECT_EQ(upper.size(), 950);
+  EXPECT_EQ(handle->key, 20);
+  EXPECT_EQ(tree.select(10)->index(), handle.index());
+
+  // Joins of trees of very different heights, in both orders.
+  SumTree small, large;
+  for (int i = 0; i < 3; ++i)
+    small.insert(i);
+  for (int i = 10; i < 5000; ++i)
+    large.insert(i);
+  auto joined = SumTree::join(std::move(small), 5, std::move(large));
+  ASSERT_TRUE(joined.verifyTree());
+  EXPECT_EQ(joined.size(), 4994);
+  EXPECT_EQ(joined.aggregate(0, 10), 0 + 1 + 2 + 5 + 10);
+
+  SumTree left, right;
+  for (int i = 0; i < 5000; ++i)
+    left.insert(i);
+  right.insert(6000);
+  joined = SumTree::join(std::move(left), 5500, std::move(right));
+  ASSERT_TRUE(joined.verifyTree());
+  EXPECT_EQ(joined.size(), 5002);
+
+  SumTree out_of_order;
+  out_of_order.insert(1);
+  EXPECT_THROW(SumTree::join(std::move(joined), 0, std::move(out_of_order)),
+               std::invalid_argument);
+}
+
+TEST(RB_Tree, EraseAndExtractRange) {
+  std::mt19937 gen(124);
+  std::uniform_int_distribution<KeyTy> dist(-500, 500);
+  RB_Tree::MultiTree<KeyTy, std::less<KeyTy>, RB_Tree::augment::Sum<long long>>
+      tree;
+  std::multiset<KeyTy> set;
+
+  for (int round = 0; round < 200; ++round) {
+    for (int i = 0; i < 50; ++i) {
+      KeyTy key = dist(gen);
+      tree.insert(key);
+      set.insert(key);
+    }
+
+    KeyTy lo = dist(gen), hi = lo + dist(gen) / 10;
+    auto first = set.lower_bound(lo);
+    auto last = lo <= hi ? set.upper_bound(hi) : first;
+    std::multiset<KeyTy> range(first, last);
+    set.erase(first, last);
+
+    if (round % 2) {
+      ASSERT_EQ(tree.eraseRange(lo, hi), range.size());
+    } else {
+      auto extracted = tree.extractRange(lo, hi);
+      ASSERT_TRUE(extracted.verifyTree());
+      ASSERT_EQ(extracted.size(), range.size());
+      long long sum = 0;
+      for (KeyTy key : range)
+        sum += key;
+      ASSERT_EQ(extracted.aggregate(-1000, 1000), sum);
+    }
+    ASSERT_TRUE(tree.verifyTree());
+    ASSERT_EQ(tree.size(), set.size());
+    ASSERT_EQ(tree.countRange(-1000, 1000), set.size());
+  }
+
+  // Nodes of erased ranges are reused.
+  size_t arena = tree.get_nodes().size();
+  tree.eraseRange(-1000, 1000);
+  EXPECT_EQ(tree.size(), 0);
+  for (int i = 0; i < 100; ++i)
+    tree.insert(i);
+  EXPECT_EQ(tree.get_nodes().size(), arena);
+  EXPECT_TRUE(tree.verifyTree());
+}
+
+TEST(RB_Tree, SplitSharesTheArena) {
+  // All keys in [0, 1000) but 500, which joins the halves back.
+  RB_Tree::Tree<KeyTy> tree;
+  for (int i = 0; i < 1000; ++i)
+    if (i != 500)
+      tree.insert(i);
+  auto handle = *tree.lowerBound(700);
+
+  for (int round = 0; round < 10; ++round) {
+    {
+      auto upper = tree.split(500);
+      auto middle = tree.extractRange(100, 199);
+      ASSERT_TRUE(tree.verifyTree());
+      ASSERT_TRUE(upper.verifyTree());
+      ASSERT_TRUE(middle.verifyTree());
+      EXPECT_EQ(upper.size(), 499);
+      EXPECT_EQ(middle.size(), 100);
+
+      // Split off without copying: handles follow their keys.
+      EXPECT_EQ(&upper.get_nodes(), &tree.get_nodes());
+      EXPECT_EQ(&middle.get_nodes(), &tree.get_nodes());
+      EXPECT_EQ(handle->key, 700);
+      EXPECT_EQ(upper.lowerBound(700)->index(), handle.index());
+
+      tree = RB_Tree::Tree<KeyTy>::join(std::move(tree), 500,
+                                        std::move(upper));
+      ASSERT_TRUE(tree.verifyTree());
+      EXPECT_EQ(tree.size(), 900);
+      tree.erase(500);
+    }
+
+    // The nodes of `middle` went back to the shared free list.
+    for (int i = 100; i < 200; ++i)
+      tree.insert(i);
+    EXPECT_EQ(tree.size(), 999);
+    EXPECT_EQ(tree.get_nodes().size(), 1000);
+    ASSERT_TRUE(tree.verifyTree());
+  }
+  EXPECT_EQ(tree.lowerBound(700)->index(), handle.index());
+}
+
+TEST(RB_Tree, InsertBatch) {
+  std::mt19937 gen(25);
+  std::uniform_int_distribution<KeyTy> dist(-100000, 100000);
+
+  for (unsigned threads : {1u, 2u, 4u}) {
+    Parallel::ThreadPool pool(threads);
+    for (size_t tree_size : {0, 10, 5000}) {
+      for (size_t batch_size : {0, 1, 100, 50000}) {
+        RB_Tree::Tree<KeyTy, std::less<KeyTy>,
+                      RB_Tree::augment::Sum<long long>>
+            tree;
+        std::set<KeyTy> set;
+        for (size_t i = 0; i < tree_size; ++i) {
+          KeyTy key = dist(gen);
+          tree.insert(key);
+          set.insert(key);
+        }
+        auto handle = tree.get_root();
+        KeyTy handle_key = handle ? (*handle)->key : 0;
+
+        std::vector<KeyTy> batch(batch_size);
+        for (auto &key : batch)
+          key = dist(gen);
+        // Some keys repeat inside the batch and some are already there.
+        if (batch_size > 1)
+          batch[1] = batch[0];
+        if (batch_size > 0 && !set.empty())
+          batch.back() = *set.begin();
+        set.insert(batch.begin(), batch.end());
+
+        tree.insertBatch(batch, pool);
+        ASSERT_TRUE(tree.verifyTree());
+        ASSERT_TRUE(std::ranges::equal(tree, set));
+        ASSERT_EQ(tree.aggregate(-100000, 100000),
+                  std::accumulate(set.begin(), set.end(), 0LL));
+
+        // Below the rebuild ratio the union keeps node handles valid.
+        if (handle && batch_size < 4 * tree_size) {
+          EXPECT_EQ((*handle)->key, handle_key);
+        }
+      }
+    }
+  }
+}
+
+TEST(RB_Tree, InsertBatchReusesFreeNodes) {
+  std::mt19937 gen(225);
+  Parallel::ThreadPool pool(2);
+  RB_Tree::Tree<KeyTy> tree;
+
+  // A sliding window of 40000 keys: every round adds 10000 new ones in a
+  // batch and drops the 10000 oldest, so the freed nodes must be reused.
+  for (KeyTy round = 0; round < 50; ++round) {
+    std::vector<KeyTy> batch(10000);
+    std::iota(batch.begin(), batch.end(), round * 10000);
+    std::shuffle(batch.begin(), batch.end(), gen);
+    tree.insertBatch(batch, pool);
+    if (round >= 4)
+      ASSERT_EQ(tree.eraseRange((round - 4) * 10000, (round - 3) * 10000 - 1),
+                10000);
+
+    ASSERT_TRUE(tree.verifyTree());
+    ASSERT_EQ(tree.size(), std::min<size_t>((round + 1) * 10000, 40000));
+    ASSERT_LE(tree.get_nodes().size(), 50000);
+  }
+}
+
+TEST(RB_Tree, MultisetInsertBatch) {
+  std::mt19937 gen(125);
+  std::uniform_int_distribution<KeyTy> dist(-1000, 1000);
+  Parallel::ThreadPool pool(3);
+  RB_Tree::MultiTree<KeyTy> tree;
+  std::multiset<KeyTy> set;
+
+  // The large batches are collapsed in parallel slices, and the last one is
+  // one long run of a single key.
+  for (int round = 0; round < 6; ++round) {
+    std::vector<KeyTy> batch(round * 10000 + 1);
+    for (auto &key : batch)
+      key = round < 5 ? dist(gen) : 7;
+    tree.insertBatch(batch, pool);
+    set.insert(batch.begin(), batch.end());
+
+    ASSERT_TRUE(tree.verifyTree());
+    ASSERT_EQ(tree.size(), set.size());
+    for (KeyTy lo = -1000; lo <= 1000; lo += 37)
+      ASSERT_EQ(tree.countRange(lo, lo + 50),
+                static_cast<size_t>(std::distance(set.lower_bound(lo),
+                                                  set.upper_bound(lo + 50))));
+  }
+}
+
 TEST(RB_Tree, AscendingInsert) {
   RB_Tree::Tree<KeyTy> tree1;
 
@@ -146,8 +596,8 @@ TEST(RB_Tree, SubtreeSizeConsistency) {
   EXPECT_TRUE(tree.verifyTree());
 }
 
-TEST(RB_Tree, RangeQuery) {
-  RB_Tree::Tree<KeyTy> tree;
+TYPED_TEST(OrderedTree, RangeQuery) {
+  TypeParam tree;
   for (int i = 1; i <= 10; ++i)
     tree.insert(i);
   EXPECT_TRUE(tree.verifyTree());
@@ -160,8 +610,8 @@ TEST(RB_Tree, RangeQuery) {
   EXPECT_EQ(tree.distance(tree.lowerBound(5), tree.upperBound(5)), 1);
 }
 
-TEST(RB_Tree, Bounds) {
-  RB_Tree::Tree<KeyTy> tree;
+TYPED_TEST(OrderedTree, Bounds) {
+  TypeParam tree;
   std::vector<int> keys = {2, 4, 6, 8};
   for (int k : keys)
     tree.insert(k);
@@ -179,8 +629,8 @@ TEST(RB_Tree, Bounds) {
   EXPECT_EQ(tree.lowerBound(10), std::nullopt);
 }
 
-TEST(RB_Tree, LargeTree) {
-  RB_Tree::Tree<KeyTy> tree;
+TYPED_TEST(OrderedTree, LargeTree) {
+  TypeParam tree;
   const int N = 1000;
   for (int i = 1; i <= N; ++i)
     tree.insert(i);
@@ -195,6 +645,761 @@ TEST(RB_Tree, LargeTree) {
   EXPECT_EQ(tree.getRank(last), N - 1);
 }
 
+TYPED_TEST(OrderedTree, CountRange) {
+  TypeParam tree;
+  EXPECT_EQ(tree.countRange(1, 10), 0);
+  EXPECT_EQ(tree.countLess(1), 0);
+
+  for (int i = 0; i < 200; i += 2)
+    tree.insert(i);
+  ASSERT_TRUE(tree.verifyTree());
+
+  for (int lo = -3; lo < 203; ++lo) {
+    EXPECT_EQ(tree.countLess(lo), tree.getRank(tree.lowerBound(lo)) +
+                                      (tree.lowerBound(lo) ? 0 : 100));
+    EXPECT_EQ(tree.countLessEqual(lo), tree.countLess(lo + 1));
+
+    for (int hi = lo; hi < 203; hi += 7)
+      EXPECT_EQ(tree.countRange(lo, hi),
+                tree.distance(tree.lowerBound(lo), tree.upperBound(hi)));
+  }
+
+  EXPECT_EQ(tree.countRange(10, 5), 0);
+  EXPECT_EQ(tree.countRange(4, 4), 1);
+  EXPECT_EQ(tree.countRange(5, 5), 0);
+}
+
+TYPED_TEST(OrderedTree, RandomAgainstSet) {
+  TypeParam tree;
+  std::set<int> reference;
+  std::mt19937 rng(42);
+
+  for (int i = 0; i < 20000; ++i) {
+    int key = static_cast<int>(rng() % 30000) - 15000;
+    tree.insert(key);
+    reference.insert(key);
+  }
+  ASSERT_TRUE(tree.verifyTree());
+
+  for (int i = 0; i < 2000; ++i) {
+    int lo = static_cast<int>(rng() % 32000) - 16000;
+    int hi = static_cast<int>(rng() % 32000) - 16000;
+
+    auto lb = tree.lowerBound(lo);
+    auto ref_lb = reference.lower_bound(lo);
+    ASSERT_EQ(lb.has_value(), ref_lb != reference.end());
+    if (lb) {
+      EXPECT_EQ((*lb)->key, *ref_lb);
+      EXPECT_EQ(tree.getRank(lb), std::distance(reference.begin(), ref_lb));
+    }
+
+    std::size_t expected = 0;
+    if (hi >= lo)
+      expected = std::distance(reference.lower_bound(lo),
+                               reference.upper_bound(hi));
+    EXPECT_EQ(tree.countRange(lo, hi), expected);
+    EXPECT_EQ(tree.distance(lb, tree.upperBound(hi)), expected);
+  }
+}
+
+TYPED_TEST(OrderedTree, SortedInserts) {
+  TypeParam ascending, descending;
+  for (int i = 0; i < 5000; ++i) {
+    ascending.insert(i);
+    descending.insert(-i);
+  }
+
+  ASSERT_TRUE(ascending.verifyTree());
+  ASSERT_TRUE(descending.verifyTree());
+  EXPECT_EQ(ascending.countRange(0, 4999), 5000);
+  EXPECT_EQ(descending.countRange(-4999, 0), 5000);
+  EXPECT_EQ(ascending.countLess(2500), 2500);
+  EXPECT_EQ(descending.countLessEqual(-2500), 2500);
+}
+
+TEST(RB_Tree, BulkBuild) {
+  for (int n = 0; n <= 300; ++n) {
+    std::vector<int> keys(n);
+    for (int i = 0; i < n; ++i)
+      keys[i] = 3 * i;
+
+    RB_Tree::Tree<KeyTy> tree(keys.begin(), keys.end());
+    ASSERT_TRUE(tree.verifyTree()) << "n = " << n;
+    EXPECT_EQ(tree.get_nodes().size(), n);
+    EXPECT_EQ(tree.countRange(0, 3 * n), n);
+  }
+}
+
+TEST(RB_Tree, BulkBuildUnsorted) {
+  std::vector<int> keys = {5, -2, 8, 5, 1, 9, 3, 8, 8, 0, -2};
+
+  RB_Tree::Tree<KeyTy> tree;
+  tree.insert(100);
+  tree.assign(keys.begin(), keys.end());
+
+  ASSERT_TRUE(tree.verifyTree());
+  EXPECT_EQ((*tree.get_root())->subtree_size, 7);
+  EXPECT_EQ(tree.countRange(-2, 9), 7);
+  EXPECT_EQ(tree.countRange(100, 100), 0);
+
+  // The tree stays usable after a bulk build.
+  tree.insert(4);
+  tree.insert(100);
+  ASSERT_TRUE(tree.verifyTree());
+  EXPECT_EQ(tree.countRange(-2, 100), 9);
+}
+
+TEST(RB_Tree, FrozenIndex) {
+  // 4- and 8-byte keys are prefetched with different strides.
+  auto check = []<typename Key>() {
+    for (int n = 0; n <= 40; ++n) {
+      RB_Tree::Tree<Key> tree;
+      for (int i = 0; i < n; ++i)
+        tree.insert(2 * i);
+
+      auto frozen = tree.freeze();
+      ASSERT_EQ(frozen.size(), n);
+
+      for (Key lo = -2; lo < 2 * n + 2; ++lo) {
+        EXPECT_EQ(frozen.countLess(lo), tree.countLess(lo));
+        EXPECT_EQ(frozen.countLessEqual(lo), tree.countLessEqual(lo));
+        for (Key hi = -2; hi < 2 * n + 2; ++hi)
+          ASSERT_EQ(frozen.countRange(lo, hi), tree.countRange(lo, hi))
+              << "n = " << n << ", lo = " << lo << ", hi = " << hi;
+      }
+    }
+  };
+  check.operator()<KeyTy>();
+  check.operator()<std::int64_t>();
+}
+
+TEST(RB_Tree, HandleSurvivesArenaGrowth) {
+  RB_Tree::Tree<KeyTy> tree;
+  tree.insert(0);
+
+  auto first = tree.lowerBound(0);
+  ASSERT_NE(first, std::nullopt);
+
+  // Enough inserts to reallocate the node arena several times.
+  for (int i = 1; i <= 1000; ++i)
+    tree.insert(i);
+  ASSERT_TRUE(tree.verifyTree());
+
+  EXPECT_EQ((*first)->key, 0);
+  EXPECT_EQ(tree.getRank(first), 0);
+  EXPECT_EQ(tree.distance(first, tree.upperBound(1000)), 1001);
+}
+
+TEST(RB_Tree, SelectAndRank) {
+  std::mt19937 gen(20);
+  std::uniform_int_distribution<KeyTy> dist(-5000, 5000);
+  RB_Tree::Tree<KeyTy> tree;
+  std::set<KeyTy> set;
+  for (int i = 0; i < 2000; ++i) {
+    KeyTy key = dist(gen);
+    tree.insert(key);
+    set.insert(key);
+  }
+  ASSERT_EQ(tree.size(), set.size());
+
+  std::size_t k = 0;
+  for (KeyTy key : set) {
+    auto node = tree.select(k);
+    ASSERT_NE(node, std::nullopt);
+    ASSERT_EQ((*node)->key, key);
+    ASSERT_EQ(tree.rank(key), k);
+    ASSERT_EQ(tree.getRank(node), k);
+    ++k;
+  }
+  EXPECT_EQ(tree.select(set.size()), std::nullopt);
+  EXPECT_EQ(tree.rank(5001), set.size());
+  EXPECT_EQ(tree.rank(-5001), 0);
+}
+
+TEST(RB_Tree, RankIteration) {
+  RB_Tree::Tree<KeyTy> empty;
+  EXPECT_EQ(empty.begin(), empty.end());
+
+  RB_Tree::Tree<KeyTy> tree;
+  for (int i = 99; i >= 0; --i)
+    tree.insert(3 * i);
+
+  std::vector<KeyTy> keys(tree.begin(), tree.end());
+  ASSERT_EQ(keys.size(), 100);
+  for (std::size_t i = 0; i < keys.size(); ++i)
+    ASSERT_EQ(keys[i], 3 * static_cast<KeyTy>(i));
+
+  // Backwards from end() and from any rank.
+  std::vector<KeyTy> reversed(std::make_reverse_iterator(tree.end()),
+                              std::make_reverse_iterator(tree.begin()));
+  EXPECT_TRUE(std::equal(keys.rbegin(), keys.rend(), reversed.begin()));
+  auto it = tree.iteratorAt(50);
+  EXPECT_EQ(*it, 150);
+  EXPECT_EQ(*--it, 147);
+  EXPECT_EQ(tree.iteratorAt(100), tree.end());
+
+  std::vector<KeyTy> middle;
+  for (KeyTy key : tree.ranks(10, 15))
+    middle.push_back(key);
+  EXPECT_EQ(middle, (std::vector<KeyTy>{30, 33, 36, 39, 42}));
+  EXPECT_TRUE(tree.ranks(90, 200).begin() != tree.end());
+  EXPECT_EQ(std::ranges::distance(tree.ranks(90, 200)), 10);
+  EXPECT_TRUE(tree.ranks(20, 10).empty());
+
+  static_assert(std::bidirectional_iterator<RB_Tree::Tree<KeyTy>::Iterator>);
+}
+
+namespace {
+// Keeps the first and last key of a range: not commutative, so it checks that
+// aggregates are folded in key order.
+struct FirstLast final {
+  struct value_type final {
+    bool empty = true;
+    KeyTy first = 0, last = 0;
+    bool operator==(const value_type &) const = default;
+  };
+
+  static value_type identity() { return {}; }
+  static value_type combine(const value_type &lhs, const value_type &rhs) {
+    if (lhs.empty)
+      return rhs;
+    if (rhs.empty)
+      return lhs;
+    return {false, lhs.first, rhs.last};
+  }
+  static value_type lift(KeyTy key) { return {false, key, key}; }
+};
+} // namespace
+
+TEST(RB_Tree, Aggregate) {
+  static_assert(sizeof(RB_Tree::Node<KeyTy>) ==
+                sizeof(KeyTy) + 4 * sizeof(RB_Tree::NodeIdx));
+
+  std::mt19937 gen(21);
+  std::uniform_int_distribution<KeyTy> dist(-1000, 1000);
+  RB_Tree::Tree<KeyTy, std::less<KeyTy>, RB_Tree::augment::Sum<long long>> sum;
+  RB_Tree::Tree<KeyTy, std::less<KeyTy>, RB_Tree::augment::Min<KeyTy>> min;
+  RB_Tree::Tree<KeyTy, std::less<KeyTy>, RB_Tree::augment::Max<KeyTy>> max;
+  RB_Tree::Tree<KeyTy, std::less<KeyTy>, FirstLast> first_last;
+  std::set<KeyTy> set;
+
+  for (int i = 0; i < 1000; ++i) {
+    KeyTy key = dist(gen);
+    sum.insert(key);
+    min.insert(key);
+    max.insert(key);
+    first_last.insert(key);
+    set.insert(key);
+  }
+  ASSERT_TRUE(sum.verifyTree());
+  ASSERT_TRUE(first_last.verifyTree());
+
+  for (int i = 0; i < 500; ++i) {
+    KeyTy lo = dist(gen), hi = dist(gen);
+    long long expected_sum = 0;
+    for (auto it = set.lower_bound(lo); it != set.end() && *it <= hi; ++it)
+      expected_sum += *it;
+    ASSERT_EQ(sum.aggregate(lo, hi), expected_sum);
+
+    auto first = set.lower_bound(lo);
+    if (lo > hi || first == set.end() || *first > hi) {
+      EXPECT_EQ(min.aggregate(lo, hi), std::numeric_limits<KeyTy>::max());
+      EXPECT_EQ(max.aggregate(lo, hi), std::numeric_limits<KeyTy>::lowest());
+      EXPECT_TRUE(first_last.aggregate(lo, hi).empty);
+      continue;
+    }
+    KeyTy last = *std::prev(set.upper_bound(hi));
+    EXPECT_EQ(min.aggregate(lo, hi), *first);
+    EXPECT_EQ(max.aggregate(lo, hi), last);
+    EXPECT_EQ(first_last.aggregate(lo, hi),
+              (FirstLast::value_type{false, *first, last}));
+  }
+
+  // The bulk build computes the aggregates too.
+  std::vector<KeyTy> keys(set.begin(), set.end());
+  RB_Tree::Tree<KeyTy, std::less<KeyTy>, FirstLast> built(keys.begin(),
+                                                         keys.end());
+  ASSERT_TRUE(built.verifyTree());
+  EXPECT_EQ(built.aggregate(-1000, 1000),
+            (FirstLast::value_type{false, keys.front(), keys.back()}));
+}
+
+TEST(RB_Tree, CustomComparator) {
+  RB_Tree::Tree<KeyTy, std::greater<KeyTy>> tree;
+  for (int i = 0; i < 100; ++i)
+    tree.insert(i);
+  ASSERT_TRUE(tree.verifyTree());
+
+  // Keys are ordered from 99 down to 0.
+  EXPECT_EQ(tree.countLess(90), 9);
+  EXPECT_EQ(tree.countLessEqual(90), 10);
+  EXPECT_EQ(tree.countRange(60, 40), 21);
+  EXPECT_EQ(tree.countRange(40, 60), 0);
+  EXPECT_EQ((*tree.lowerBound(50))->key, 50);
+  EXPECT_EQ((*tree.upperBound(50))->key, 49);
+
+  auto frozen = tree.freeze();
+  for (int lo = -1; lo <= 100; ++lo)
+    ASSERT_EQ(frozen.countRange(lo, lo - 10), tree.countRange(lo, lo - 10));
+
+  std::vector<KeyTy> keys = {5, 1, 4, 1, 3};
+  RB_Tree::Tree<KeyTy, std::greater<KeyTy>> built(keys.begin(), keys.end());
+  EXPECT_TRUE(built.verifyTree());
+  EXPECT_EQ((*built.get_root())->subtree_size, 4);
+}
+
+namespace {
+struct Employee final {
+  int id;
+  int age;
+};
+
+// Orders employees by age and compares them with plain ages.
+struct ByAge final {
+  using is_transparent = void;
+  bool operator()(const Employee &lhs, const Employee &rhs) const {
+    return lhs.age < rhs.age;
+  }
+  bool operator()(const Employee &lhs, int age) const { return lhs.age < age; }
+  bool operator()(int age, const Employee &rhs) const { return age < rhs.age; }
+};
+} // namespace
+
+TEST(RB_Tree, TransparentLookup) {
+  RB_Tree::Tree<std::string, std::less<>> words;
+  for (const char *word : {"apple", "banana", "cherry", "date", "fig"})
+    words.insert(word);
+  ASSERT_TRUE(words.verifyTree());
+
+  EXPECT_EQ(words.countRange(std::string_view("b"), std::string_view("d")), 2);
+  EXPECT_EQ(words.countLess("cherry"), 2);
+  EXPECT_EQ((*words.lowerBound(std::string_view("c")))->key, "cherry");
+  EXPECT_EQ(words.upperBound(std::string_view("fig")), std::nullopt);
+
+  RB_Tree::Tree<Employee, ByAge> staff;
+  for (int i = 0; i < 50; ++i)
+    staff.insert({i, 20 + i});
+  ASSERT_TRUE(staff.verifyTree());
+
+  EXPECT_EQ(staff.countRange(30, 39), 10);
+  EXPECT_EQ(staff.countLessEqual(25), 6);
+  EXPECT_EQ((*staff.lowerBound(42))->key.id, 22);
+}
+
+TEST(RB_Tree, SaveLoad) {
+  std::string path = ::testing::TempDir() + "tree_image_test.img";
+  std::mt19937 gen(17);
+  std::uniform_int_distribution<KeyTy> dist(-1000, 1000);
+
+  for (int n : {0, 1, 2, 100, 1000}) {
+    RB_Tree::Tree<KeyTy> tree;
+    for (int i = 0; i < n; ++i)
+      tree.insert(dist(gen));
+    tree.save(path);
+
+    auto loaded = RB_Tree::Tree<KeyTy>::load(path, true);
+    ASSERT_EQ(loaded.get_nodes().size(), tree.get_nodes().size());
+    for (int lo = -1001; lo <= 1001; lo += 7)
+      ASSERT_EQ(loaded.countRange(lo, lo + 100), tree.countRange(lo, lo + 100));
+
+    // The loaded tree keeps growing like any other.
+    loaded.insert(5000);
+    EXPECT_TRUE(loaded.verifyTree());
+  }
+
+  // The free list is saved with the nodes.
+  RB_Tree::Tree<KeyTy> tree;
+  for (int i = 0; i < 100; ++i)
+    tree.insert(i);
+  for (int i = 0; i < 100; i += 3)
+    tree.erase(i);
+  tree.save(path);
+  auto loaded = RB_Tree::Tree<KeyTy>::load(path, true);
+  EXPECT_EQ(loaded.size(), tree.size());
+  for (int i = 0; i < 100; i += 3)
+    loaded.insert(i);
+  EXPECT_TRUE(loaded.verifyTree());
+  EXPECT_EQ(loaded.get_nodes().size(), 100);
+
+  // An image of a tree sharing its arena holds only that tree's nodes.
+  auto upper = loaded.split(90);
+  upper.save(path);
+  auto loaded_upper = RB_Tree::Tree<KeyTy>::load(path, true);
+  EXPECT_EQ(loaded_upper.get_nodes().size(), upper.size());
+  EXPECT_TRUE(std::ranges::equal(loaded_upper, upper));
+  std::remove(path.c_str());
+}
+
+// Orders keys up or down, as chosen when the tree is built.
+struct DirectedLess {
+  bool descending = false;
+  bool operator()(KeyTy lhs, KeyTy rhs) const {
+    return descending ? rhs < lhs : lhs < rhs;
+  }
+};
+
+TEST(RB_Tree, LoadTakesTheComparator) {
+  using DirectedTree = RB_Tree::Tree<KeyTy, DirectedLess>;
+  std::string path = ::testing::TempDir() + "tree_image_test.img";
+  std::vector<KeyTy> keys(100);
+  std::iota(keys.begin(), keys.end(), 0);
+  DirectedTree tree(keys.begin(), keys.end(), DirectedLess{true});
+  tree.save(path);
+
+  auto loaded = DirectedTree::load(path, true, DirectedLess{true});
+  EXPECT_TRUE(std::ranges::equal(loaded, tree));
+  loaded.insert(100);
+  EXPECT_EQ(*loaded.begin(), 100);
+  EXPECT_TRUE(loaded.verifyTree());
+
+  // With the default comparator the descending image is out of order.
+  EXPECT_THROW(DirectedTree::load(path, true), std::runtime_error);
+  std::remove(path.c_str());
+}
+
+TEST(RB_Tree, LoadRejectsBadImages) {
+  std::string path = ::testing::TempDir() + "tree_image_test.img";
+  RB_Tree::Tree<KeyTy> tree;
+  for (int i = 0; i < 100; ++i)
+    tree.insert(i);
+  tree.save(path);
+
+  std::vector<char> image;
+  {
+    std::ifstream in(path, std::ios::binary);
+    image.assign(std::istreambuf_iterator<char>(in), {});
+  }
+  auto writeImage = [&path](const std::vector<char> &bytes) {
+    std::ofstream out(path, std::ios::binary);
+    out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+  };
+  auto expectRejected = [&path](bool verify) {
+    EXPECT_THROW(RB_Tree::Tree<KeyTy>::load(path, verify), std::runtime_error);
+  };
+
+  auto bad = image;
+  bad[0] = 'X';
+  writeImage(bad);
+  expectRejected(false);
+
+  bad = image;
+  bad.pop_back();
+  writeImage(bad);
+  expectRejected(false);
+
+  bad = image;
+  bad[RB_Tree::image::HEADER_SIZE] ^= 1;
+  writeImage(bad);
+  expectRejected(false);
+
+  // A consistent checksum over a broken tree is only caught by verifyTree:
+  // every node is made red.
+  using NodeTy = RB_Tree::Node<KeyTy>;
+  bad = image;
+  std::vector<NodeTy> nodes = tree.get_nodes();
+  for (auto &node : nodes)
+    node.color = RB_Tree::Color::red;
+  std::memcpy(bad.data() + RB_Tree::image::HEADER_SIZE, nodes.data(),
+              nodes.size() * sizeof(NodeTy));
+  std::uint64_t checksum = RB_Tree::image::checksum(
+      nodes.data(), nodes.size() * sizeof(NodeTy));
+  std::memcpy(bad.data() + offsetof(RB_Tree::image::Header, checksum),
+              &checksum, sizeof(checksum));
+  writeImage(bad);
+  EXPECT_NO_THROW(RB_Tree::Tree<KeyTy>::load(path));
+  expectRejected(true);
+
+  std::remove(path.c_str());
+}
+
+TEST(PersistentTree, MatchesSet) {
+  RB_Tree::PersistentTree<KeyTy> tree;
+  std::set<int> reference;
+  std::mt19937 rng(7);
+
+  for (int i = 0; i < 5000; ++i) {
+    int key = static_cast<int>(rng() % 8000) - 4000;
+    tree.insert(key);
+    reference.insert(key);
+  }
+
+  auto snapshot = tree.snapshot();
+  ASSERT_TRUE(snapshot.verifyTree());
+  ASSERT_EQ(snapshot.size(), reference.size());
+
+  for (int key = -4100; key <= 4100; key += 7) {
+    auto lb = reference.lower_bound(key);
+    auto ub = reference.upper_bound(key);
+    EXPECT_EQ(snapshot.lowerBound(key),
+              lb == reference.end() ? std::nullopt : std::optional(*lb));
+    EXPECT_EQ(snapshot.upperBound(key),
+              ub == reference.end() ? std::nullopt : std::optional(*ub));
+    EXPECT_EQ(snapshot.countLess(key),
+              std::distance(reference.begin(), lb));
+    EXPECT_EQ(snapshot.countRange(key, key + 100),
+              std::distance(lb, reference.upper_bound(key + 100)));
+  }
+}
+
+TEST(PersistentTree, SnapshotIsImmutable) {
+  RB_Tree::PersistentTree<KeyTy> tree;
+  for (int i = 0; i < 100; ++i)
+    tree.insert(i);
+
+  auto old_version = tree.snapshot();
+  for (int i = 100; i < 1000; ++i)
+    tree.insert(i);
+
+  EXPECT_EQ(old_version.size(), 100);
+  EXPECT_EQ(old_version.countRange(0, 999), 100);
+  EXPECT_EQ(old_version.lowerBound(100), std::nullopt);
+  EXPECT_TRUE(old_version.verifyTree());
+  EXPECT_EQ(tree.snapshot().countRange(0, 999), 1000);
+}
+
+TEST(PersistentTree, ReadersDuringInserts) {
+  constexpr int KEYS = 20000;
+  RB_Tree::PersistentTree<KeyTy> tree;
+  std::atomic<bool> done = false;
+  std::atomic<int> failures = 0;
+
+  // Keys are inserted in increasing order, so every version holds exactly
+  // 0 .. size - 1.
+  auto read = [&] {
+    while (!done) {
+      auto snapshot = tree.snapshot();
+      auto n = static_cast<int>(snapshot.size());
+      if (snapshot.countRange(0, KEYS) != static_cast<std::size_t>(n) ||
+          snapshot.countLess(n / 2) != static_cast<std::size_t>(n / 2))
+        ++failures;
+    }
+  };
+
+  std::thread reader1(read), reader2(read);
+  for (int i = 0; i < KEYS; ++i)
+    tree.insert(i);
+  done = true;
+  reader1.join();
+  reader2.join();
+
+  EXPECT_EQ(failures, 0);
+  EXPECT_TRUE(tree.snapshot().verifyTree());
+}
+
+TEST(ShardedTree, MatchesSet) {
+  RB_Tree::ShardedTree<KeyTy> tree({-5000, 0, 5000});
+  std::set<int> reference;
+  std::mt19937 rng(11);
+
+  for (int i = 0; i < 50000; ++i) {
+    int key = static_cast<int>(rng() % 20000) - 10000;
+    tree.insert(key);
+    reference.insert(key);
+  }
+
+  ASSERT_TRUE(tree.verifyTree());
+  ASSERT_EQ(tree.size(), reference.size());
+  for (int lo = -10500; lo <= 10500; lo += 333)
+    for (int hi = lo - 100; hi <= 10500; hi += 1777)
+      ASSERT_EQ(tree.countRange(lo, hi),
+                hi < lo ? 0
+                        : std::distance(reference.lower_bound(lo),
+                                        reference.upper_bound(hi)))
+          << "lo = " << lo << ", hi = " << hi;
+}
+
+TEST(ShardedTree, RebalancesSkewedKeys) {
+  // All keys fall into the last shard at first.
+  RB_Tree::ShardedTree<KeyTy> tree({-3000, -2000, -1000});
+  for (int i = 0; i < 100000; ++i)
+    tree.insert((i * 7919) % 100000);
+
+  EXPECT_GT(tree.rebalances(), 0);
+  ASSERT_TRUE(tree.verifyTree());
+  EXPECT_EQ(tree.size(), 100000);
+  EXPECT_EQ(tree.countRange(500, 99499), 99000);
+
+  for (std::size_t size : tree.shardSizes())
+    EXPECT_LE(size, 2 * 100000 / tree.shardCount());
+}
+
+namespace {
+// Comparing two keys 13 throws, so the second insert of 13 fails.
+struct FragileKey {
+  int value;
+
+  friend bool operator<(FragileKey lhs, FragileKey rhs) {
+    if (lhs.value == 13 && rhs.value == 13)
+      throw std::runtime_error("fragile key");
+    return lhs.value < rhs.value;
+  }
+  friend bool operator==(FragileKey, FragileKey) = default;
+};
+} // namespace
+
+TEST(ShardedTree, PassesWorkerErrorsToTheCaller) {
+  RB_Tree::ShardedTree<FragileKey> tree(std::vector<FragileKey>{{0}});
+  tree.insert({-1});
+  tree.insert({13});
+  tree.insert({13});
+
+  // Only the shards the range overlaps are waited for.
+  EXPECT_EQ(tree.countRange({-5}, {-1}), 1);
+  EXPECT_THROW(tree.countRange({1}, {20}), std::runtime_error);
+  EXPECT_EQ(tree.countRange({1}, {20}), 1);
+  EXPECT_EQ(tree.size(), 2);
+}
+
+TEST(LatencyHistogram, Percentiles) {
+  Perf::LatencyHistogram histogram;
+  EXPECT_EQ(histogram.percentile(50), 0);
+
+  for (std::uint64_t value = 1; value <= 100000; ++value)
+    histogram.record(value);
+
+  EXPECT_EQ(histogram.count(), 100000);
+  EXPECT_EQ(histogram.max(), 100000);
+  EXPECT_EQ(histogram.percentile(100), 100000);
+  for (double percent : {50.0, 90.0, 99.0, 99.9}) {
+    double exact = percent * 1000;
+    EXPECT_GE(histogram.percentile(percent), exact * 0.97) << percent;
+    EXPECT_LE(histogram.percentile(percent), exact * 1.04) << percent;
+  }
+
+  std::ostringstream csv;
+  histogram.dumpCsv(csv, "k", 1);
+  EXPECT_EQ(csv.str().substr(0, 8), "k,1,1,1\n");
+}
+
+TEST(Offline, MatchesTree) {
+  std::vector<Offline::Command<KeyTy>> commands = {
+      {'k', 10, 0}, {'k', 20, 0}, {'q', 8, 31},  {'q', 6, 9},
+      {'k', 30, 0}, {'k', 40, 0}, {'q', 15, 40}, {'k', 20, 0},
+      {'q', 40, 15}, {'q', 20, 20}, {'q', -5, 100}};
+
+  RB_Tree::Tree<KeyTy> tree;
+  std::vector<std::size_t> expected;
+  for (const auto &command : commands) {
+    if (command.type == 'k')
+      tree.insert(command.first);
+    else if (command.second > command.first)
+      expected.push_back(tree.countRange(command.first, command.second));
+    else
+      expected.push_back(0);
+  }
+
+  EXPECT_EQ(Offline::answerQueries(commands), expected);
+  EXPECT_EQ(expected, (std::vector<std::size_t>{2, 0, 3, 0, 0, 4}));
+}
+
+TEST(CommandReader, ParsesAndReportsErrors) {
+  std::string path = ::testing::TempDir() + "command_reader_test.dat";
+  {
+    std::ofstream out(path);
+    out << "k -10 k +20\n\tq 8 2147483647   q x";
+  }
+
+  Input::CommandReader reader(path);
+  char command = 0;
+
+  ASSERT_TRUE(reader.nextCommand(command));
+  EXPECT_EQ(command, 'k');
+  EXPECT_EQ(reader.nextInt<int>(), -10);
+  ASSERT_TRUE(reader.nextCommand(command));
+  EXPECT_EQ(reader.nextInt<int>(), 20);
+  ASSERT_TRUE(reader.nextCommand(command));
+  EXPECT_EQ(command, 'q');
+  EXPECT_EQ(reader.nextInt<int>(), 8);
+  EXPECT_EQ(reader.nextInt<int>(), 2147483647);
+  ASSERT_TRUE(reader.nextCommand(command));
+  EXPECT_THROW(reader.nextInt<int>(), Input::ParseError);
+  EXPECT_EQ(reader.offset(), 32);
+
+  std::remove(path.c_str());
+}
+
+TEST(CommandReader, BinaryStream) {
+  std::string path = ::testing::TempDir() + "command_reader_test.bin";
+  auto writeStream = [&path](const std::vector<char> &bytes) {
+    std::ofstream out(path, std::ios::binary);
+    out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+  };
+
+  for (bool delta : {false, true}) {
+    BinaryFormat::Encoder encoder(4, delta);
+    encoder.insert(-10);
+    encoder.query(8, 2147483647);
+    encoder.insert(-2147483648LL);
+    writeStream(encoder.finish());
+
+    Input::CommandReader reader(path);
+    char command = 0;
+
+    ASSERT_TRUE(reader.nextCommand(command));
+    EXPECT_TRUE(reader.isBinary());
+    EXPECT_EQ(command, 'k');
+    EXPECT_EQ(reader.nextInt<int>(), -10);
+    ASSERT_TRUE(reader.nextCommand(command));
+    EXPECT_EQ(command, 'q');
+    EXPECT_EQ(reader.nextInt<int>(), 8);
+    EXPECT_EQ(reader.nextInt<int>(), 2147483647);
+    ASSERT_TRUE(reader.nextCommand(command));
+    EXPECT_EQ(reader.nextInt<int>(), -2147483648LL);
+    EXPECT_FALSE(reader.nextCommand(command));
+  }
+
+  // The header promises one more command than the stream holds.
+  BinaryFormat::Encoder encoder;
+  encoder.insert(1);
+  encoder.insert(2);
+  auto bytes = encoder.finish();
+  bytes.resize(bytes.size() - 5);
+  writeStream(bytes);
+
+  Input::CommandReader reader(path);
+  char command = 0;
+  ASSERT_TRUE(reader.nextCommand(command));
+  EXPECT_EQ(reader.nextInt<int>(), 1);
+  EXPECT_THROW(reader.nextCommand(command), Input::ParseError);
+
+  std::remove(path.c_str());
+}
+
+TEST(ResultWriter, TextAndBinary) {
+  std::string path = ::testing::TempDir() + "result_writer_test.out";
+  auto writeAll = [&path](Output::Format format) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ASSERT_GE(fd, 0);
+    {
+      Output::ResultWriter writer(format, fd);
+      writer.write(2);
+      writer.write(0);
+      writer.write(258);
+      writer.write(-1);
+    }
+    ::close(fd);
+  };
+  auto readAll = [&path]() {
+    std::ifstream in(path, std::ios::binary);
+    std::stringstream content;
+    content << in.rdbuf();
+    return content.str();
+  };
+
+  writeAll(Output::Format::text);
+  EXPECT_EQ(readAll(), "2 0 258 -1 ");
+
+  writeAll(Output::Format::binary);
+  std::string expected(24, '\0');
+  expected[0] = 2;
+  expected[16] = 2;
+  expected[17] = 1;
+  expected.append(8, '\xFF');
+  EXPECT_EQ(readAll(), expected);
+
+  std::remove(path.c_str());
+}
+
 //==============================================================================
 
 class TreeMoveTest : public ::testing::Test {
@@ -236,6 +1441,18 @@ TEST_F(TreeMoveTest, MoveConstructor) {
   EXPECT_TRUE(tree1.verifyTree());
 }
 
+TEST_F(TreeMoveTest, HandlesSurviveMove) {
+  // Хэндлы указывают на массив узлов, а не на объект дерева.
+  auto handle = *tree1.lowerBound(5);
+  RB_Tree::Tree<int> tree2(std::move(tree1));
+  EXPECT_EQ(handle->key, 5);
+
+  RB_Tree::Tree<int> tree3;
+  tree3 = std::move(tree2);
+  EXPECT_EQ(handle->key, 5);
+  EXPECT_EQ(tree3.lowerBound(5)->index(), handle.index());
+}
+
 TEST_F(TreeMoveTest, MoveAssignment) {
   RB_Tree::Tree<int> tree2;
   tree2.insert(20);
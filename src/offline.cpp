@@ -0,0 +1,82 @@
+#include "../include/command_reader.hpp"
+#include "../include/fenwick.hpp"
+#include "../include/result_writer.hpp"
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifdef TIME
+#include <chrono>
+#endif // TIME
+
+int main([[maybe_unused]] int argc, [[maybe_unused]] char **argv) {
+  using KeyTy = int;
+#ifdef BENCHMARK
+  [[maybe_unused]] volatile std::size_t benchmark_sink = 0;
+#endif
+
+  char command = 0;
+  KeyTy first = 0, second = 0;
+
+  std::vector<Offline::Command<KeyTy>> commands;
+
+#ifdef TIME
+  auto begin = std::chrono::steady_clock::now();
+#endif // TIME
+
+#ifndef BENCHMARK
+  Output::ResultWriter writer(Output::parseFormat(argc, argv));
+#endif
+
+  Input::CommandReader reader;
+
+  // The whole stream is read up front. A parse error ends it, but the
+  // commands read before it are still answered.
+  std::string parse_error;
+  try {
+    while (reader.nextCommand(command)) {
+      if (command == 'k') {
+        first = reader.nextInt<KeyTy>();
+        commands.push_back({command, first, 0});
+      } else if (command == 'q') {
+        first = reader.nextInt<KeyTy>();
+        second = reader.nextInt<KeyTy>();
+        commands.push_back({command, first, second});
+      } else {
+        reader.fail(std::string("unknown command '") + command + "'");
+      }
+    }
+  } catch (const Input::ParseError &e) {
+    parse_error = e.what();
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  for (std::size_t distance : Offline::answerQueries(commands)) {
+#ifdef BENCHMARK
+    benchmark_sink = distance;
+#else
+    writer.write(distance);
+#endif
+  }
+
+#ifndef BENCHMARK
+  writer.flush();
+#endif
+
+  if (!parse_error.empty()) {
+    std::cerr << parse_error << std::endl;
+    return 1;
+  }
+
+#ifdef TIME
+  auto end = std::chrono::steady_clock::now();
+  auto elapsed_ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(end - begin);
+  std::cout << "\n\nTime: " << static_cast<float>(elapsed_ms.count()) / 1000
+            << " s\n";
+#endif // TIME
+
+  return 0;
+}
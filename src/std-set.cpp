@@ -1,12 +1,15 @@
+#include "../include/command_reader.hpp"
+#include "../include/result_writer.hpp"
 #include <iostream>
 #include <iterator>
 #include <set>
+#include <string>
 
 #ifdef TIME
 #include <chrono>
 #endif // TIME
 
-int main() {
+int main([[maybe_unused]] int argc, [[maybe_unused]] char **argv) {
   volatile std::size_t benchmark_sink = 0;
 
   char command = 0;
@@ -18,49 +21,62 @@ int main() {
   auto begin = std::chrono::steady_clock::now();
 #endif // TIME
 
-  while (true) {
-    std::cin >> command;
-
-    switch (command) {
-    case 'k': {
-      std::cin >> first;
-      set_.insert(first);
+#ifndef BENCHMARK
+  Output::ResultWriter writer(Output::parseFormat(argc, argv));
+#endif
 
-      command = 0;
-      break;
-    }
+  Input::CommandReader reader;
 
-    case 'q': {
-      std::cin >> first >> second;
+  try {
+    while (reader.nextCommand(command)) {
+      switch (command) {
+      case 'k': {
+        first = reader.nextInt<int>();
+        set_.insert(first);
 
-      std::size_t distance = 0;
-      if (second > first) {
-        std::set<int>::iterator start = set_.lower_bound(first);
-        std::set<int>::iterator fin = set_.upper_bound(second);
-        distance = std::distance(start, fin);
+        break;
       }
 
+      case 'q': {
+        first = reader.nextInt<int>();
+        second = reader.nextInt<int>();
+
+        std::size_t distance = 0;
+        if (second > first) {
+          std::set<int>::iterator start = set_.lower_bound(first);
+          std::set<int>::iterator fin = set_.upper_bound(second);
+          distance = std::distance(start, fin);
+        }
+
 #ifdef BENCHMARK
-      benchmark_sink = distance;
+        benchmark_sink = distance;
 #else
-      std::cout << distance << " ";
+        writer.write(distance);
 #endif
 
-      command = 0;
-      break;
+        break;
+      }
+
+      default:
+        reader.fail(std::string("unknown command '") + command + "'");
+      }
     }
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+#ifndef BENCHMARK
+  writer.flush();
+#endif
 
-    default: {
 #ifdef TIME
-      auto end = std::chrono::steady_clock::now();
-      auto elapsed_ms =
-          std::chrono::duration_cast<std::chrono::milliseconds>(end - begin);
-      std::cout << std::format("\n\nTime: {} s\n",
-                               static_cast<float>(elapsed_ms.count()) / 1000);
+  auto end = std::chrono::steady_clock::now();
+  auto elapsed_ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(end - begin);
+  std::cout << "\n\nTime: " << static_cast<float>(elapsed_ms.count()) / 1000
+            << " s\n";
 #endif // TIME
 
-      return 0;
-    }
-    }
-  }
+  return 0;
 }
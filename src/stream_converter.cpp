@@ -0,0 +1,132 @@
+#include "../include/binary_format.hpp"
+#include "../include/command_reader.hpp"
+#include <cerrno>
+#include <charconv>
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// Converts a command stream between the text and the binary format. The input
+// may be in either format.
+namespace {
+constexpr std::string_view USAGE =
+    "usage: stream_converter to-binary [--delta] [--key-size 4|8] "
+    "[input [output]]\n"
+    "       stream_converter to-text [input [output]]\n"
+    "Reads stdin and writes stdout when no paths are given.\n";
+
+void writeAll(int fd, const char *data, std::size_t size) {
+  while (size > 0) {
+    ssize_t n = ::write(fd, data, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      throw std::runtime_error("Failed to write the output");
+    data += n;
+    size -= static_cast<std::size_t>(n);
+  }
+}
+
+std::vector<char> toBinary(Input::CommandReader &reader, std::size_t key_size,
+                           bool delta) {
+  BinaryFormat::Encoder encoder(key_size, delta);
+  char command = 0;
+
+  while (reader.nextCommand(command)) {
+    if (command == 'k') {
+      encoder.insert(reader.nextInt<std::int64_t>());
+    } else if (command == 'q') {
+      std::int64_t first = reader.nextInt<std::int64_t>();
+      std::int64_t second = reader.nextInt<std::int64_t>();
+      encoder.query(first, second);
+    } else {
+      reader.fail(std::string("unknown command '") + command + "'");
+    }
+  }
+
+  return encoder.finish();
+}
+
+std::vector<char> toText(Input::CommandReader &reader) {
+  std::vector<char> out;
+  char command = 0;
+
+  auto number = [&out](std::int64_t value) {
+    char buffer[24];
+    char *end = std::to_chars(buffer, buffer + sizeof(buffer), value).ptr;
+    out.insert(out.end(), buffer, end);
+    out.push_back(' ');
+  };
+
+  while (reader.nextCommand(command)) {
+    if (command != 'k' && command != 'q')
+      reader.fail(std::string("unknown command '") + command + "'");
+
+    out.push_back(command);
+    out.push_back(' ');
+    number(reader.nextInt<std::int64_t>());
+    if (command == 'q')
+      number(reader.nextInt<std::int64_t>());
+  }
+  out.push_back('\n');
+
+  return out;
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  try {
+    std::vector<std::string_view> args(argv + 1, argv + argc);
+    if (args.empty() || (args[0] != "to-binary" && args[0] != "to-text"))
+      throw std::invalid_argument("expected to-binary or to-text");
+    bool binary = args[0] == "to-binary";
+
+    bool delta = false;
+    std::size_t key_size = 4;
+    std::vector<std::string> paths;
+    for (std::size_t i = 1; i < args.size(); ++i) {
+      if (binary && args[i] == "--delta") {
+        delta = true;
+      } else if (binary && args[i] == "--key-size" && i + 1 < args.size()) {
+        key_size = args[++i] == "8" ? 8 : args[i] == "4" ? 4 : 0;
+      } else if (args[i].starts_with("--") || paths.size() == 2) {
+        throw std::invalid_argument("unexpected argument " +
+                                    std::string(args[i]));
+      } else {
+        paths.emplace_back(args[i]);
+      }
+    }
+
+    std::vector<char> out;
+    {
+      Input::CommandReader reader = paths.empty()
+                                        ? Input::CommandReader()
+                                        : Input::CommandReader(paths[0]);
+      out = binary ? toBinary(reader, key_size, delta) : toText(reader);
+    }
+
+    int fd = STDOUT_FILENO;
+    if (paths.size() == 2) {
+      fd = ::open(paths[1].c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0)
+        throw std::runtime_error("Failed to open file: " + paths[1]);
+    }
+    writeAll(fd, out.data(), out.size());
+    if (fd != STDOUT_FILENO && ::close(fd) != 0)
+      throw std::runtime_error("Failed to write " + paths[1]);
+  } catch (const std::invalid_argument &e) {
+    std::cerr << e.what() << "\n" << USAGE;
+    return 1;
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
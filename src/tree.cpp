@@ -1,76 +1,705 @@
+#include "../include/command_reader.hpp"
+#include "../include/frozen_index.hpp"
+#include "../include/latency_histogram.hpp"
+#include "../include/perf_counters.hpp"
+#include "../include/persistent_tree.hpp"
+#include "../include/result_writer.hpp"
+#include "../include/sharded_tree.hpp"
+#include "../include/thread_pool.hpp"
 #include "../include/tree.hpp"
+#include "../include/tree_batch.hpp"
+#include "../include/tree_image.hpp"
+#include <algorithm>
 #include <iostream>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
 
 #ifdef TIME
+#include <atomic>
 #include <chrono>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
 #endif // TIME
 
 #ifdef GPAPHVIZ_DUMP
 #include "../include/dump.hpp"
-#include <string>
 #endif // GPAPHVIZ_DUMP
 
-int main() {
+#ifdef TIME
+namespace {
+using BenchKeyTy = int;
+
+struct BenchStream final {
+  std::vector<BenchKeyTy> keys;
+  std::vector<std::pair<BenchKeyTy, BenchKeyTy>> queries;
+};
+
+struct BenchCommand final {
+  char type;
+  BenchKeyTy first, second;
+};
+
+// Reads the whole command stream.
+std::vector<BenchCommand> readBenchCommands() {
+  std::vector<BenchCommand> commands;
+  char command = 0;
+
+  Input::CommandReader reader;
+  while (reader.nextCommand(command)) {
+    if (command == 'k') {
+      commands.push_back({'k', reader.nextInt<BenchKeyTy>(), 0});
+    } else if (command == 'q') {
+      BenchKeyTy first = reader.nextInt<BenchKeyTy>();
+      BenchKeyTy second = reader.nextInt<BenchKeyTy>();
+      commands.push_back({'q', first, second});
+    } else {
+      reader.fail(std::string("unknown command '") + command + "'");
+    }
+  }
+
+  return commands;
+}
+
+// The keys of all 'k' commands and the bounds of all 'q' commands.
+BenchStream readBenchStream() {
+  BenchStream stream;
+  for (const auto &command : readBenchCommands()) {
+    if (command.type == 'k')
+      stream.keys.push_back(command.first);
+    else
+      stream.queries.emplace_back(command.first, command.second);
+  }
+
+  return stream;
+}
+
+float secondsSince(std::chrono::steady_clock::time_point begin) {
+  auto elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - begin);
+  return static_cast<float>(elapsed_us.count()) / 1000000;
+}
+
+// Times building a tree from all keys of the stream in one go against
+// inserting them one by one.
+int benchBulkBuild() {
+  auto keys = readBenchStream().keys;
+
+  auto begin = std::chrono::steady_clock::now();
+  RB_Tree::Tree<BenchKeyTy> inserted;
+  for (BenchKeyTy key : keys)
+    inserted.insert(key);
+  float insert_s = secondsSince(begin);
+
+  begin = std::chrono::steady_clock::now();
+  RB_Tree::Tree<BenchKeyTy> built(keys.begin(), keys.end());
+  float build_s = secondsSince(begin);
+
+  std::cout << "Keys: " << keys.size()
+            << ", distinct: " << built.get_nodes().size() << "\n";
+  std::cout << "Insert time: " << insert_s << " s\n";
+  std::cout << "Bulk build time: " << build_s << " s\n";
+
+  return inserted.get_nodes().size() == built.get_nodes().size() ? 0 : 1;
+}
+
+// Inserts all keys of the stream, then times answering all of its queries
+// on the live tree against a frozen snapshot of it.
+int benchFrozen() {
+  auto stream = readBenchStream();
+
+  RB_Tree::Tree<BenchKeyTy> tree;
+  for (BenchKeyTy key : stream.keys)
+    tree.insert(key);
+
+  auto begin = std::chrono::steady_clock::now();
+  std::size_t tree_sum = 0;
+  for (auto [first, second] : stream.queries)
+    tree_sum += tree.countRange(first, second);
+  float tree_s = secondsSince(begin);
+
+  begin = std::chrono::steady_clock::now();
+  auto frozen = tree.freeze();
+  float freeze_s = secondsSince(begin);
+
+  begin = std::chrono::steady_clock::now();
+  std::size_t frozen_sum = 0;
+  for (auto [first, second] : stream.queries)
+    frozen_sum += frozen.countRange(first, second);
+  float frozen_s = secondsSince(begin);
+
+  std::cout << "Keys: " << frozen.size()
+            << ", queries: " << stream.queries.size() << "\n";
+  std::cout << "Live tree queries time: " << tree_s << " s\n";
+  std::cout << "Freeze time: " << freeze_s << " s\n";
+  std::cout << "Frozen index queries time: " << frozen_s << " s\n";
+
+  return tree_sum == frozen_sum ? 0 : 1;
+}
+
+// One writer inserts all keys of the stream into a PersistentTree while a
+// growing number of readers answer all of its queries on snapshots, taking
+// a fresh one every SNAPSHOT_EVERY queries. Prints the reader throughput for
+// every thread count.
+int benchPersistentReaders() {
+  constexpr std::size_t SNAPSHOT_EVERY = 1024;
+  auto stream = readBenchStream();
+  unsigned max_readers = std::max(4u, std::thread::hardware_concurrency());
+
+  std::cout << "Keys: " << stream.keys.size()
+            << ", queries per reader: " << stream.queries.size() << "\n";
+
+  for (unsigned readers = 1; readers <= max_readers; readers *= 2) {
+    RB_Tree::PersistentTree<BenchKeyTy> tree;
+    std::atomic<std::size_t> sink = 0;
+
+    auto read = [&] {
+      std::size_t sum = 0;
+      auto snapshot = tree.snapshot();
+      for (std::size_t i = 0; i < stream.queries.size(); ++i) {
+        if (i % SNAPSHOT_EVERY == 0)
+          snapshot = tree.snapshot();
+        auto [first, second] = stream.queries[i];
+        sum += snapshot.countRange(first, second);
+      }
+      sink += sum;
+    };
+
+    auto begin = std::chrono::steady_clock::now();
+    std::thread writer([&] {
+      for (BenchKeyTy key : stream.keys)
+        tree.insert(key);
+    });
+    std::vector<std::thread> threads;
+    for (unsigned r = 0; r < readers; ++r)
+      threads.emplace_back(read);
+    for (auto &thread : threads)
+      thread.join();
+    float readers_s = secondsSince(begin);
+    writer.join();
+    float total_s = secondsSince(begin);
+
+    std::cout << "Readers: " << readers << ", queries/s: "
+              << static_cast<float>(readers * stream.queries.size()) /
+                     readers_s
+              << ", writer done in " << total_s << " s\n";
+  }
+
+  return 0;
+}
+
+// Inserts all keys of the stream, then answers all of its queries on the
+// live tree with 1, 2, 4, ... threads. The answers must not depend on the
+// thread count.
+int benchParallelQueries() {
+  auto stream = readBenchStream();
+  unsigned max_threads = std::max(4u, std::thread::hardware_concurrency());
+
+  RB_Tree::Tree<BenchKeyTy> tree;
+  for (BenchKeyTy key : stream.keys)
+    tree.insert(key);
+
+  std::cout << "Keys: " << tree.get_nodes().size()
+            << ", queries: " << stream.queries.size() << "\n";
+
+  std::vector<std::size_t> serial, answers(stream.queries.size());
+  float serial_s = 0;
+  for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+    Parallel::ThreadPool pool(threads);
+
+    auto begin = std::chrono::steady_clock::now();
+    pool.parallelFor(stream.queries.size(),
+                     [&](std::size_t from, std::size_t to) {
+                       for (std::size_t i = from; i < to; ++i) {
+                         auto [lo, hi] = stream.queries[i];
+                         answers[i] = tree.countRange(lo, hi);
+                       }
+                     });
+    float elapsed_s = secondsSince(begin);
+
+    if (threads == 1) {
+      serial = answers;
+      serial_s = elapsed_s;
+    } else if (answers != serial) {
+      std::cerr << "Answers differ with " << threads << " threads\n";
+      return 1;
+    }
+
+    std::cout << "Threads: " << threads << ", time: " << elapsed_s
+              << " s, speedup: " << serial_s / elapsed_s << "\n";
+  }
+
+  return 0;
+}
+
+// Inserts a batch of generated keys one by one and with insertBatch on 1, 2,
+// 4, ... threads, into an empty tree and into one that already holds as
+// many keys. All trees must end up with the same keys.
+int benchBatchInsert() {
+  constexpr std::size_t KEYS = 1000000;
+  unsigned max_threads = std::max(4u, std::thread::hardware_concurrency());
+
+  std::mt19937 rng(1);
+  std::uniform_int_distribution<BenchKeyTy> any_key;
+  std::vector<BenchKeyTy> existing(KEYS), batch(KEYS);
+  for (auto &key : existing)
+    key = any_key(rng);
+  for (auto &key : batch)
+    key = any_key(rng);
+
+  for (bool prefilled : {false, true}) {
+    auto makeTree = [&] {
+      return prefilled ? RB_Tree::Tree<BenchKeyTy>(existing.begin(),
+                                                   existing.end())
+                       : RB_Tree::Tree<BenchKeyTy>();
+    };
+    std::cout << (prefilled ? "Into a tree of " : "Into an empty tree, ")
+              << (prefilled ? std::to_string(KEYS) + " keys, " : "")
+              << "batch: " << KEYS << " keys\n";
+
+    auto tree = makeTree();
+    auto begin = std::chrono::steady_clock::now();
+    for (BenchKeyTy key : batch)
+      tree.insert(key);
+    float insert_s = secondsSince(begin);
+    std::cout << "  Per-key insert time: " << insert_s << " s\n";
+
+    for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+      Parallel::ThreadPool pool(threads);
+      auto batched = makeTree();
+
+      begin = std::chrono::steady_clock::now();
+      batched.insertBatch(batch, pool);
+      float batch_s = secondsSince(begin);
+
+      if (!std::equal(batched.begin(), batched.end(), tree.begin(),
+                      tree.end())) {
+        std::cerr << "Trees differ with " << threads << " threads\n";
+        return 1;
+      }
+      std::cout << "  Threads: " << threads << ", insertBatch time: " << batch_s
+                << " s, speedup over insert: " << insert_s / batch_s << "\n";
+    }
+  }
+
+  return 0;
+}
+
+// Inserts generated keys into a ShardedTree with 1, 2, 4, 8 shards, then
+// answers generated range queries. The shards start evenly spread over the
+// key range; in the skewed workload 90% of the keys fall into its first
+// percent, which only sampling-based rebalancing spreads out again.
+int benchSharded() {
+  constexpr std::size_t KEYS = 1000000, QUERIES = 200000;
+  constexpr BenchKeyTy KEY_RANGE = 1000000000;
+
+  for (bool skewed : {false, true}) {
+    std::mt19937 rng(1);
+    std::uniform_int_distribution<BenchKeyTy> any_key(0, KEY_RANGE - 1);
+    std::uniform_int_distribution<BenchKeyTy> hot_key(0, KEY_RANGE / 100);
+    std::bernoulli_distribution is_hot(0.9);
+
+    std::vector<BenchKeyTy> keys(KEYS);
+    for (auto &key : keys)
+      key = skewed && is_hot(rng) ? hot_key(rng) : any_key(rng);
+    std::vector<std::pair<BenchKeyTy, BenchKeyTy>> queries(QUERIES);
+    for (auto &[lo, hi] : queries) {
+      lo = skewed ? hot_key(rng) : any_key(rng);
+      hi = lo + (skewed ? hot_key(rng) : any_key(rng)) / 10;
+    }
+
+    std::cout << (skewed ? "Skewed" : "Uniform") << " keys: " << KEYS
+              << ", queries: " << QUERIES << "\n";
+
+    std::size_t expected = 0;
+    for (std::size_t shards = 1; shards <= 8; shards *= 2) {
+      std::vector<BenchKeyTy> bounds;
+      for (std::size_t i = 1; i < shards; ++i)
+        bounds.push_back(static_cast<BenchKeyTy>(KEY_RANGE / shards * i));
+      RB_Tree::ShardedTree<BenchKeyTy> tree(bounds);
+
+      auto begin = std::chrono::steady_clock::now();
+      for (BenchKeyTy key : keys)
+        tree.insert(key);
+      tree.sync();
+      float insert_s = secondsSince(begin);
+
+      begin = std::chrono::steady_clock::now();
+      std::size_t sum = 0;
+      for (auto [lo, hi] : queries)
+        sum += tree.countRange(lo, hi);
+      float query_s = secondsSince(begin);
+
+      if (shards == 1)
+        expected = sum;
+      else if (sum != expected)
+        return 1;
+
+      std::cout << "  Shards: " << shards
+                << ", inserts/s: " << static_cast<float>(KEYS) / insert_s
+                << ", queries/s: " << static_cast<float>(QUERIES) / query_s
+                << ", rebalances: " << tree.rebalances() << "\n";
+    }
+  }
+
+  return 0;
+}
+
+// Sliding window over generated keys: every round inserts WINDOW new keys
+// and erases the WINDOW oldest ones. Erased nodes are recycled, so after the
+// first round the arena stays the same size.
+int benchChurn() {
+  constexpr std::size_t WINDOW = 1 << 18, ROUNDS = 10;
+  constexpr BenchKeyTy KEY_RANGE = 1000000000;
+
+  std::mt19937 rng(1);
+  std::uniform_int_distribution<BenchKeyTy> any_key(0, KEY_RANGE - 1);
+  std::vector<BenchKeyTy> window(WINDOW);
+  RB_Tree::MultiTree<BenchKeyTy> tree;
+  for (auto &key : window) {
+    key = any_key(rng);
+    tree.insert(key);
+  }
+  std::size_t arena = tree.get_nodes().capacity();
+
+  std::cout << "Window: " << WINDOW << " keys\n";
+  for (std::size_t round = 1; round <= ROUNDS; ++round) {
+    auto begin = std::chrono::steady_clock::now();
+    for (auto &key : window) {
+      tree.eraseOne(key);
+      key = any_key(rng);
+      tree.insert(key);
+    }
+    float round_s = secondsSince(begin);
+
+    const auto &nodes = tree.get_nodes();
+    std::cout << "  Round " << round << ": "
+              << static_cast<float>(2 * WINDOW) / round_s << " ops/s, keys: "
+              << tree.size() << ", arena nodes: " << nodes.size()
+              << ", arena bytes: "
+              << nodes.capacity() * sizeof(nodes.front()) << "\n";
+    if (nodes.capacity() != arena || tree.size() != WINDOW)
+      return 1;
+  }
+
+  return 0;
+}
+
+// Inserts all keys of the stream, then answers all of its queries, and
+// reports time and hardware counters per operation of each phase.
+int benchPerfCounters() {
+  auto stream = readBenchStream();
+  Perf::Counters counters;
+  if (!counters.error().empty())
+    std::cout << "Perf counters unavailable: " << counters.error() << "\n";
+
+  RB_Tree::Tree<BenchKeyTy> tree;
+  auto begin = std::chrono::steady_clock::now();
+  counters.start();
+  for (BenchKeyTy key : stream.keys)
+    tree.insert(key);
+  counters.stop();
+  float insert_s = secondsSince(begin);
+
+  std::cout << "insert ops: " << stream.keys.size() << "\n";
+  if (!stream.keys.empty())
+    std::cout << "insert ns/op: " << insert_s * 1e9f / stream.keys.size()
+              << "\n";
+  counters.report(std::cout, "insert", stream.keys.size());
+
+  begin = std::chrono::steady_clock::now();
+  counters.start();
+  std::size_t sum = 0;
+  for (auto [first, second] : stream.queries)
+    if (second > first)
+      sum += tree.countRange(first, second);
+  counters.stop();
+  float query_s = secondsSince(begin);
+
+  std::cout << "query ops: " << stream.queries.size() << "\n";
+  if (!stream.queries.empty())
+    std::cout << "query ns/op: " << query_s * 1e9f / stream.queries.size()
+              << "\n";
+  counters.report(std::cout, "query", stream.queries.size());
+
+  volatile std::size_t sink = sum;
+  (void)sink;
+  return 0;
+}
+
+// Replays the stream on a tree, timing every command, and prints latency
+// percentiles of inserts and queries. With a path, the histograms are also
+// written there as CSV.
+int benchLatency(const char *csv_path) {
+  auto commands = readBenchCommands();
+  Perf::TickClock clock;
+  Perf::LatencyHistogram inserts, queries;
+
+  RB_Tree::Tree<BenchKeyTy> tree;
+  std::size_t sum = 0;
+  for (const auto &command : commands) {
+    std::uint64_t begin = Perf::TickClock::now();
+    if (command.type == 'k') {
+      tree.insert(command.first);
+      inserts.record(Perf::TickClock::now() - begin);
+    } else {
+      if (command.second > command.first)
+        sum += tree.countRange(command.first, command.second);
+      queries.record(Perf::TickClock::now() - begin);
+    }
+  }
+  clock.calibrate();
+
+  const double scale = clock.nsPerTick();
+  for (auto [name, histogram] : {std::pair{"k", &inserts}, {"q", &queries}}) {
+    std::cout << name << ": " << histogram->count() << " ops, ns";
+    for (double percent : {50.0, 90.0, 99.0, 99.9})
+      std::cout << " p" << percent << ": "
+                << static_cast<double>(histogram->percentile(percent)) * scale;
+    std::cout << " max: " << static_cast<double>(histogram->max()) * scale
+              << "\n";
+  }
+
+  if (csv_path) {
+    std::ofstream csv(csv_path);
+    if (!csv.is_open())
+      throw std::runtime_error(std::string("Failed to open file: ") +
+                               csv_path);
+    csv << "command,low_ns,high_ns,count\n";
+    inserts.dumpCsv(csv, "k", scale);
+    queries.dumpCsv(csv, "q", scale);
+  }
+
+  volatile std::size_t sink = sum;
+  (void)sink;
+  return 0;
+}
+
+// Cold start of a tree holding all keys of the stream: replaying its inserts
+// against loading an image saved to `path`, with and without verifyTree.
+int benchImage(const char *path) {
+  auto keys = readBenchStream().keys;
+
+  auto begin = std::chrono::steady_clock::now();
+  RB_Tree::Tree<BenchKeyTy> replayed;
+  for (BenchKeyTy key : keys)
+    replayed.insert(key);
+  float replay_s = secondsSince(begin);
+
+  begin = std::chrono::steady_clock::now();
+  replayed.save(path);
+  float save_s = secondsSince(begin);
+
+  begin = std::chrono::steady_clock::now();
+  auto loaded = RB_Tree::Tree<BenchKeyTy>::load(path);
+  float load_s = secondsSince(begin);
+
+  begin = std::chrono::steady_clock::now();
+  auto verified = RB_Tree::Tree<BenchKeyTy>::load(path, true);
+  float verified_s = secondsSince(begin);
+
+  std::cout << "Keys: " << keys.size()
+            << ", distinct: " << loaded.get_nodes().size() << "\n";
+  std::cout << "Replay time: " << replay_s << " s\n";
+  std::cout << "Save time: " << save_s << " s\n";
+  std::cout << "Load time: " << load_s << " s\n";
+  std::cout << "Load with verifyTree time: " << verified_s << " s\n";
+
+  return loaded.get_nodes().size() == replayed.get_nodes().size() &&
+                 verified.get_nodes().size() == replayed.get_nodes().size()
+             ? 0
+             : 1;
+}
+
+template <typename Mode> int runBenchMode(Mode mode) {
+  try {
+    return mode();
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+}
+} // namespace
+#endif // TIME
+
+int main([[maybe_unused]] int argc, [[maybe_unused]] char **argv) {
+#ifdef TIME
+  if (argc > 1 && std::string_view(argv[1]) == "--bulk-build")
+    return runBenchMode(benchBulkBuild);
+  if (argc > 1 && std::string_view(argv[1]) == "--frozen")
+    return runBenchMode(benchFrozen);
+  if (argc > 1 && std::string_view(argv[1]) == "--persistent-readers")
+    return runBenchMode(benchPersistentReaders);
+  if (argc > 1 && std::string_view(argv[1]) == "--parallel-queries")
+    return runBenchMode(benchParallelQueries);
+  if (argc > 1 && std::string_view(argv[1]) == "--batch-insert")
+    return runBenchMode(benchBatchInsert);
+  if (argc > 1 && std::string_view(argv[1]) == "--sharded")
+    return runBenchMode(benchSharded);
+  if (argc > 1 && std::string_view(argv[1]) == "--churn")
+    return runBenchMode(benchChurn);
+  if (argc > 1 && std::string_view(argv[1]) == "--perf-counters")
+    return runBenchMode(benchPerfCounters);
+  if (argc > 1 && std::string_view(argv[1]) == "--latency")
+    return runBenchMode(
+        [&] { return benchLatency(argc > 2 ? argv[2] : nullptr); });
+  if (argc > 1 && std::string_view(argv[1]) == "--image")
+    return runBenchMode(
+        [&] { return benchImage(argc > 2 ? argv[2] : "tree.img"); });
+#endif // TIME
+
   using KeyTy = int;
   volatile std::size_t benchmark_sink = 0;
 
   char command = 0;
-  int first = 0, second = 0;
+  KeyTy first = 0, second = 0;
 
   RB_Tree::Tree<KeyTy> tree;
 
+  // Once the stream settles into queries only, they are answered by a frozen
+  // snapshot of the tree, which is dropped again by the next insert.
+  constexpr std::size_t MIN_QUERIES_TO_FREEZE = 1024;
+  std::optional<RB_Tree::FrozenIndex<KeyTy>> frozen;
+  std::size_t queries_since_insert = 0;
+
+  // Nothing changes the tree between two inserts, so consecutive queries are
+  // collected and answered in parallel. Short runs are not worth waking the
+  // pool.
+  constexpr std::size_t MAX_BATCH = 1 << 16;
+  constexpr std::size_t MIN_PARALLEL_BATCH = 256;
+  std::vector<std::pair<KeyTy, KeyTy>> batch;
+  std::vector<std::size_t> answers;
+
 #ifdef TIME
   auto begin = std::chrono::steady_clock::now();
 #endif // TIME
 
-  while (true) {
-    std::cin >> command;
+#ifndef BENCHMARK
+  Output::ResultWriter writer(Output::parseFormat(argc, argv));
+#endif
+
+  Input::CommandReader reader;
+
+  try {
+    Parallel::ThreadPool pool(Parallel::parseThreads(argc, argv));
+
+    auto answerBatch = [&] {
+      // A run of queries as long as the tree pays for freezing it.
+      queries_since_insert += batch.size();
+      if (!frozen &&
+          queries_since_insert >=
+              std::max(tree.get_nodes().size(), MIN_QUERIES_TO_FREEZE))
+        frozen = tree.freeze();
+
+      answers.resize(batch.size());
+      auto answer = [&](std::size_t from, std::size_t to) {
+        for (std::size_t i = from; i < to; ++i) {
+          auto [lo, hi] = batch[i];
+          answers[i] = 0;
+          if (hi > lo)
+            answers[i] =
+                frozen ? frozen->countRange(lo, hi) : tree.countRange(lo, hi);
+        }
+      };
+
+      if (batch.size() >= MIN_PARALLEL_BATCH)
+        pool.parallelFor(batch.size(), answer);
+      else
+        answer(0, batch.size());
+
+      for (std::size_t distance : answers) {
+#ifdef BENCHMARK
+        benchmark_sink = distance;
+#else
+        writer.write(distance);
+#endif
+      }
+
+      batch.clear();
+    };
 
-    switch (command) {
-    case 'k': {
-      std::cin >> first;
-      tree.insert(first);
+    // The queries read before a malformed command are answered before the
+    // error is reported, as they would be without batching.
+    try {
+      while (reader.nextCommand(command)) {
+        switch (command) {
+        case 'k': {
+          first = reader.nextInt<KeyTy>();
+          if (!batch.empty())
+            answerBatch();
+          tree.insert(first);
+
+          frozen.reset();
+          queries_since_insert = 0;
 
 #ifdef GPAPHVIZ_DUMP
-      static int dot_num = 1;
-      std::string filename = "./graphviz_output/after_insert_" +
-                             std::to_string(dot_num++) + ".dot";
-      makeGraph(filename, tree);
+          static int dot_num = 1;
+          std::string filename = "./graphviz_output/after_insert_" +
+                                 std::to_string(dot_num++) + ".dot";
+          makeGraph(filename, tree);
 #endif // GPAPHVIZ_DUMP
 
-      command = 0;
-      break;
-    }
-    case 'q': {
-      std::cin >> first >> second;
-
-      std::size_t distance = 0;
-      if (second > first) {
-        auto start = tree.lowerBound(first);
-        auto fin = tree.upperBound(second);
-        distance = tree.distance(start, fin);
-      }
+          break;
+        }
+        case 'q': {
+          first = reader.nextInt<KeyTy>();
+          second = reader.nextInt<KeyTy>();
+
+          batch.emplace_back(first, second);
+          if (batch.size() == MAX_BATCH)
+            answerBatch();
+
+          break;
+        }
+        case 's': {
+          // The k-th smallest key, k counted from 1.
+          auto k = reader.nextInt<std::size_t>();
+          if (!batch.empty())
+            answerBatch();
 
+          auto node = tree.select(k - 1);
+          if (k == 0 || !node)
+            reader.fail("no key of rank " + std::to_string(k));
 #ifdef BENCHMARK
-      benchmark_sink = distance;
+          benchmark_sink = static_cast<std::size_t>((*node)->key);
 #else
-      std::cout << distance << " ";
+          writer.write((*node)->key);
 #endif
 
-      command = 0;
-      break;
+          break;
+        }
+        default:
+          reader.fail(std::string("unknown command '") + command + "'");
+        }
+      }
+    } catch (const Input::ParseError &) {
+      if (!batch.empty())
+        answerBatch();
+      throw;
     }
-    default: {
+
+    if (!batch.empty())
+      answerBatch();
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+#ifndef BENCHMARK
+  writer.flush();
+#endif
+
 #ifdef TIME
-      auto end = std::chrono::steady_clock::now();
-      auto elapsed_ms =
-          std::chrono::duration_cast<std::chrono::milliseconds>(end - begin);
-      std::cout << std::format("\n\nTime: {} s\n",
-                               static_cast<float>(elapsed_ms.count()) / 1000);
+  auto end = std::chrono::steady_clock::now();
+  auto elapsed_ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(end - begin);
+  std::cout << "\n\nTime: " << static_cast<float>(elapsed_ms.count()) / 1000
+            << " s\n";
 #endif // TIME
 
-      return 0;
-    }
-    }
-  }
+  return 0;
 }
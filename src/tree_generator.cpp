@@ -1,48 +1,341 @@
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
 #include <fstream>
 #include <iostream>
+#include <numeric>
 #include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
 
-// 1000
-// 10000
-// 25000
-// 50000
-// 100000
-// 250000
-// 500000
-// 1000000
-
-int main() {
-  srand(time(nullptr));
-
-  int N = 0;
-  std::cin >> N;
-
-  std::mt19937 rng(std::random_device{}());
-
-  std::ofstream out;
-  out.open("name.dat");
-  if (out.is_open()) {
-    for (int i = 0; i < N; ++i) {
-      if (rand() % 2) {
-        out << "k ";
-        out << rand() % 1000000 << " ";
-      } else {
-        int first = rand() % 1000000;
-        int second = rand() % 1000000;
-
-        while (first > second) {
-          first = rand() % 1000000;
-          second = rand() % 1000000;
-        }
-
-        out << "q ";
-        out << first << " " << second << " ";
-      }
-    }
-  } else {
-    std::cout << "File didn't wroten\n";
-  }
-
-  out << std::endl;
-  out.close();
+// Reproducible generator of "k <key>" / "q <first> <second>" streams: the
+// same options and seed always give the same bytes.
+namespace {
+constexpr std::string_view USAGE =
+    "usage: tree_generator [options]\n"
+    "  --count N          number of commands (default 1000)\n"
+    "  --seed S           random seed (default 1)\n"
+    "  --universe U       keys are in [0, U) (default 1000000)\n"
+    "  --ratio I:Q        inserts to queries (default 1:1)\n"
+    "  --keys DIST        uniform | zipf | sequential | clustered | window\n"
+    "  --zipf-exponent X  skew of zipf keys (default 1.1)\n"
+    "  --clusters C       number of clustered key centers (default 16)\n"
+    "  --window W         width of the sliding key window (default U / 100)\n"
+    "  --width DIST       query widths: uniform | fixed | exponential\n"
+    "  --max-width W      largest (uniform), exact (fixed) or mean\n"
+    "                     (exponential) query width (default U / 100)\n"
+    "  --output PATH      write to PATH instead of stdout\n";
+
+enum class KeyDistribution { uniform, zipf, sequential, clustered, window };
+enum class WidthDistribution { uniform, fixed, exponential };
+
+struct Options final {
+  std::uint64_t count = 1000;
+  std::uint64_t seed = 1;
+  std::int64_t universe = 1000000;
+  std::uint64_t insert_weight = 1, query_weight = 1;
+  KeyDistribution keys = KeyDistribution::uniform;
+  double zipf_exponent = 1.1;
+  std::int64_t clusters = 16;
+  std::int64_t window = 0; // 0 means universe / 100
+  WidthDistribution width = WidthDistribution::uniform;
+  std::int64_t max_width = 0; // 0 means universe / 100
+  std::string output;
+};
+
+template <typename NumTy> NumTy parseNumber(std::string_view text) {
+  NumTy value{};
+  auto [ptr, ec] =
+      std::from_chars(text.data(), text.data() + text.size(), value);
+  if (ec != std::errc() || ptr != text.data() + text.size())
+    throw std::invalid_argument("bad number '" + std::string(text) + "'");
+  return value;
+}
+
+Options parseOptions(int argc, char **argv) {
+  Options options;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string_view name = argv[i];
+    if (i + 1 == argc)
+      throw std::invalid_argument("missing value of " + std::string(name));
+    std::string_view value = argv[++i];
+
+    if (name == "--count") {
+      options.count = parseNumber<std::uint64_t>(value);
+    } else if (name == "--seed") {
+      options.seed = parseNumber<std::uint64_t>(value);
+    } else if (name == "--universe") {
+      options.universe = parseNumber<std::int64_t>(value);
+    } else if (name == "--ratio") {
+      auto colon = value.find(':');
+      if (colon == std::string_view::npos)
+        throw std::invalid_argument("--ratio expects I:Q");
+      options.insert_weight =
+          parseNumber<std::uint64_t>(value.substr(0, colon));
+      options.query_weight =
+          parseNumber<std::uint64_t>(value.substr(colon + 1));
+    } else if (name == "--keys") {
+      if (value == "uniform")
+        options.keys = KeyDistribution::uniform;
+      else if (value == "zipf")
+        options.keys = KeyDistribution::zipf;
+      else if (value == "sequential")
+        options.keys = KeyDistribution::sequential;
+      else if (value == "clustered")
+        options.keys = KeyDistribution::clustered;
+      else if (value == "window")
+        options.keys = KeyDistribution::window;
+      else
+        throw std::invalid_argument("unknown key distribution '" +
+                                    std::string(value) + "'");
+    } else if (name == "--zipf-exponent") {
+      options.zipf_exponent = std::stod(std::string(value));
+    } else if (name == "--clusters") {
+      options.clusters = parseNumber<std::int64_t>(value);
+    } else if (name == "--window") {
+      options.window = parseNumber<std::int64_t>(value);
+    } else if (name == "--width") {
+      if (value == "uniform")
+        options.width = WidthDistribution::uniform;
+      else if (value == "fixed")
+        options.width = WidthDistribution::fixed;
+      else if (value == "exponential")
+        options.width = WidthDistribution::exponential;
+      else
+        throw std::invalid_argument("unknown width distribution '" +
+                                    std::string(value) + "'");
+    } else if (name == "--max-width") {
+      options.max_width = parseNumber<std::int64_t>(value);
+    } else if (name == "--output") {
+      options.output = value;
+    } else {
+      throw std::invalid_argument("unknown option " + std::string(name));
+    }
+  }
+
+  if (options.universe <= 0 || options.universe > (std::int64_t{1} << 31))
+    throw std::invalid_argument("--universe must be in [1, 2^31]");
+  if (options.insert_weight + options.query_weight == 0)
+    throw std::invalid_argument("--ratio must not be 0:0");
+  if (options.clusters <= 0 || options.window < 0 || options.max_width < 0 ||
+      options.zipf_exponent <= 0)
+    throw std::invalid_argument("cluster, window, width and exponent options "
+                                "must be positive");
+
+  if (options.window == 0)
+    options.window = std::max<std::int64_t>(1, options.universe / 100);
+  if (options.max_width == 0)
+    options.max_width = std::max<std::int64_t>(1, options.universe / 100);
+
+  return options;
+}
+
+// The standard distributions are implementation-defined, so streams would
+// differ between standard libraries; these are spelled out on top of the
+// fully specified mt19937_64.
+class Random final {
+  std::mt19937_64 engine_;
+
+public:
+  explicit Random(std::uint64_t seed) : engine_(seed) {}
+
+  // Uniform in [0, 1).
+  double unit() { return static_cast<double>(engine_() >> 11) * 0x1p-53; }
+
+  // Uniform in [0, n), without modulo bias.
+  std::uint64_t below(std::uint64_t n) {
+    const std::uint64_t limit = -n % n; // 2^64 mod n
+    while (true) {
+      std::uint64_t x = engine_();
+      if (x >= limit)
+        return x % n;
+    }
+  }
+
+  std::int64_t between(std::int64_t lo, std::int64_t hi) {
+    return lo + static_cast<std::int64_t>(
+                    below(static_cast<std::uint64_t>(hi - lo) + 1));
+  }
+
+  bool chance(double p) { return unit() < p; }
+
+  double exponential(double mean) { return -mean * std::log1p(-unit()); }
+
+  // Standard normal, Box-Muller.
+  double normal() {
+    return std::sqrt(-2 * std::log1p(-unit())) *
+           std::cos(2 * 3.14159265358979323846 * unit());
+  }
+};
+
+// Zipf distribution over 1..n, P(k) ~ k^-exponent, by rejection-inversion
+// (Hormann, Derflinger): constant time per sample for any n.
+class ZipfDistribution final {
+  double exponent_, h_integral_x1_, h_integral_n_, s_;
+  std::int64_t n_;
+
+public:
+  ZipfDistribution(std::int64_t n, double exponent)
+      : exponent_(exponent), n_(n) {
+    h_integral_x1_ = hIntegral(1.5) - 1;
+    h_integral_n_ = hIntegral(static_cast<double>(n) + 0.5);
+    s_ = 2 - hIntegralInverse(hIntegral(2.5) - h(2));
+  }
+
+  std::int64_t operator()(Random &random) {
+    while (true) {
+      double u =
+          h_integral_n_ + random.unit() * (h_integral_x1_ - h_integral_n_);
+      double x = hIntegralInverse(u);
+      auto k = std::clamp<std::int64_t>(std::llround(x), 1, n_);
+      if (static_cast<double>(k) - x <= s_ ||
+          u >= hIntegral(static_cast<double>(k) + 0.5) -
+                   h(static_cast<double>(k)))
+        return k;
+    }
+  }
+
+private:
+  double h(double x) const { return std::exp(-exponent_ * std::log(x)); }
+
+  double hIntegral(double x) const {
+    double log_x = std::log(x);
+    return expm1OverX((1 - exponent_) * log_x) * log_x;
+  }
+
+  double hIntegralInverse(double x) const {
+    double t = std::max(x * (1 - exponent_), -1.0);
+    return std::exp(log1pOverX(t) * x);
+  }
+
+  static double expm1OverX(double x) {
+    return std::abs(x) > 1e-8 ? std::expm1(x) / x : 1 + x / 2;
+  }
+
+  static double log1pOverX(double x) {
+    return std::abs(x) > 1e-8 ? std::log1p(x) / x : 1 - x / 2;
+  }
+};
+
+class KeySource final {
+  const Options &options_;
+  Random &random_;
+  ZipfDistribution zipf_;
+  std::int64_t zipf_stride_ = 1;
+  std::vector<std::int64_t> centers_;
+  std::int64_t next_sequential_ = 0;
+
+public:
+  KeySource(const Options &options, Random &random)
+      : options_(options), random_(random),
+        zipf_(options.universe, options.zipf_exponent) {
+    // Zipf ranks are scattered over the universe by a stride coprime with
+    // it, so the hot keys are not all next to 0.
+    zipf_stride_ = 2654435761 % options.universe;
+    while (std::gcd(zipf_stride_, options.universe) != 1)
+      ++zipf_stride_;
+
+    for (std::int64_t i = 0; i < options.clusters; ++i)
+      centers_.push_back(random_.between(0, options.universe - 1));
+  }
+
+  // Key for the `step`-th of `steps` commands.
+  std::int64_t next(std::uint64_t step, std::uint64_t steps) {
+    const std::int64_t universe = options_.universe;
+
+    switch (options_.keys) {
+    case KeyDistribution::uniform:
+      return random_.between(0, universe - 1);
+    case KeyDistribution::zipf:
+      return ((zipf_(random_) - 1) * zipf_stride_) % universe;
+    case KeyDistribution::sequential:
+      return next_sequential_++ % universe;
+    case KeyDistribution::clustered: {
+      double center = static_cast<double>(centers_[random_.below(
+          centers_.size())]);
+      double spread = static_cast<double>(universe) /
+                      static_cast<double>(20 * centers_.size());
+      auto key = std::llround(center + spread * random_.normal());
+      return std::clamp<std::int64_t>(key, 0, universe - 1);
+    }
+    case KeyDistribution::window: {
+      std::int64_t window = std::min(options_.window, universe);
+      auto start = static_cast<std::int64_t>(
+          static_cast<double>(universe - window) * static_cast<double>(step) /
+          static_cast<double>(std::max<std::uint64_t>(steps, 1)));
+      return random_.between(start, start + window - 1);
+    }
+    }
+
+    return 0;
+  }
+};
+
+std::int64_t nextWidth(const Options &options, Random &random) {
+  switch (options.width) {
+  case WidthDistribution::uniform:
+    return random.between(0, options.max_width);
+  case WidthDistribution::fixed:
+    return options.max_width;
+  case WidthDistribution::exponential:
+    return std::llround(
+        random.exponential(static_cast<double>(options.max_width)));
+  }
+
+  return 0;
+}
+
+void generate(const Options &options, std::ostream &out) {
+  Random random(options.seed);
+  KeySource keys(options, random);
+  const double insert_share =
+      static_cast<double>(options.insert_weight) /
+      static_cast<double>(options.insert_weight + options.query_weight);
+
+  for (std::uint64_t i = 0; i < options.count; ++i) {
+    std::int64_t key = keys.next(i, options.count);
+    if (random.chance(insert_share)) {
+      out << "k " << key << ' ';
+    } else {
+      std::int64_t second =
+          std::min(key + nextWidth(options, random), options.universe - 1);
+      out << "q " << key << ' ' << second << ' ';
+    }
+  }
+  out << '\n';
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  try {
+    Options options = parseOptions(argc, argv);
+
+    if (options.output.empty()) {
+      std::ios::sync_with_stdio(false);
+      generate(options, std::cout);
+      std::cout.flush();
+      if (!std::cout)
+        throw std::runtime_error("Failed to write the output");
+    } else {
+      std::ofstream out(options.output);
+      if (!out.is_open())
+        throw std::runtime_error("Failed to open file: " + options.output);
+      generate(options, out);
+      out.flush();
+      if (!out)
+        throw std::runtime_error("Failed to write " + options.output);
+    }
+  } catch (const std::invalid_argument &e) {
+    std::cerr << e.what() << "\n" << USAGE;
+    return 1;
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
 }
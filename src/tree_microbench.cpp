@@ -0,0 +1,286 @@
+#include "../include/tree.hpp"
+#include <algorithm>
+#include <benchmark/benchmark.h>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <optional>
+#include <random>
+#include <set>
+#include <utility>
+#include <vector>
+
+// Every benchmark takes two arguments: the number of keys and their
+// distribution. Query benchmarks build their container once per argument pair
+// and cycle through a fixed set of probe keys drawn from the same range.
+namespace {
+using KeyTy = int;
+
+enum Distribution : std::int64_t { uniform, sequential, clustered };
+
+constexpr std::size_t PROBES = 1 << 12;
+// Keys are spread over four times their number of values, so ranges of the
+// distance and query benchmarks hold about 100 keys.
+constexpr KeyTy RANGE_WIDTH = 400;
+
+struct Workload final {
+  std::vector<KeyTy> keys;
+  std::vector<KeyTy> probes;
+};
+
+// Keys in [0, 4n): uniform, every fourth value, or packed around 16 centers.
+Workload makeWorkload(std::size_t n, Distribution distribution) {
+  const auto universe = static_cast<KeyTy>(4 * n);
+  std::mt19937 rng(static_cast<unsigned>(n + distribution));
+  std::uniform_int_distribution<KeyTy> any_key(0, universe - 1);
+
+  Workload workload;
+  workload.keys.reserve(n);
+  if (distribution == sequential) {
+    for (std::size_t i = 0; i < n; ++i)
+      workload.keys.push_back(static_cast<KeyTy>(4 * i));
+  } else if (distribution == clustered) {
+    std::normal_distribution<double> offset(0, static_cast<double>(n) / 64);
+    for (std::size_t i = 0; i < n; ++i) {
+      double center = static_cast<double>(universe) * (2 * (i % 16) + 1) / 32;
+      auto key = std::lround(center + offset(rng));
+      workload.keys.push_back(static_cast<KeyTy>(
+          std::clamp<long>(key, 0, static_cast<long>(universe) - 1)));
+    }
+  } else {
+    for (std::size_t i = 0; i < n; ++i)
+      workload.keys.push_back(any_key(rng));
+  }
+
+  // Probes follow the keys, so clustered lookups mostly hit the clusters.
+  std::uniform_int_distribution<std::size_t> any_index(0, n - 1);
+  for (std::size_t i = 0; i < PROBES; ++i)
+    workload.probes.push_back(workload.keys[any_index(rng)] + any_key(rng) % 4);
+
+  return workload;
+}
+
+std::size_t sizeArg(const benchmark::State &state) {
+  return static_cast<std::size_t>(state.range(0));
+}
+
+Distribution distributionArg(const benchmark::State &state) {
+  return static_cast<Distribution>(state.range(1));
+}
+
+// The last built container and its workload, shared by consecutive runs with
+// the same arguments.
+template <typename ContainerTy> struct Fixture final {
+  std::size_t n = 0;
+  Distribution distribution = uniform;
+  Workload workload;
+  ContainerTy container;
+
+  static Fixture &get(const benchmark::State &state) {
+    static Fixture fixture;
+    if (fixture.n != sizeArg(state) ||
+        fixture.distribution != distributionArg(state)) {
+      fixture.n = sizeArg(state);
+      fixture.distribution = distributionArg(state);
+      fixture.workload = makeWorkload(fixture.n, fixture.distribution);
+      fixture.container = ContainerTy(fixture.workload.keys.begin(),
+                                      fixture.workload.keys.end());
+    }
+    return fixture;
+  }
+};
+
+using TreeFixture = Fixture<RB_Tree::Tree<KeyTy>>;
+using SetFixture = Fixture<std::set<KeyTy>>;
+
+template <typename ContainerTy> void BM_Insert(benchmark::State &state) {
+  auto workload = makeWorkload(sizeArg(state), distributionArg(state));
+
+  for (auto _ : state) {
+    ContainerTy container;
+    for (KeyTy key : workload.keys)
+      container.insert(key);
+    benchmark::DoNotOptimize(container);
+  }
+  state.SetItemsProcessed(state.iterations() * workload.keys.size());
+}
+
+void BM_TreeLowerBound(benchmark::State &state) {
+  auto &fixture = TreeFixture::get(state);
+  std::size_t i = 0;
+  for (auto _ : state)
+    benchmark::DoNotOptimize(
+        fixture.container.lowerBound(fixture.workload.probes[i++ % PROBES]));
+  state.SetItemsProcessed(state.iterations());
+}
+
+void BM_SetLowerBound(benchmark::State &state) {
+  auto &fixture = SetFixture::get(state);
+  std::size_t i = 0;
+  for (auto _ : state)
+    benchmark::DoNotOptimize(
+        fixture.container.lower_bound(fixture.workload.probes[i++ % PROBES]));
+  state.SetItemsProcessed(state.iterations());
+}
+
+void BM_TreeUpperBound(benchmark::State &state) {
+  auto &fixture = TreeFixture::get(state);
+  std::size_t i = 0;
+  for (auto _ : state)
+    benchmark::DoNotOptimize(
+        fixture.container.upperBound(fixture.workload.probes[i++ % PROBES]));
+  state.SetItemsProcessed(state.iterations());
+}
+
+void BM_SetUpperBound(benchmark::State &state) {
+  auto &fixture = SetFixture::get(state);
+  std::size_t i = 0;
+  for (auto _ : state)
+    benchmark::DoNotOptimize(
+        fixture.container.upper_bound(fixture.workload.probes[i++ % PROBES]));
+  state.SetItemsProcessed(state.iterations());
+}
+
+void BM_TreeGetRank(benchmark::State &state) {
+  auto &fixture = TreeFixture::get(state);
+  std::vector<std::optional<RB_Tree::NodeIt<KeyTy>>> nodes;
+  for (KeyTy probe : fixture.workload.probes)
+    nodes.push_back(fixture.container.lowerBound(probe));
+
+  std::size_t i = 0;
+  for (auto _ : state)
+    benchmark::DoNotOptimize(fixture.container.getRank(nodes[i++ % PROBES]));
+  state.SetItemsProcessed(state.iterations());
+}
+
+void BM_SetGetRank(benchmark::State &state) {
+  auto &fixture = SetFixture::get(state);
+  std::vector<std::set<KeyTy>::const_iterator> nodes;
+  for (KeyTy probe : fixture.workload.probes)
+    nodes.push_back(fixture.container.lower_bound(probe));
+
+  std::size_t i = 0;
+  for (auto _ : state)
+    benchmark::DoNotOptimize(
+        std::distance(fixture.container.begin(), nodes[i++ % PROBES]));
+  state.SetItemsProcessed(state.iterations());
+}
+
+void BM_TreeDistance(benchmark::State &state) {
+  auto &fixture = TreeFixture::get(state);
+  const auto &tree = fixture.container;
+  using It = std::optional<RB_Tree::NodeIt<KeyTy>>;
+  std::vector<std::pair<It, It>> ranges;
+  for (KeyTy probe : fixture.workload.probes)
+    ranges.emplace_back(tree.lowerBound(probe),
+                        tree.upperBound(probe + RANGE_WIDTH));
+
+  std::size_t i = 0;
+  for (auto _ : state) {
+    const auto &[first, last] = ranges[i++ % PROBES];
+    benchmark::DoNotOptimize(tree.distance(first, last));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+void BM_SetDistance(benchmark::State &state) {
+  auto &fixture = SetFixture::get(state);
+  const auto &set = fixture.container;
+  using It = std::set<KeyTy>::const_iterator;
+  std::vector<std::pair<It, It>> ranges;
+  for (KeyTy probe : fixture.workload.probes)
+    ranges.emplace_back(set.lower_bound(probe),
+                        set.upper_bound(probe + RANGE_WIDTH));
+
+  std::size_t i = 0;
+  for (auto _ : state) {
+    const auto &[first, last] = ranges[i++ % PROBES];
+    benchmark::DoNotOptimize(std::distance(first, last));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// The "q" command of the drivers: bounds, then the count between them.
+void BM_TreeQuery(benchmark::State &state) {
+  auto &fixture = TreeFixture::get(state);
+  std::size_t i = 0;
+  for (auto _ : state) {
+    KeyTy lo = fixture.workload.probes[i++ % PROBES];
+    benchmark::DoNotOptimize(
+        fixture.container.countRange(lo, lo + RANGE_WIDTH));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+void BM_SetQuery(benchmark::State &state) {
+  auto &fixture = SetFixture::get(state);
+  const auto &set = fixture.container;
+  std::size_t i = 0;
+  for (auto _ : state) {
+    KeyTy lo = fixture.workload.probes[i++ % PROBES];
+    benchmark::DoNotOptimize(
+        std::distance(set.lower_bound(lo),
+                      set.upper_bound(lo + RANGE_WIDTH)));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// The "s" command of the driver: the key of a given rank. std::set has to
+// walk to it with std::next.
+std::vector<std::size_t> probeRanks(std::size_t n) {
+  std::mt19937 rng(static_cast<unsigned>(n));
+  std::uniform_int_distribution<std::size_t> any_rank(0, n - 1);
+  std::vector<std::size_t> ranks(PROBES);
+  for (auto &rank : ranks)
+    rank = any_rank(rng);
+  return ranks;
+}
+
+void BM_TreeSelect(benchmark::State &state) {
+  auto &fixture = TreeFixture::get(state);
+  auto ranks = probeRanks(fixture.container.size());
+  std::size_t i = 0;
+  for (auto _ : state)
+    benchmark::DoNotOptimize(fixture.container.select(ranks[i++ % PROBES]));
+  state.SetItemsProcessed(state.iterations());
+}
+
+void BM_SetNext(benchmark::State &state) {
+  auto &fixture = SetFixture::get(state);
+  const auto &set = fixture.container;
+  auto ranks = probeRanks(set.size());
+  std::size_t i = 0;
+  for (auto _ : state)
+    benchmark::DoNotOptimize(*std::next(
+        set.begin(), static_cast<std::ptrdiff_t>(ranks[i++ % PROBES])));
+  state.SetItemsProcessed(state.iterations());
+}
+
+void sizesAndDistributions(benchmark::internal::Benchmark *benchmark) {
+  benchmark->ArgNames({"n", "dist"})
+      ->ArgsProduct({benchmark::CreateRange(1000, 10000000, 10),
+                     {uniform, sequential, clustered}});
+}
+} // namespace
+
+BENCHMARK(BM_Insert<RB_Tree::Tree<KeyTy>>)
+    ->Apply(sizesAndDistributions)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_Insert<std::set<KeyTy>>)
+    ->Apply(sizesAndDistributions)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_TreeLowerBound)->Apply(sizesAndDistributions);
+BENCHMARK(BM_SetLowerBound)->Apply(sizesAndDistributions);
+BENCHMARK(BM_TreeUpperBound)->Apply(sizesAndDistributions);
+BENCHMARK(BM_SetUpperBound)->Apply(sizesAndDistributions);
+BENCHMARK(BM_TreeGetRank)->Apply(sizesAndDistributions);
+BENCHMARK(BM_SetGetRank)->Apply(sizesAndDistributions);
+BENCHMARK(BM_TreeDistance)->Apply(sizesAndDistributions);
+BENCHMARK(BM_SetDistance)->Apply(sizesAndDistributions);
+BENCHMARK(BM_TreeQuery)->Apply(sizesAndDistributions);
+BENCHMARK(BM_SetQuery)->Apply(sizesAndDistributions);
+BENCHMARK(BM_TreeSelect)->Apply(sizesAndDistributions);
+BENCHMARK(BM_SetNext)->Apply(sizesAndDistributions);
+
+BENCHMARK_MAIN();